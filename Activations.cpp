@@ -0,0 +1,499 @@
+// Header guard
+#ifndef ACTIVATIONS_H
+#define ACTIVATIONS_H
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "Gemm.cpp"
+
+// Vectorized activation kernels, applied in place to contiguous floats
+// every activation is a small struct giving its function and its derivative (in terms of the function's output,
+// which is what the backward pass keeps) once for scalars, once for AVX2 and once for AVX-512 registers; map and
+// mapBackward run any of them over an array with the instruction set Gemm picked. a new activation is one more
+// struct and two one-line entry points
+//
+// tanh is a 13/6 rational approximation on [-7.9053, 7.9053] (clamped outside, where tanh rounds to +-1 within
+// the bound) and returns x itself below 4e-4. measured over every float against double-precision tanh, it is off
+// by at most TANH_MAX_ULP_SIMD = 5 units in the last place in the SIMD kernels (which use fma) and TANH_MAX_ULP = 7
+// in the scalar fallback. exp (used by softmax) is the Cephes range reduction with a degree 5 polynomial, at most
+// EXP_MAX_ULP off. activation_test.cpp checks both bounds under every instruction set
+// setExact(true), or building with NN_EXACT_ACTIVATIONS, makes every kernel call libm instead
+class Activations
+{
+public:
+    static const int TANH_MAX_ULP = 7;
+    static const int TANH_MAX_ULP_SIMD = 5;
+    static const int EXP_MAX_ULP = 1;
+
+    static bool &exact()
+    {
+#ifdef NN_EXACT_ACTIVATIONS
+        static bool value = true;
+#else
+        static bool value = false;
+#endif
+        return value;
+    }
+
+    static void setExact(bool enabled)
+    {
+        exact() = enabled;
+    }
+
+    struct Tanh
+    {
+        static float exact(float x)
+        {
+            return std::tanh(x);
+        }
+
+        static float forward(float x)
+        {
+            float clamped = std::min(std::max(x, -CLAMP), CLAMP);
+            float x2 = clamped * clamped;
+            float p = ALPHA[0];
+            for (int i = 1; i < 7; i++)
+            {
+                p = p * x2 + ALPHA[i];
+            }
+            float q = BETA[0];
+            for (int i = 1; i < 4; i++)
+            {
+                q = q * x2 + BETA[i];
+            }
+            return std::fabs(x) < TINY ? x : clamped * p / q;
+        }
+
+        static float derivative(float y)
+        {
+            return 1 - y * y;
+        }
+
+#ifdef GEMM_X86
+        __attribute__((target("avx2,fma"))) static __m256 forward(__m256 x)
+        {
+            // x second: min & max return their second operand for a NaN, which then propagates like std::min/max
+            __m256 clamped = _mm256_min_ps(_mm256_set1_ps(CLAMP), _mm256_max_ps(_mm256_set1_ps(-CLAMP), x));
+            __m256 x2 = _mm256_mul_ps(clamped, clamped);
+            __m256 p = _mm256_set1_ps(ALPHA[0]);
+            for (int i = 1; i < 7; i++)
+            {
+                p = _mm256_fmadd_ps(p, x2, _mm256_set1_ps(ALPHA[i]));
+            }
+            __m256 q = _mm256_set1_ps(BETA[0]);
+            for (int i = 1; i < 4; i++)
+            {
+                q = _mm256_fmadd_ps(q, x2, _mm256_set1_ps(BETA[i]));
+            }
+            __m256 result = _mm256_div_ps(_mm256_mul_ps(clamped, p), q);
+            __m256 absolute = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+            return _mm256_blendv_ps(result, x, _mm256_cmp_ps(absolute, _mm256_set1_ps(TINY), _CMP_LT_OQ));
+        }
+
+        __attribute__((target("avx2,fma"))) static __m256 derivative(__m256 y)
+        {
+            return _mm256_fnmadd_ps(y, y, _mm256_set1_ps(1.0f));
+        }
+
+        __attribute__((target("avx512f"))) static __m512 forward(__m512 x)
+        {
+            __m512 clamped = _mm512_min_ps(_mm512_set1_ps(CLAMP), _mm512_max_ps(_mm512_set1_ps(-CLAMP), x));
+            __m512 x2 = _mm512_mul_ps(clamped, clamped);
+            __m512 p = _mm512_set1_ps(ALPHA[0]);
+            for (int i = 1; i < 7; i++)
+            {
+                p = _mm512_fmadd_ps(p, x2, _mm512_set1_ps(ALPHA[i]));
+            }
+            __m512 q = _mm512_set1_ps(BETA[0]);
+            for (int i = 1; i < 4; i++)
+            {
+                q = _mm512_fmadd_ps(q, x2, _mm512_set1_ps(BETA[i]));
+            }
+            __m512 result = _mm512_div_ps(_mm512_mul_ps(clamped, p), q);
+            __mmask16 tiny = _mm512_cmp_ps_mask(_mm512_abs_ps(x), _mm512_set1_ps(TINY), _CMP_LT_OQ);
+            return _mm512_mask_blend_ps(tiny, result, x);
+        }
+
+        __attribute__((target("avx512f"))) static __m512 derivative(__m512 y)
+        {
+            return _mm512_fnmadd_ps(y, y, _mm512_set1_ps(1.0f));
+        }
+#endif
+
+        static constexpr float CLAMP = 7.90531110763549805f;
+        static constexpr float TINY = 0.0004f;
+        // numerator coefficients from x^13 down to x^1, denominator from x^6 down to x^0 (in powers of x^2)
+        static constexpr float ALPHA[7] = {-2.76076847742355e-16f, 2.00018790482477e-13f, -8.60467152213735e-11f, 5.12229709037114e-08f,
+                                           1.48572235717979e-05f, 6.37261928875436e-04f, 4.89352455891786e-03f};
+        static constexpr float BETA[4] = {1.19825839466702e-06f, 1.18534705686654e-04f, 2.26843463243900e-03f, 4.89352518554385e-03f};
+    };
+
+    // 1 / (1 + e^-x), computed as (1 + tanh(x / 2)) / 2
+    struct Sigmoid
+    {
+        static float exact(float x)
+        {
+            return 1 / (1 + std::exp(-x));
+        }
+
+        static float forward(float x)
+        {
+            return 0.5f * Tanh::forward(0.5f * x) + 0.5f;
+        }
+
+        static float derivative(float y)
+        {
+            return y * (1 - y);
+        }
+
+#ifdef GEMM_X86
+        __attribute__((target("avx2,fma"))) static __m256 forward(__m256 x)
+        {
+            __m256 half = _mm256_set1_ps(0.5f);
+            return _mm256_fmadd_ps(half, Tanh::forward(_mm256_mul_ps(half, x)), half);
+        }
+
+        __attribute__((target("avx2,fma"))) static __m256 derivative(__m256 y)
+        {
+            return _mm256_mul_ps(y, _mm256_sub_ps(_mm256_set1_ps(1.0f), y));
+        }
+
+        __attribute__((target("avx512f"))) static __m512 forward(__m512 x)
+        {
+            __m512 half = _mm512_set1_ps(0.5f);
+            return _mm512_fmadd_ps(half, Tanh::forward(_mm512_mul_ps(half, x)), half);
+        }
+
+        __attribute__((target("avx512f"))) static __m512 derivative(__m512 y)
+        {
+            return _mm512_mul_ps(y, _mm512_sub_ps(_mm512_set1_ps(1.0f), y));
+        }
+#endif
+    };
+
+    struct Relu
+    {
+        static float exact(float x)
+        {
+            return forward(x);
+        }
+
+        static float forward(float x)
+        {
+            return x > 0 ? x : 0.0f;
+        }
+
+        static float derivative(float y)
+        {
+            return y > 0 ? 1.0f : 0.0f;
+        }
+
+#ifdef GEMM_X86
+        __attribute__((target("avx2,fma"))) static __m256 forward(__m256 x)
+        {
+            return _mm256_max_ps(x, _mm256_setzero_ps());
+        }
+
+        __attribute__((target("avx2,fma"))) static __m256 derivative(__m256 y)
+        {
+            return _mm256_and_ps(_mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_GT_OQ), _mm256_set1_ps(1.0f));
+        }
+
+        __attribute__((target("avx512f"))) static __m512 forward(__m512 x)
+        {
+            return _mm512_max_ps(x, _mm512_setzero_ps());
+        }
+
+        __attribute__((target("avx512f"))) static __m512 derivative(__m512 y)
+        {
+            return _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(y, _mm512_setzero_ps(), _CMP_GT_OQ), _mm512_set1_ps(1.0f));
+        }
+#endif
+    };
+
+    // e^x, only a forward for softmax
+    struct Exp
+    {
+        static float exact(float x)
+        {
+            return std::exp(x);
+        }
+
+        static float forward(float x)
+        {
+            x = std::min(std::max(x, LOWEST), HIGHEST);
+            float n = std::nearbyint(x * LOG2E);
+            float r = x - n * LN2_HIGH - n * LN2_LOW;
+            float p = P[0];
+            for (int i = 1; i < 6; i++)
+            {
+                p = p * r + P[i];
+            }
+            return scale(p * r * r + r + 1, (int)n);
+        }
+
+#ifdef GEMM_X86
+        __attribute__((target("avx2,fma"))) static __m256 forward(__m256 x)
+        {
+            // x second so a NaN stays NaN (see Tanh)
+            x = _mm256_min_ps(_mm256_set1_ps(HIGHEST), _mm256_max_ps(_mm256_set1_ps(LOWEST), x));
+            __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_HIGH), x);
+            r = _mm256_fnmadd_ps(n, _mm256_set1_ps(LN2_LOW), r);
+            __m256 p = _mm256_set1_ps(P[0]);
+            for (int i = 1; i < 6; i++)
+            {
+                p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(P[i]));
+            }
+            __m256 y = _mm256_add_ps(_mm256_fmadd_ps(_mm256_mul_ps(p, r), r, r), _mm256_set1_ps(1.0f));
+            __m256i exponent = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+            return _mm256_mul_ps(y, _mm256_castsi256_ps(exponent));
+        }
+
+        __attribute__((target("avx512f"))) static __m512 forward(__m512 x)
+        {
+            x = _mm512_min_ps(_mm512_set1_ps(HIGHEST), _mm512_max_ps(_mm512_set1_ps(LOWEST), x));
+            __m512 n = _mm512_roundscale_ps(_mm512_mul_ps(x, _mm512_set1_ps(LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+            __m512 r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_HIGH), x);
+            r = _mm512_fnmadd_ps(n, _mm512_set1_ps(LN2_LOW), r);
+            __m512 p = _mm512_set1_ps(P[0]);
+            for (int i = 1; i < 6; i++)
+            {
+                p = _mm512_fmadd_ps(p, r, _mm512_set1_ps(P[i]));
+            }
+            __m512 y = _mm512_add_ps(_mm512_fmadd_ps(_mm512_mul_ps(p, r), r, r), _mm512_set1_ps(1.0f));
+            __m512i exponent = _mm512_slli_epi32(_mm512_add_epi32(_mm512_cvtps_epi32(n), _mm512_set1_epi32(127)), 23);
+            return _mm512_mul_ps(y, _mm512_castsi512_ps(exponent));
+        }
+#endif
+
+        // y * 2^n for n in the normal exponent range
+        static float scale(float y, int n)
+        {
+            uint32_t bits = (uint32_t)(n + 127) << 23;
+            float power;
+            std::memcpy(&power, &bits, sizeof(power));
+            return y * power;
+        }
+
+        // the inputs are clamped to where e^x and 2^n stay normal floats
+        static constexpr float LOWEST = -87.3f;
+        static constexpr float HIGHEST = 88.3f;
+        static constexpr float LOG2E = 1.44269504088896341f;
+        static constexpr float LN2_HIGH = 0.693359375f;
+        static constexpr float LN2_LOW = -2.12194440e-4f;
+        static constexpr float P[6] = {1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f, 4.1665795894e-2f, 1.6666665459e-1f, 5.0000001201e-1f};
+    };
+
+    static float tanh(float x)
+    {
+        return exact() ? Tanh::exact(x) : Tanh::forward(x);
+    }
+
+    static void tanh(float *values, int n)
+    {
+        map<Tanh>(values, n);
+    }
+
+    // derivatives *= 1 - outputs^2, the backward pass through tanh in one fused pass
+    static void tanhBackward(const float *outputs, float *derivatives, int n)
+    {
+        mapBackward<Tanh>(outputs, derivatives, n);
+    }
+
+    static void sigmoid(float *values, int n)
+    {
+        map<Sigmoid>(values, n);
+    }
+
+    static void sigmoidBackward(const float *outputs, float *derivatives, int n)
+    {
+        mapBackward<Sigmoid>(outputs, derivatives, n);
+    }
+
+    static void relu(float *values, int n)
+    {
+        map<Relu>(values, n);
+    }
+
+    static void reluBackward(const float *outputs, float *derivatives, int n)
+    {
+        mapBackward<Relu>(outputs, derivatives, n);
+    }
+
+    // softmax of every column of a rows x columns matrix (one sample per column), in place. the columns of a row
+    // are contiguous, so the max, the exponentials and the sums are computed for a whole row of samples at a time:
+    // blocks of up to BLOCK columns keep their running maxima and sums on the stack, and every pass over the
+    // block walks its rows in order
+    static void softmax(float *values, int rows, int columns)
+    {
+        const int BLOCK = 256;
+        float largest[BLOCK];
+        float sums[BLOCK];
+        for (int begin = 0; begin < columns; begin += BLOCK)
+        {
+            int width = std::min(BLOCK, columns - begin);
+            std::copy(values + begin, values + begin + width, largest);
+            for (int i = 1; i < rows; i++)
+            {
+                const float *row = values + (size_t)i * columns + begin;
+                for (int j = 0; j < width; j++)
+                {
+                    largest[j] = std::max(largest[j], row[j]);
+                }
+            }
+            std::fill(sums, sums + width, 0.0f);
+            for (int i = 0; i < rows; i++)
+            {
+                float *row = values + (size_t)i * columns + begin;
+                for (int j = 0; j < width; j++)
+                {
+                    row[j] -= largest[j];
+                }
+                map<Exp>(row, width);
+                for (int j = 0; j < width; j++)
+                {
+                    sums[j] += row[j];
+                }
+            }
+            for (int j = 0; j < width; j++)
+            {
+                sums[j] = 1 / sums[j];
+            }
+            for (int i = 0; i < rows; i++)
+            {
+                float *row = values + (size_t)i * columns + begin;
+                for (int j = 0; j < width; j++)
+                {
+                    row[j] *= sums[j];
+                }
+            }
+        }
+    }
+
+    // values[i] = Op(values[i])
+    template <typename Op>
+    static void map(float *values, int n)
+    {
+        if (exact())
+        {
+            for (int i = 0; i < n; i++)
+            {
+                values[i] = Op::exact(values[i]);
+            }
+            return;
+        }
+#ifdef GEMM_X86
+        switch (Gemm::activeIsa())
+        {
+        case Gemm::AVX512:
+            mapAvx512<Op>(values, n);
+            return;
+        case Gemm::AVX2:
+            mapAvx2<Op>(values, n);
+            return;
+        default:
+            break;
+        }
+#endif
+        for (int i = 0; i < n; i++)
+        {
+            values[i] = Op::forward(values[i]);
+        }
+    }
+
+    // derivatives[i] *= Op'(outputs[i])
+    template <typename Op>
+    static void mapBackward(const float *outputs, float *derivatives, int n)
+    {
+#ifdef GEMM_X86
+        switch (Gemm::activeIsa())
+        {
+        case Gemm::AVX512:
+            mapBackwardAvx512<Op>(outputs, derivatives, n);
+            return;
+        case Gemm::AVX2:
+            mapBackwardAvx2<Op>(outputs, derivatives, n);
+            return;
+        default:
+            break;
+        }
+#endif
+        for (int i = 0; i < n; i++)
+        {
+            derivatives[i] *= Op::derivative(outputs[i]);
+        }
+    }
+
+private:
+#ifdef GEMM_X86
+    // the last partial vector goes through a zero-padded copy, so every entry sees the same arithmetic
+    template <typename Op>
+    __attribute__((target("avx2,fma"))) static void mapAvx2(float *values, int n)
+    {
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            _mm256_storeu_ps(values + i, Op::forward(_mm256_loadu_ps(values + i)));
+        }
+        if (i < n)
+        {
+            float tail[8] = {};
+            std::copy(values + i, values + n, tail);
+            _mm256_storeu_ps(tail, Op::forward(_mm256_loadu_ps(tail)));
+            std::copy(tail, tail + (n - i), values + i);
+        }
+    }
+
+    template <typename Op>
+    __attribute__((target("avx2,fma"))) static void mapBackwardAvx2(const float *outputs, float *derivatives, int n)
+    {
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 derivative = Op::derivative(_mm256_loadu_ps(outputs + i));
+            _mm256_storeu_ps(derivatives + i, _mm256_mul_ps(_mm256_loadu_ps(derivatives + i), derivative));
+        }
+        for (; i < n; i++)
+        {
+            derivatives[i] *= Op::derivative(outputs[i]);
+        }
+    }
+
+    template <typename Op>
+    __attribute__((target("avx512f"))) static void mapAvx512(float *values, int n)
+    {
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            _mm512_storeu_ps(values + i, Op::forward(_mm512_loadu_ps(values + i)));
+        }
+        if (i < n)
+        {
+            __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+            _mm512_mask_storeu_ps(values + i, mask, Op::forward(_mm512_maskz_loadu_ps(mask, values + i)));
+        }
+    }
+
+    template <typename Op>
+    __attribute__((target("avx512f"))) static void mapBackwardAvx512(const float *outputs, float *derivatives, int n)
+    {
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            __m512 derivative = Op::derivative(_mm512_loadu_ps(outputs + i));
+            _mm512_storeu_ps(derivatives + i, _mm512_mul_ps(_mm512_loadu_ps(derivatives + i), derivative));
+        }
+        if (i < n)
+        {
+            __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+            __m512 derivative = Op::derivative(_mm512_maskz_loadu_ps(mask, outputs + i));
+            _mm512_mask_storeu_ps(derivatives + i, mask, _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, derivatives + i), derivative));
+        }
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,97 @@
+// Header guard
+#ifndef ALLOCATION_COUNTER_H
+#define ALLOCATION_COUNTER_H
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Test hook counting heap allocations
+// when built with NN_COUNT_ALLOCATIONS the global operator new is replaced so that every call is counted, e.g. to
+// check that a planned training step allocates nothing. The replacement is defined here, so this file must end up
+// in only one translation unit of a program (like every executable of this project)
+class AllocationCounter
+{
+public:
+    static std::atomic<long> &counter()
+    {
+        static std::atomic<long> noAllocations(0);
+        return noAllocations;
+    }
+
+    // the calling thread's own count, which needs no synchronization (e.g. for per-thread profiles)
+    static long &threadCounter()
+    {
+        thread_local long noAllocations = 0;
+        return noAllocations;
+    }
+
+    // number of allocations so far, always 0 if counting is compiled out
+    static long count()
+    {
+        return counter().load(std::memory_order_relaxed);
+    }
+
+    static long threadCount()
+    {
+        return threadCounter();
+    }
+
+    static bool enabled()
+    {
+#ifdef NN_COUNT_ALLOCATIONS
+        return true;
+#else
+        return false;
+#endif
+    }
+};
+
+#ifdef NN_COUNT_ALLOCATIONS
+// GCC flags the free below as mismatched with the new it is paired with once both are inlined, but both are these
+// replacements, which allocate with malloc
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void *operator new(std::size_t size)
+{
+    AllocationCounter::counter().fetch_add(1, std::memory_order_relaxed);
+    AllocationCounter::threadCounter()++;
+    if (void *pointer = std::malloc(size == 0 ? 1 : size))
+    {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, std::size_t) noexcept
+{
+    std::free(pointer);
+}
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+#endif
+
+#endif
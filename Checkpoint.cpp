@@ -0,0 +1,370 @@
+// Header guard
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Network.cpp"
+
+// Binary model checkpoint
+// layout: the 64-byte header, a table of tensor records, then the float data of every tensor, each 64-byte aligned
+// so a mapped checkpoint can hand out its tensors as views. besides the weights & biases of every layer a checkpoint
+// carries the state of the network's optimizer, and may carry extra per-layer tensors, to resume training
+struct CheckpointHeader
+{
+    static const uint32_t MAGIC = 0x4b434e4e; // "NNCK"
+    static const uint32_t VERSION = 1;
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t noLayers;
+    uint32_t noTensors;
+    uint64_t fileSize;
+    uint8_t reserved[40];
+};
+
+static_assert(sizeof(CheckpointHeader) == 64, "the checkpoint header must stay 64 bytes");
+
+struct CheckpointRecord
+{
+    // what a tensor holds, anything from STATE up is free for optimizers to number their tensors
+    enum Kind : uint32_t
+    {
+        WEIGHTS = 0,
+        BIASES = 1,
+        STATE = 2
+    };
+
+    uint32_t layer;
+    uint32_t kind;
+    uint32_t noRows;
+    uint32_t noColumns;
+    uint64_t offset; // from the start of the file
+};
+
+// an extra tensor to store with the model
+struct CheckpointTensor
+{
+    int layer;
+    int kind;
+    MatrixView<const float> values;
+};
+
+// Read-only, shared memory mapping of a checkpoint. the tensors are views into the mapping, so every process that
+// maps the same file serves from the same physical pages and nothing is read before it is used
+class MappedCheckpoint
+{
+private:
+    const uint8_t *base = nullptr;
+    size_t length = 0;
+    const CheckpointHeader *header = nullptr;
+    const CheckpointRecord *records = nullptr;
+
+    void close()
+    {
+        if (base != nullptr)
+        {
+            munmap((void *)base, length);
+        }
+        base = nullptr;
+        header = nullptr;
+        records = nullptr;
+        length = 0;
+    }
+
+public:
+    MappedCheckpoint() {}
+
+    MappedCheckpoint(const MappedCheckpoint &) = delete;
+    MappedCheckpoint &operator=(const MappedCheckpoint &) = delete;
+
+    ~MappedCheckpoint()
+    {
+        close();
+    }
+
+    // map the file, false if it is missing, truncated or not a checkpoint of this version
+    bool open(const std::string &fileName)
+    {
+        close();
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(CheckpointHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping keeps the file alive
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        base = (const uint8_t *)mapping;
+        length = info.st_size;
+        header = (const CheckpointHeader *)base;
+        records = (const CheckpointRecord *)(base + sizeof(CheckpointHeader));
+        if (header->magic != CheckpointHeader::MAGIC || header->version != CheckpointHeader::VERSION ||
+            header->fileSize != length || sizeof(CheckpointHeader) + header->noTensors * sizeof(CheckpointRecord) > length)
+        {
+            close();
+            return false;
+        }
+        for (uint32_t i = 0; i < header->noTensors; i++)
+        {
+            if (records[i].offset + (uint64_t)records[i].noRows * records[i].noColumns * sizeof(float) > length)
+            {
+                close();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    int noLayers() const
+    {
+        return header == nullptr ? 0 : (int)header->noLayers;
+    }
+
+    // the tensor of a given kind of a layer, a view with no data if the checkpoint does not have it
+    MatrixView<const float> tensor(int layer, int kind) const
+    {
+        for (uint32_t i = 0; i < header->noTensors; i++)
+        {
+            if ((int)records[i].layer == layer && (int)records[i].kind == kind)
+            {
+                return MatrixView<const float>((const float *)(base + records[i].offset), records[i].noRows, records[i].noColumns);
+            }
+        }
+        return MatrixView<const float>();
+    }
+
+    MatrixView<const float> weights(int layer) const
+    {
+        return tensor(layer, CheckpointRecord::WEIGHTS);
+    }
+
+    MatrixView<const float> biases(int layer) const
+    {
+        return tensor(layer, CheckpointRecord::BIASES);
+    }
+
+    // layer dimensions in the format of the Network constructor
+    std::vector<std::vector<int>> dimensions() const
+    {
+        std::vector<std::vector<int>> result;
+        for (int i = 0; i < noLayers(); i++)
+        {
+            result.push_back({weights(i).noColumns, weights(i).noRows});
+        }
+        return result;
+    }
+};
+
+class Checkpoint
+{
+public:
+    // the optimizer state is stored from STATE up: the method and step count on layer 0, then slot s of every
+    // layer's weights and biases (see Optimizer::getState), shaped like them. extra tensors go after these kinds
+    static const int OPTIMIZER_STEPS = CheckpointRecord::STATE;
+    static const int OPTIMIZER_SLOTS = CheckpointRecord::STATE + 1;
+    static const int EXTRA = OPTIMIZER_SLOTS + 4;
+
+    static int slotKind(int slot, bool biases)
+    {
+        return OPTIMIZER_SLOTS + 2 * slot + (biases ? 1 : 0);
+    }
+
+    // write the weights & biases of every layer, the optimizer state once the network has taken a step, and any
+    // extra tensors (kinds from EXTRA up), false if the file cannot be written
+    static bool save(const Network &network, const std::string &fileName, const std::vector<CheckpointTensor> &extra = {})
+    {
+        std::vector<CheckpointTensor> tensors;
+        const std::vector<FullyConnectedLayer> &layers = network.getLayers();
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            tensors.push_back({i, CheckpointRecord::WEIGHTS, layers[i].getWeights().view()});
+            tensors.push_back({i, CheckpointRecord::BIASES, layers[i].getBiases().view()});
+        }
+        // the step count is only a bias correction, which is 1 long before a float stops counting steps exactly
+        const Optimizer &optimizer = network.getOptimizer();
+        float steps[2] = {(float)optimizer.getSettings().method, (float)optimizer.getNoSteps()};
+        if (optimizer.getNoSteps() > 0 && optimizer.getNoTensors() == 2 * (int)layers.size())
+        {
+            tensors.push_back({0, OPTIMIZER_STEPS, MatrixView<const float>(steps, 1, 2)});
+            for (int slot = 0; slot < optimizer.getNoSlots(); slot++)
+            {
+                for (int i = 0; i < (int)layers.size(); i++)
+                {
+                    const Matrix<float> &weights = layers[i].getWeights();
+                    const Matrix<float> &biases = layers[i].getBiases();
+                    tensors.push_back({i, slotKind(slot, false), MatrixView<const float>(optimizer.getState(2 * i, slot), weights.noRows, weights.noColumns)});
+                    tensors.push_back({i, slotKind(slot, true), MatrixView<const float>(optimizer.getState(2 * i + 1, slot), biases.noRows, biases.noColumns)});
+                }
+            }
+        }
+        tensors.insert(tensors.end(), extra.begin(), extra.end());
+
+        CheckpointHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic = CheckpointHeader::MAGIC;
+        header.version = CheckpointHeader::VERSION;
+        header.noLayers = (uint32_t)layers.size();
+        header.noTensors = (uint32_t)tensors.size();
+
+        std::vector<CheckpointRecord> records;
+        uint64_t offset = align(sizeof(CheckpointHeader) + tensors.size() * sizeof(CheckpointRecord));
+        for (const CheckpointTensor &tensor : tensors)
+        {
+            records.push_back({(uint32_t)tensor.layer, (uint32_t)tensor.kind, (uint32_t)tensor.values.noRows, (uint32_t)tensor.values.noColumns, offset});
+            offset = align(offset + tensor.values.size() * sizeof(float));
+        }
+        header.fileSize = offset;
+
+        // write to a temporary file and rename it, so processes mapping the old checkpoint never see a partial one
+        std::string temporaryName = fileName + ".tmp";
+        std::ofstream file(temporaryName, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        file.write((const char *)&header, sizeof(header));
+        file.write((const char *)records.data(), records.size() * sizeof(CheckpointRecord));
+        for (int i = 0; i < (int)tensors.size(); i++)
+        {
+            pad(file, records[i].offset);
+            file.write((const char *)tensors[i].values.data, tensors[i].values.size() * sizeof(float));
+        }
+        pad(file, header.fileSize);
+        file.close();
+        if (file.fail())
+        {
+            return false;
+        }
+        return std::rename(temporaryName.c_str(), fileName.c_str()) == 0;
+    }
+
+    // copy the weights & biases of a checkpoint into a network of the same architecture, e.g. to resume training,
+    // and the optimizer state if the checkpoint has one of the network's optimizer method. the network keeps
+    // everything else (optimizer settings, precision, topology, activation budget), and an optimizer whose state
+    // is not in the checkpoint starts afresh. false, leaving the network untouched, if the file is missing or holds
+    // another architecture
+    static bool load(const std::string &fileName, Network &network)
+    {
+        MappedCheckpoint checkpoint;
+        if (!checkpoint.open(fileName))
+        {
+            return false;
+        }
+        return load(checkpoint, network);
+    }
+
+    static bool load(const MappedCheckpoint &checkpoint, Network &network)
+    {
+        if (!matches(checkpoint, network))
+        {
+            return false;
+        }
+        for (int i = 0; i < checkpoint.noLayers(); i++)
+        {
+            network.setLayerParameters(i, checkpoint.weights(i), checkpoint.biases(i));
+        }
+        loadOptimizerState(checkpoint, network);
+        return true;
+    }
+
+    // whether every layer of the checkpoint has weights & biases shaped like the network's layer, which also makes
+    // each layer's outputs the next one's inputs
+    static bool matches(const MappedCheckpoint &checkpoint, const Network &network)
+    {
+        const std::vector<FullyConnectedLayer> &layers = network.getLayers();
+        std::vector<std::vector<int>> dimensions = checkpoint.dimensions();
+        if ((int)dimensions.size() != (int)layers.size())
+        {
+            return false;
+        }
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            if (dimensions[i][0] != layers[i].getNoInputNodes() || dimensions[i][1] != layers[i].getNoOutputNodes() ||
+                (i > 0 && dimensions[i][0] != dimensions[i - 1][1]))
+            {
+                return false;
+            }
+            MatrixView<const float> biases = checkpoint.biases(i);
+            if (biases.noRows != layers[i].getNoOutputNodes() || biases.noColumns != 1)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    // the saved step count and every slot of every tensor, if they are there in the shapes of the network's layers
+    // and were saved by the same optimizer method
+    static void loadOptimizerState(const MappedCheckpoint &checkpoint, Network &network)
+    {
+        Optimizer &optimizer = network.prepareOptimizer();
+        MatrixView<const float> steps = checkpoint.tensor(0, OPTIMIZER_STEPS);
+        if (steps.size() != 2 || steps.data[0] != (float)optimizer.getSettings().method)
+        {
+            return;
+        }
+        const std::vector<FullyConnectedLayer> &layers = network.getLayers();
+        for (int slot = 0; slot < optimizer.getNoSlots(); slot++)
+        {
+            for (int i = 0; i < (int)layers.size(); i++)
+            {
+                MatrixView<const float> weights = checkpoint.tensor(i, slotKind(slot, false));
+                MatrixView<const float> biases = checkpoint.tensor(i, slotKind(slot, true));
+                if (weights.noRows != layers[i].getWeights().noRows || weights.noColumns != layers[i].getWeights().noColumns ||
+                    biases.noRows != layers[i].getBiases().noRows || biases.noColumns != layers[i].getBiases().noColumns)
+                {
+                    return;
+                }
+            }
+        }
+
+        optimizer.planState();
+        for (int slot = 0; slot < optimizer.getNoSlots(); slot++)
+        {
+            for (int i = 0; i < (int)layers.size(); i++)
+            {
+                MatrixView<const float> weights = checkpoint.tensor(i, slotKind(slot, false));
+                MatrixView<const float> biases = checkpoint.tensor(i, slotKind(slot, true));
+                std::copy(weights.data, weights.data + weights.size(), optimizer.getState(2 * i, slot));
+                std::copy(biases.data, biases.data + biases.size(), optimizer.getState(2 * i + 1, slot));
+            }
+        }
+        optimizer.setNoSteps((long)steps.data[1]);
+    }
+
+    static uint64_t align(uint64_t offset)
+    {
+        return (offset + 63) / 64 * 64;
+    }
+
+    static void pad(std::ofstream &file, uint64_t offset)
+    {
+        static const char zeros[64] = {};
+        uint64_t position = (uint64_t)file.tellp();
+        file.write(zeros, offset - position);
+    }
+};
+
+#endif
@@ -0,0 +1,175 @@
+// Header guard
+#ifndef CHECKPOINTING_H
+#define CHECKPOINTING_H
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstddef>
+
+// Which layer outputs a training step keeps from its forward pass for the backward pass (the checkpoints)
+// the outputs in between are dropped and, when the backward pass gets down to them, recomputed segment by segment
+// from the checkpoint below (or the batch input), all segments sharing the buffers of the largest one
+struct CheckpointPlan
+{
+    std::vector<char> kept;     // per layer, the last layer is always kept
+    size_t activationBytes = 0; // kept outputs plus the buffers of the largest segment
+    double recomputeCost = 0;   // summed cost of the layers forwarded twice per step
+    bool fits = true;           // false if even the smallest plan is over the budget it was made for
+
+    bool isKept(int layer) const
+    {
+        return kept.empty() || kept[layer];
+    }
+
+    int noKept() const
+    {
+        return (int)std::count(kept.begin(), kept.end(), 1);
+    }
+
+    // e.g. "4/12 layer outputs kept (1 3 7 11), 1.5 MB of activations"
+    std::string toString() const
+    {
+        std::string layers;
+        for (int i = 0; i < (int)kept.size(); i++)
+        {
+            if (kept[i])
+            {
+                layers += (layers.empty() ? "" : " ") + std::to_string(i);
+            }
+        }
+        return std::to_string(noKept()) + "/" + std::to_string(kept.size()) + " layer outputs kept (" + layers + "), " +
+               std::to_string(activationBytes / 1e6) + " MB of activations" + (fits ? "" : " (over budget)");
+    }
+};
+
+// Picks the checkpoints of a stack of layers from a memory budget
+// a cap on the bytes of a recomputed segment bounds the shared buffers; for every cap worth trying the cheapest
+// checkpoints (fewest bytes kept, then least recomputed) come from a dynamic program over the layers, and the plan
+// that fits the budget with the least recomputation wins. for L equally wide layers that lands on the familiar
+// sqrt(L) segments of sqrt(L) layers when the budget is about 2 sqrt(L) outputs
+class CheckpointPlanner
+{
+public:
+    // bytes[i]: layer i's output for one batch, cost[i]: the work of computing it again (e.g. its multiply-adds)
+    // budget 0 means no limit, everything is kept
+    static CheckpointPlan plan(const std::vector<size_t> &bytes, const std::vector<double> &cost, size_t budget)
+    {
+        int noLayers = (int)bytes.size();
+        CheckpointPlan keepAll;
+        keepAll.kept.assign(noLayers, 1);
+        for (size_t b : bytes)
+        {
+            keepAll.activationBytes += b;
+        }
+        if (budget == 0 || keepAll.activationBytes <= budget || noLayers < 2)
+        {
+            keepAll.fits = budget == 0 || keepAll.activationBytes <= budget;
+            return keepAll;
+        }
+
+        // every run of consecutive layers below the last is a possible largest segment
+        std::vector<size_t> caps;
+        for (int begin = 0; begin + 1 < noLayers; begin++)
+        {
+            size_t sum = 0;
+            for (int end = begin; end + 1 < noLayers; end++)
+            {
+                sum += bytes[end];
+                caps.push_back(sum);
+            }
+        }
+        std::sort(caps.begin(), caps.end());
+        caps.erase(std::unique(caps.begin(), caps.end()), caps.end());
+
+        CheckpointPlan best = keepAll;
+        best.fits = false;
+        for (size_t cap : caps)
+        {
+            CheckpointPlan candidate = planForCap(bytes, cost, cap);
+            candidate.fits = candidate.activationBytes <= budget;
+            if (better(candidate, best))
+            {
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+private:
+    // fitting beats not fitting; among plans that fit the least recomputation, otherwise the fewest bytes
+    static bool better(const CheckpointPlan &a, const CheckpointPlan &b)
+    {
+        if (a.fits != b.fits)
+        {
+            return a.fits;
+        }
+        if (a.fits && a.recomputeCost != b.recomputeCost)
+        {
+            return a.recomputeCost < b.recomputeCost;
+        }
+        return a.activationBytes < b.activationBytes;
+    }
+
+    // the fewest bytes of checkpoints leaving no segment over cap bytes, ties going to less recomputation
+    // position p of the program is the output of layer p - 1, position 0 the batch input (kept anyway, free)
+    // the topmost segment is never recomputed: it is still in the shared buffers when the backward pass starts
+    static CheckpointPlan planForCap(const std::vector<size_t> &bytes, const std::vector<double> &cost, size_t cap)
+    {
+        int noLayers = (int)bytes.size();
+        const size_t NONE = (size_t)-1;
+        std::vector<size_t> keptBytes(noLayers + 1, NONE);
+        std::vector<double> recompute(noLayers + 1, 0);
+        std::vector<int> previous(noLayers + 1, -1);
+        keptBytes[0] = 0;
+        for (int p = 1; p <= noLayers; p++)
+        {
+            size_t segment = 0;
+            double segmentCost = 0;
+            // q is the checkpoint below, the layers q .. p - 2 in between are dropped
+            for (int q = p - 1; q >= 0; q--)
+            {
+                if (q < p - 1)
+                {
+                    segment += bytes[q];
+                    segmentCost += cost[q];
+                }
+                if (segment > cap)
+                {
+                    break;
+                }
+                if (keptBytes[q] == NONE)
+                {
+                    continue;
+                }
+                size_t total = keptBytes[q] + bytes[p - 1];
+                double totalCost = recompute[q] + (p == noLayers ? 0 : segmentCost);
+                if (total < keptBytes[p] || (total == keptBytes[p] && totalCost < recompute[p]))
+                {
+                    keptBytes[p] = total;
+                    recompute[p] = totalCost;
+                    previous[p] = q;
+                }
+            }
+        }
+
+        CheckpointPlan plan;
+        plan.kept.assign(noLayers, 0);
+        plan.recomputeCost = recompute[noLayers];
+        size_t largest = 0;
+        for (int p = noLayers; p > 0; p = previous[p])
+        {
+            plan.kept[p - 1] = 1;
+            size_t segment = 0;
+            for (int i = previous[p]; i < p - 1; i++)
+            {
+                segment += bytes[i];
+            }
+            largest = std::max(largest, segment);
+        }
+        plan.activationBytes = keptBytes[noLayers] + largest;
+        return plan;
+    }
+};
+
+#endif
@@ -0,0 +1,446 @@
+// Header guard
+#ifndef COLLECTIVE_H
+#define COLLECTIVE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Profiler.cpp"
+
+// Communication between the ranks 0 .. size() - 1 of a data-parallel training job (one process each)
+// the collectives below only need two primitives, so another backend (e.g. TCP over loopback) is one more subclass
+class Transport
+{
+public:
+    virtual ~Transport() {}
+
+    virtual int rank() const = 0;
+    virtual int size() const = 0;
+
+    // send sendCount floats to rank 'to' while receiving receiveCount floats from rank 'from', returning once both
+    // are done. both directions make progress together, so every rank of a ring can exchange at the same time
+    // without deadlocking however long the messages are. either count may be 0
+    virtual void exchange(int to, const float *send, size_t sendCount, int from, float *receive, size_t receiveCount) = 0;
+
+    // wait until every rank has called barrier()
+    virtual void barrier() = 0;
+};
+
+// Transport between processes on one host through a POSIX shared memory segment
+// the segment holds one single-producer single-consumer ring of floats per ordered pair of ranks, of which a ring
+// all-reduce only ever touches size() (the rest is never paged in), and a barrier. ranks wait by spinning on the
+// ring counters and yielding, which keeps the latency of the small messages of a training step low
+class SharedMemoryTransport : public Transport
+{
+private:
+    static const uint32_t MAGIC = 0x52414e4e; // "NNAR"
+
+    struct Header
+    {
+        std::atomic<uint32_t> magic; // set last by rank 0, once the segment is initialized
+        uint32_t size;
+        uint64_t channelCapacity; // floats per ring
+        std::atomic<uint32_t> noAttached;
+        std::atomic<uint32_t> noArrived; // barrier
+        std::atomic<uint32_t> generation;
+    };
+
+    // head and tail count every float ever written and read, on separate cache lines since different ranks write them
+    struct Channel
+    {
+        alignas(64) std::atomic<uint64_t> head;
+        alignas(64) std::atomic<uint64_t> tail;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "the rings need lock-free atomics to be shared between processes");
+
+    uint8_t *base = nullptr;
+    size_t length = 0;
+    Header *header = nullptr;
+    int myRank = 0;
+    int noRanks = 1;
+    size_t capacity = 0;
+    size_t channelStride = 0;
+
+    static size_t align(size_t offset)
+    {
+        return (offset + 63) / 64 * 64;
+    }
+
+    Channel &channel(int from, int to)
+    {
+        return *(Channel *)(base + align(sizeof(Header)) + ((size_t)from * noRanks + to) * channelStride);
+    }
+
+    float *channelData(int from, int to)
+    {
+        return (float *)((uint8_t *)&channel(from, to) + sizeof(Channel));
+    }
+
+    static void pause(int &noIdle)
+    {
+        if (++noIdle > 64)
+        {
+            sched_yield();
+        }
+    }
+
+    void close()
+    {
+        if (base != nullptr)
+        {
+            munmap(base, length);
+        }
+        base = nullptr;
+        header = nullptr;
+        length = 0;
+    }
+
+public:
+    SharedMemoryTransport() {}
+
+    SharedMemoryTransport(const SharedMemoryTransport &) = delete;
+    SharedMemoryTransport &operator=(const SharedMemoryTransport &) = delete;
+
+    ~SharedMemoryTransport()
+    {
+        close();
+    }
+
+    // join the job 'name' as rank of size ranks. the name must be unique to the job, e.g. "/nn-train-" followed by
+    // the pid of the process that launched it. rank 0 creates the segment, the others wait for
+    // it for up to timeoutSeconds. returns once every rank has joined, at which point the name is unlinked again so
+    // nothing is left behind however the job ends. false if the segment cannot be created or joined in time
+    bool open(const std::string &name, int rank, int size, size_t channelCapacity = 1 << 16, double timeoutSeconds = 30)
+    {
+        close();
+        myRank = rank;
+        noRanks = size;
+        capacity = channelCapacity;
+        channelStride = align(sizeof(Channel) + capacity * sizeof(float));
+        length = align(sizeof(Header)) + (size_t)size * size * channelStride;
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+
+        int fd;
+        if (rank == 0)
+        {
+            shm_unlink(name.c_str()); // a segment left over by a crashed job
+            fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd < 0 || ftruncate(fd, length) != 0)
+            {
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+                return false;
+            }
+        }
+        else
+        {
+            // wait until rank 0 has created and sized the segment
+            while (true)
+            {
+                fd = shm_open(name.c_str(), O_RDWR, 0600);
+                struct stat info;
+                if (fd >= 0 && fstat(fd, &info) == 0 && (size_t)info.st_size == length)
+                {
+                    break;
+                }
+                if (fd >= 0)
+                {
+                    ::close(fd);
+                }
+                if (std::chrono::steady_clock::now() > deadline)
+                {
+                    return false;
+                }
+                usleep(1000);
+            }
+        }
+        void *mapping = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping keeps the segment alive
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        base = (uint8_t *)mapping;
+        header = (Header *)base;
+
+        // a fresh segment is all zeros, which is a valid state for every counter
+        if (rank == 0)
+        {
+            header->size = (uint32_t)size;
+            header->channelCapacity = capacity;
+            header->magic.store(MAGIC, std::memory_order_release);
+        }
+        while (header->magic.load(std::memory_order_acquire) != MAGIC)
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                close();
+                return false;
+            }
+            usleep(1000);
+        }
+        if (header->size != (uint32_t)size || header->channelCapacity != capacity)
+        {
+            close();
+            return false;
+        }
+
+        header->noAttached.fetch_add(1, std::memory_order_acq_rel);
+        while (header->noAttached.load(std::memory_order_acquire) < (uint32_t)size)
+        {
+            if (std::chrono::steady_clock::now() > deadline)
+            {
+                close();
+                return false;
+            }
+            usleep(1000);
+        }
+        if (rank == 0)
+        {
+            shm_unlink(name.c_str());
+        }
+        return true;
+    }
+
+    int rank() const override
+    {
+        return myRank;
+    }
+
+    int size() const override
+    {
+        return noRanks;
+    }
+
+    void exchange(int to, const float *send, size_t sendCount, int from, float *receive, size_t receiveCount) override
+    {
+        Channel &out = channel(myRank, to);
+        Channel &in = channel(from, myRank);
+        float *outData = channelData(myRank, to);
+        const float *inData = channelData(from, myRank);
+        size_t sent = 0;
+        size_t received = 0;
+        int noIdle = 0;
+        while (sent < sendCount || received < receiveCount)
+        {
+            bool progress = false;
+            if (sent < sendCount)
+            {
+                uint64_t head = out.head.load(std::memory_order_relaxed);
+                size_t space = capacity - (size_t)(head - out.tail.load(std::memory_order_acquire));
+                size_t n = std::min(space, sendCount - sent);
+                if (n > 0)
+                {
+                    // the free space may wrap around the end of the ring
+                    size_t position = head % capacity;
+                    size_t first = std::min(n, capacity - position);
+                    std::memcpy(outData + position, send + sent, first * sizeof(float));
+                    std::memcpy(outData, send + sent + first, (n - first) * sizeof(float));
+                    out.head.store(head + n, std::memory_order_release);
+                    sent += n;
+                    progress = true;
+                }
+            }
+            if (received < receiveCount)
+            {
+                uint64_t tail = in.tail.load(std::memory_order_relaxed);
+                size_t available = (size_t)(in.head.load(std::memory_order_acquire) - tail);
+                size_t n = std::min(available, receiveCount - received);
+                if (n > 0)
+                {
+                    size_t position = tail % capacity;
+                    size_t first = std::min(n, capacity - position);
+                    std::memcpy(receive + received, inData + position, first * sizeof(float));
+                    std::memcpy(receive + received + first, inData, (n - first) * sizeof(float));
+                    in.tail.store(tail + n, std::memory_order_release);
+                    received += n;
+                    progress = true;
+                }
+            }
+            if (progress)
+            {
+                noIdle = 0;
+            }
+            else
+            {
+                pause(noIdle);
+            }
+        }
+    }
+
+    // sense-reversing: the last rank to arrive resets the count and starts the next generation
+    void barrier() override
+    {
+        uint32_t generation = header->generation.load(std::memory_order_acquire);
+        if (header->noArrived.fetch_add(1, std::memory_order_acq_rel) + 1 == (uint32_t)noRanks)
+        {
+            header->noArrived.store(0, std::memory_order_relaxed);
+            header->generation.fetch_add(1, std::memory_order_release);
+            return;
+        }
+        int noIdle = 0;
+        while (header->generation.load(std::memory_order_acquire) == generation)
+        {
+            pause(noIdle);
+        }
+    }
+};
+
+// Collectives over a ring of ranks, each rank only ever talks to its two neighbours
+class RingAllReduce
+{
+private:
+    Transport &transport;
+    std::vector<float> scratch;
+
+    // [begin, end) of chunk i of count floats split into size() chunks
+    size_t chunkBegin(size_t count, int chunk) const
+    {
+        return count * chunk / transport.size();
+    }
+
+public:
+    explicit RingAllReduce(Transport &_transport) : transport(_transport) {}
+
+    // replace data on every rank by its sum over all ranks
+    // reduce-scatter: after size() - 1 steps rank r holds the total of chunk r + 1, every step adding the chunk
+    // received from the previous rank into its own. all-gather: size() - 1 more steps pass the totals around.
+    // every rank sends and receives 2 (size() - 1) / size() of the data, whatever the number of ranks, and every
+    // chunk is added up in the same order for everyone, so all ranks end with bit-identical results
+    void sum(float *data, size_t count)
+    {
+        int noRanks = transport.size();
+        if (noRanks == 1)
+        {
+            return;
+        }
+        NN_PROFILE_SCOPE("collective.allReduce", (double)count * (noRanks - 1) / noRanks, 2.0 * sizeof(float) * count * (noRanks - 1) / noRanks);
+        int rank = transport.rank();
+        int next = (rank + 1) % noRanks;
+        int previous = (rank + noRanks - 1) % noRanks;
+        scratch.resize(count / noRanks + 1);
+        for (int step = 0; step < noRanks - 1; step++)
+        {
+            int sendChunk = (rank - step + noRanks) % noRanks;
+            int receiveChunk = (rank - step - 1 + 2 * noRanks) % noRanks;
+            size_t sendBegin = chunkBegin(count, sendChunk);
+            size_t receiveBegin = chunkBegin(count, receiveChunk);
+            size_t receiveCount = chunkBegin(count, receiveChunk + 1) - receiveBegin;
+            transport.exchange(next, data + sendBegin, chunkBegin(count, sendChunk + 1) - sendBegin, previous, scratch.data(), receiveCount);
+            for (size_t i = 0; i < receiveCount; i++)
+            {
+                data[receiveBegin + i] += scratch[i];
+            }
+        }
+        for (int step = 0; step < noRanks - 1; step++)
+        {
+            int sendChunk = (rank - step + 1 + noRanks) % noRanks;
+            int receiveChunk = (rank - step + noRanks) % noRanks;
+            size_t sendBegin = chunkBegin(count, sendChunk);
+            size_t receiveBegin = chunkBegin(count, receiveChunk);
+            transport.exchange(next, data + sendBegin, chunkBegin(count, sendChunk + 1) - sendBegin, previous, data + receiveBegin,
+                               chunkBegin(count, receiveChunk + 1) - receiveBegin);
+        }
+    }
+
+    // replace data on every rank by its mean over all ranks
+    void average(float *data, size_t count)
+    {
+        sum(data, count);
+        float scale = 1.0f / (float)transport.size();
+        for (size_t i = 0; i < count; i++)
+        {
+            data[i] *= scale;
+        }
+    }
+
+    // copy data of rank root to every other rank, handed along the ring
+    void broadcast(float *data, size_t count, int root = 0)
+    {
+        int noRanks = transport.size();
+        int rank = transport.rank();
+        int next = (rank + 1) % noRanks;
+        int previous = (rank + noRanks - 1) % noRanks;
+        if (rank != root)
+        {
+            transport.exchange(next, nullptr, 0, previous, data, count);
+        }
+        if (next != root)
+        {
+            transport.exchange(next, data, count, previous, nullptr, 0);
+        }
+    }
+};
+
+// Runs a job as noProcesses forked copies of the calling process
+class ProcessGroup
+{
+private:
+    std::vector<pid_t> children;
+
+public:
+    ProcessGroup() {}
+
+    ProcessGroup(const ProcessGroup &) = delete;
+    ProcessGroup &operator=(const ProcessGroup &) = delete;
+
+    // fork noProcesses - 1 children and return the rank of the caller: 0 in the original process, 1 .. in the
+    // children, or -1 if a fork failed (the children already started are killed)
+    int fork(int noProcesses)
+    {
+        for (int rank = 1; rank < noProcesses; rank++)
+        {
+            pid_t pid = ::fork();
+            if (pid == 0)
+            {
+                children.clear();
+                return rank;
+            }
+            if (pid < 0)
+            {
+                for (pid_t child : children)
+                {
+                    kill(child, SIGKILL);
+                }
+                join();
+                return -1;
+            }
+            children.push_back(pid);
+        }
+        return 0;
+    }
+
+    // in the original process: wait for every child, true if all of them exited with status 0
+    bool join()
+    {
+        bool succeeded = true;
+        for (pid_t child : children)
+        {
+            int status = 0;
+            if (waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                succeeded = false;
+            }
+        }
+        children.clear();
+        return succeeded;
+    }
+};
+
+#endif
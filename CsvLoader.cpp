@@ -0,0 +1,243 @@
+// Header guard
+#ifndef CSV_LOADER_H
+#define CSV_LOADER_H
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "Matrix.cpp"
+#include "ThreadPool.cpp"
+
+// A csv dataset (label first, then the integer features) parsed into contiguous buffers
+// the file is read in large chunks, split at newline boundaries across threads, and every field is parsed with
+// std::from_chars straight into the feature buffer, normalized on the way. no std::string per field or per line
+class CsvDataset
+{
+public:
+    std::vector<float> features;  // noRows x noFeatures, one sample per row
+    std::vector<float> labels;    // noRows x noLabels one-hot expected outputs, empty if noLabels is 0
+    std::vector<uint8_t> classes; // label of every row
+    int noRows = 0;
+    int noFeatures = 0;
+    int noLabels = 0;
+
+    // parse fileName with one header line. features are multiplied by scale, labels expanded to noLabels wide
+    // one-hot vectors. false if the file cannot be read or a line has the wrong number of fields
+    bool load(const std::string &fileName, int _noLabels, float scale, int noThreads = 0)
+    {
+        auto startTime = std::chrono::high_resolution_clock::now();
+        std::vector<char> text;
+        if (!readFile(fileName, text))
+        {
+            return false;
+        }
+        noLabels = _noLabels;
+
+        // skip fieldname line in csv
+        const char *begin = text.data();
+        const char *end = begin + text.size();
+        const char *firstLine = std::find(begin, end, '\n');
+        if (firstLine == end)
+        {
+            return false;
+        }
+        begin = firstLine + 1;
+        noFeatures = (int)std::count((const char *)text.data(), firstLine, ',');
+
+        ThreadPool pool(noThreads);
+        int noChunks = pool.size();
+
+        // split at newline boundaries, then count the lines of every chunk to know where its rows go
+        std::vector<const char *> chunkStart(noChunks + 1);
+        chunkStart[0] = begin;
+        chunkStart[noChunks] = end;
+        for (int i = 1; i < noChunks; i++)
+        {
+            const char *guess = begin + (end - begin) * i / noChunks;
+            guess = std::max(guess, chunkStart[i - 1]);
+            const char *newline = std::find(guess, end, '\n');
+            chunkStart[i] = newline == end ? end : newline + 1;
+        }
+        std::vector<int> chunkRows(noChunks + 1, 0);
+        pool.parallelFor(noChunks, [&](int, int chunk) {
+            chunkRows[chunk + 1] = countLines(chunkStart[chunk], chunkStart[chunk + 1]);
+        });
+        for (int i = 0; i < noChunks; i++)
+        {
+            chunkRows[i + 1] += chunkRows[i];
+        }
+        noRows = chunkRows[noChunks];
+
+        features.assign((size_t)noRows * noFeatures, 0.0f);
+        labels.assign((size_t)noRows * noLabels, 0.0f);
+        classes.assign(noRows, 0);
+        std::vector<char> chunkValid(noChunks, 1);
+        pool.parallelFor(noChunks, [&](int, int chunk) {
+            chunkValid[chunk] = parseChunk(chunkStart[chunk], chunkStart[chunk + 1], chunkRows[chunk], scale);
+        });
+        if (std::count(chunkValid.begin(), chunkValid.end(), 0) > 0)
+        {
+            std::cout << "Malformed line in " + fileName << std::endl;
+            return false;
+        }
+
+        auto endTime = std::chrono::high_resolution_clock::now();
+        double seconds = std::chrono::duration<double>(endTime - startTime).count();
+        std::cout << "Parsed " + std::to_string(noRows) + " rows of " + fileName + " in " + std::to_string((int)(seconds * 1000)) +
+                         " milliseconds (" + std::to_string((long)(noRows / seconds)) + " rows/sec)"
+                  << std::endl;
+        return true;
+    }
+
+    int size() const
+    {
+        return noRows;
+    }
+
+    int featureCount() const
+    {
+        return noFeatures;
+    }
+
+    int labelCount() const
+    {
+        return noLabels;
+    }
+
+    int label(int sample) const
+    {
+        return classes[sample];
+    }
+
+    // zero-copy (noFeatures x 1) view of a sample
+    MatrixView<const float> input(int sample) const
+    {
+        return MatrixView<const float>(features.data() + (size_t)sample * noFeatures, noFeatures, 1);
+    }
+
+    // copy rows [start, start + count) into one column each of inputs and expectedOutputs
+    void gatherBatch(int start, int count, MatrixView<float> inputs, MatrixView<float> expectedOutputs) const
+    {
+        for (int j = 0; j < count; j++)
+        {
+            gatherSample(start + j, j, inputs, expectedOutputs);
+        }
+    }
+
+    // copy a single row into column 'column' of the batches
+    void gatherSample(int sample, int column, MatrixView<float> inputs, MatrixView<float> expectedOutputs) const
+    {
+        const float *row = features.data() + (size_t)sample * noFeatures;
+        for (int i = 0; i < noFeatures; i++)
+        {
+            inputs.row(i)[column] = row[i];
+        }
+        const float *label = labels.data() + (size_t)sample * noLabels;
+        for (int i = 0; i < noLabels; i++)
+        {
+            expectedOutputs.row(i)[column] = label[i];
+        }
+    }
+
+private:
+    // the whole file in one buffer, read in large chunks
+    static bool readFile(const std::string &fileName, std::vector<char> &text)
+    {
+        std::ifstream file(fileName, std::ios::in | std::ios::binary);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        file.seekg(0, std::ios::end);
+        size_t length = (size_t)file.tellg();
+        file.seekg(0);
+        text.resize(length);
+        const size_t chunkSize = (size_t)16 << 20;
+        for (size_t offset = 0; offset < length; offset += chunkSize)
+        {
+            file.read(text.data() + offset, std::min(chunkSize, length - offset));
+        }
+        return (bool)file || file.eof();
+    }
+
+    // lines with at least one character, the last one may miss its newline
+    static int countLines(const char *begin, const char *end)
+    {
+        int noLines = 0;
+        while (begin < end)
+        {
+            const char *newline = std::find(begin, end, '\n');
+            if (newline > begin && !(newline == begin + 1 && *begin == '\r'))
+            {
+                noLines++;
+            }
+            begin = newline == end ? end : newline + 1;
+        }
+        return noLines;
+    }
+
+    bool parseChunk(const char *begin, const char *end, int row, float scale)
+    {
+        while (begin < end)
+        {
+            const char *newline = std::find(begin, end, '\n');
+            const char *lineEnd = newline;
+            if (lineEnd > begin && lineEnd[-1] == '\r')
+            {
+                lineEnd--;
+            }
+            if (lineEnd > begin)
+            {
+                if (!parseLine(begin, lineEnd, row, scale))
+                {
+                    return false;
+                }
+                row++;
+            }
+            begin = newline == end ? end : newline + 1;
+        }
+        return true;
+    }
+
+    bool parseLine(const char *begin, const char *end, int row, float scale)
+    {
+        int label;
+        std::from_chars_result result = std::from_chars(begin, end, label);
+        if (result.ec != std::errc() || label < 0 || label > 255 || (noLabels > 0 && label >= noLabels))
+        {
+            return false;
+        }
+        classes[row] = (uint8_t)label;
+        if (noLabels > 0)
+        {
+            labels[(size_t)row * noLabels + label] = 1; // only correct label set to 1, rest set to 0
+        }
+
+        float *rowFeatures = features.data() + (size_t)row * noFeatures;
+        const char *field = result.ptr;
+        for (int i = 0; i < noFeatures; i++)
+        {
+            if (field >= end || *field != ',')
+            {
+                return false;
+            }
+            int value;
+            result = std::from_chars(field + 1, end, value);
+            if (result.ec != std::errc())
+            {
+                return false;
+            }
+            rowFeatures[i] = (float)value * scale;
+            field = result.ptr;
+        }
+        return field == end;
+    }
+};
+
+#endif
@@ -0,0 +1,208 @@
+// Header guard
+#ifndef DATA_PIPELINE_H
+#define DATA_PIPELINE_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+#include <numeric>
+#include <algorithm>
+
+#include "Matrix.cpp"
+#include "Workspace.cpp"
+#include "Profiler.cpp"
+
+// Background producer of shuffled mini-batches for Network::train
+// a producer thread gathers the next batches into a ring of locked (non-swappable) buffers while the current one
+// is being trained on, so reading (e.g. page faults of a MappedDataset bigger than RAM) and decoding hide behind
+// compute. every epoch visits the entries in a fresh random order by shuffling indices, never the samples themselves
+// Dataset is anything with size(), featureCount(), labelCount() and gatherSample() (MappedDataset, CsvDataset)
+template <typename Dataset>
+class DataPipeline
+{
+public:
+    // a batch handed to the trainer, one entry per column. valid until the next call to next()
+    struct Batch
+    {
+        MatrixView<const float> input;
+        MatrixView<const float> expectedOutput;
+        int count = 0;
+    };
+
+private:
+    struct Slot
+    {
+        MatrixView<float> input;
+        MatrixView<float> expectedOutput;
+        int count = 0;
+        bool endOfEpoch = false;
+    };
+
+    const Dataset &data;
+    int batchSize;
+    bool shuffle;
+    std::mt19937 gen;
+    std::vector<int> order; // entry indices in the order of the current epoch
+
+    Workspace arena;
+    std::vector<Slot> slots;
+    int producerSlot = 0;
+    int consumerSlot = 0;
+    int noFilled = 0;         // slots written by the producer and not yet released by the consumer
+    bool holdingSlot = false; // the consumer is training on slots[consumerSlot]
+    bool stopping = false;
+
+    std::mutex lock;
+    std::condition_variable slotFilled;
+    std::condition_variable slotFreed;
+    std::thread producer;
+
+public:
+    // noBuffers >= 2 batches are prefetched ahead of the trainer
+    DataPipeline(const Dataset &_data, int _batchSize, bool _shuffle = true, int noBuffers = 2, unsigned seed = std::random_device()())
+        : data(_data), batchSize(_batchSize), shuffle(_shuffle), gen(seed)
+    {
+        noBuffers = std::max(2, noBuffers);
+        int noFeatures = data.featureCount();
+        int noLabels = data.labelCount();
+        arena.reserve(noBuffers * (Workspace::sizeOf(noFeatures, batchSize) + Workspace::sizeOf(noLabels, batchSize)));
+        arena.lock();
+        for (int i = 0; i < noBuffers; i++)
+        {
+            Slot slot;
+            slot.input = arena.allocate(noFeatures, batchSize);
+            slot.expectedOutput = arena.allocate(noLabels, batchSize);
+            slots.push_back(slot);
+        }
+        order.resize(data.size());
+        std::iota(order.begin(), order.end(), 0);
+        producer = std::thread(&DataPipeline::produce, this);
+    }
+
+    DataPipeline(const DataPipeline &) = delete;
+    DataPipeline &operator=(const DataPipeline &) = delete;
+
+    ~DataPipeline()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        slotFreed.notify_all();
+        producer.join();
+    }
+
+    int getBatchSize() const
+    {
+        return batchSize;
+    }
+
+    int size() const
+    {
+        return data.size();
+    }
+
+    int featureCount() const
+    {
+        return data.featureCount();
+    }
+
+    int labelCount() const
+    {
+        return data.labelCount();
+    }
+
+    // the next batch of the current epoch. returns false once the epoch is over, the call after that starts the next
+    bool next(Batch &batch)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        if (holdingSlot)
+        {
+            releaseSlot();
+        }
+        {
+            // time the trainer spends waiting for data, nonzero only when the producer falls behind
+            NN_PROFILE_SCOPE("data.wait");
+            slotFilled.wait(guard, [this] { return noFilled > 0; });
+        }
+        Slot &slot = slots[consumerSlot];
+        if (slot.endOfEpoch)
+        {
+            releaseSlot();
+            return false;
+        }
+        holdingSlot = true;
+        batch.count = slot.count;
+        batch.input = slot.input.reshaped(slot.input.noRows, slot.count);
+        batch.expectedOutput = slot.expectedOutput.reshaped(slot.expectedOutput.noRows, slot.count);
+        return true;
+    }
+
+private:
+    // called with the lock held
+    void releaseSlot()
+    {
+        holdingSlot = false;
+        consumerSlot = (consumerSlot + 1) % (int)slots.size();
+        noFilled--;
+        slotFreed.notify_one();
+    }
+
+    // wait for a free slot, false if the pipeline is shutting down
+    bool acquireSlot()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        slotFreed.wait(guard, [this] { return stopping || noFilled < (int)slots.size(); });
+        return !stopping;
+    }
+
+    void publishSlot()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        producerSlot = (producerSlot + 1) % (int)slots.size();
+        noFilled++;
+        slotFilled.notify_one();
+    }
+
+    // runs epoch after epoch until destroyed, always a few batches ahead of the trainer
+    void produce()
+    {
+        while (true)
+        {
+            if (shuffle)
+            {
+                std::shuffle(order.begin(), order.end(), gen);
+            }
+            for (int start = 0; start < (int)order.size(); start += batchSize)
+            {
+                if (!acquireSlot())
+                {
+                    return;
+                }
+                NN_PROFILE_SCOPE("data.produce");
+                Slot &slot = slots[producerSlot];
+                slot.count = std::min(batchSize, (int)order.size() - start);
+                slot.endOfEpoch = false;
+                MatrixView<float> input = slot.input.reshaped(slot.input.noRows, slot.count);
+                MatrixView<float> expectedOutput = slot.expectedOutput.reshaped(slot.expectedOutput.noRows, slot.count);
+                for (int j = 0; j < slot.count; j++)
+                {
+                    data.gatherSample(order[start + j], j, input, expectedOutput);
+                }
+                publishSlot();
+            }
+            // an empty slot marks the end of the epoch
+            if (!acquireSlot())
+            {
+                return;
+            }
+            slots[producerSlot].count = 0;
+            slots[producerSlot].endOfEpoch = true;
+            publishSlot();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,310 @@
+// Header guard
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <cmath>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Matrix.cpp"
+
+// Binary dataset file, written once from a csv by nn-convert and memory-mapped for training
+// layout: the 64-byte header, then the features of every sample back to back (sample-major, so one sample is a
+// contiguous featureCount x 1 column), then one uint8 class index per sample. every section starts 64-byte aligned
+struct DatasetHeader
+{
+    static const uint32_t MAGIC = 0x53444e4e; // "NNDS"
+    static const uint32_t VERSION = 1;
+
+    enum Dtype : uint32_t
+    {
+        U8 = 0, // raw bytes, multiplied by scale when read
+        F32 = 1 // final values, readable in place
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sampleCount;
+    uint32_t featureCount;
+    uint32_t labelCount; // number of classes, expected outputs are one-hot vectors of this size
+    uint32_t dtype;
+    float scale;
+    uint64_t featuresOffset;
+    uint64_t labelsOffset;
+    uint8_t reserved[16];
+
+    static uint64_t align(uint64_t offset)
+    {
+        return (offset + 63) / 64 * 64;
+    }
+
+    uint64_t featureBytes() const
+    {
+        return (uint64_t)featureCount * (dtype == F32 ? sizeof(float) : sizeof(uint8_t));
+    }
+};
+
+static_assert(sizeof(DatasetHeader) == 64, "the dataset header must stay 64 bytes");
+
+// Stream samples into a dataset file. the labels are held back and appended on close, once the sample count is known
+class DatasetWriter
+{
+private:
+    std::ofstream file;
+    DatasetHeader header;
+    std::vector<uint8_t> labels;
+    std::vector<uint8_t> buffer;
+
+public:
+    // U8 stores values as bytes and applies scale when read, F32 stores value * scale
+    // labelCount grows if a larger label shows up
+    bool open(const std::string &fileName, int featureCount, int labelCount, DatasetHeader::Dtype dtype, float scale)
+    {
+        file.open(fileName, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        std::memset(&header, 0, sizeof(header));
+        header.magic = DatasetHeader::MAGIC;
+        header.version = DatasetHeader::VERSION;
+        header.featureCount = featureCount;
+        header.labelCount = labelCount;
+        header.dtype = dtype;
+        header.scale = scale;
+        header.featuresOffset = sizeof(DatasetHeader);
+        labels.clear();
+        buffer.resize(header.featureBytes());
+        // placeholder, rewritten on close
+        file.write((const char *)&header, sizeof(header));
+        return file.good();
+    }
+
+    // false, writing nothing, for a label that does not fit the file's uint8 class index or, in a U8 file, a feature
+    // that does not round to 0 .. 255 (negative, too large or NaN)
+    bool addSample(const float *features, int label)
+    {
+        if (label < 0 || label > 255)
+        {
+            return false;
+        }
+        if (header.dtype == DatasetHeader::F32)
+        {
+            float *values = (float *)buffer.data();
+            for (uint32_t i = 0; i < header.featureCount; i++)
+            {
+                values[i] = features[i] * header.scale;
+            }
+        }
+        else
+        {
+            for (uint32_t i = 0; i < header.featureCount; i++)
+            {
+                float rounded = std::nearbyint(features[i]);
+                if (!(rounded >= 0 && rounded <= 255))
+                {
+                    return false;
+                }
+                buffer[i] = (uint8_t)rounded;
+            }
+        }
+        file.write((const char *)buffer.data(), buffer.size());
+        labels.push_back((uint8_t)label);
+        header.labelCount = std::max<uint32_t>(header.labelCount, label + 1);
+        return file.good();
+    }
+
+    bool close()
+    {
+        header.sampleCount = labels.size();
+        header.labelsOffset = DatasetHeader::align(header.featuresOffset + header.sampleCount * header.featureBytes());
+        std::vector<char> padding(header.labelsOffset - (header.featuresOffset + header.sampleCount * header.featureBytes()));
+        file.write(padding.data(), padding.size());
+        file.write((const char *)labels.data(), labels.size());
+        file.seekp(0);
+        file.write((const char *)&header, sizeof(header));
+        file.close();
+        return !file.fail();
+    }
+};
+
+// Read-only memory mapping of a dataset file. the samples are only ever in the page cache, shared by every process
+// that maps the same file, and f32 samples can be handed to the layers as views without any copy
+class MappedDataset
+{
+private:
+    const uint8_t *base = nullptr;
+    size_t length = 0;
+    const DatasetHeader *header = nullptr;
+
+    void close()
+    {
+        if (base != nullptr)
+        {
+            munmap((void *)base, length);
+        }
+        base = nullptr;
+        header = nullptr;
+        length = 0;
+    }
+
+    // every read the accessors make stays inside the mapping, computed without overflowing
+    bool isConsistent() const
+    {
+        if ((header->dtype != DatasetHeader::U8 && header->dtype != DatasetHeader::F32) || header->labelCount == 0 ||
+            header->sampleCount > (uint64_t)std::numeric_limits<int>::max() || header->featuresOffset < sizeof(DatasetHeader) ||
+            header->featuresOffset > length || header->labelsOffset > length || header->labelsOffset < header->featuresOffset ||
+            (header->dtype == DatasetHeader::F32 && header->featuresOffset % sizeof(float) != 0))
+        {
+            return false;
+        }
+        uint64_t featureBytes = header->featureBytes();
+        if (featureBytes != 0 && header->sampleCount > (header->labelsOffset - header->featuresOffset) / featureBytes)
+        {
+            return false;
+        }
+        if (header->sampleCount > length - header->labelsOffset)
+        {
+            return false;
+        }
+        const uint8_t *labels = base + header->labelsOffset;
+        for (uint64_t i = 0; i < header->sampleCount; i++)
+        {
+            if (labels[i] >= header->labelCount)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    MappedDataset() {}
+
+    MappedDataset(const MappedDataset &) = delete;
+    MappedDataset &operator=(const MappedDataset &) = delete;
+
+    ~MappedDataset()
+    {
+        close();
+    }
+
+    // map the file, false if it is missing, not a dataset of this version or inconsistent: sections that overlap or
+    // run past the end of the file, or a label outside [0, labelCount)
+    bool open(const std::string &fileName)
+    {
+        close();
+        int fd = ::open(fileName.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(DatasetHeader))
+        {
+            ::close(fd);
+            return false;
+        }
+        void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd); // the mapping keeps the file alive
+        if (mapping == MAP_FAILED)
+        {
+            return false;
+        }
+        base = (const uint8_t *)mapping;
+        length = info.st_size;
+        header = (const DatasetHeader *)base;
+        if (header->magic != DatasetHeader::MAGIC || header->version != DatasetHeader::VERSION || !isConsistent())
+        {
+            close();
+            return false;
+        }
+        // every epoch reads all of it in a shuffled order (DataPipeline), so start paging it in rather than tune
+        // read-ahead and reclaim for a front-to-back scan
+        madvise((void *)base, length, MADV_WILLNEED);
+        return true;
+    }
+
+    int size() const
+    {
+        return header == nullptr ? 0 : (int)header->sampleCount;
+    }
+
+
+    int featureCount() const
+    {
+        return header->featureCount;
+    }
+
+    int labelCount() const
+    {
+        return header->labelCount;
+    }
+
+    bool isFloat() const
+    {
+        return header->dtype == DatasetHeader::F32;
+    }
+
+    int label(int sample) const
+    {
+        return base[header->labelsOffset + sample];
+    }
+
+    // zero-copy (featureCount x 1) view of a sample, only for f32 datasets
+    MatrixView<const float> input(int sample) const
+    {
+        const float *features = (const float *)(base + header->featuresOffset) + (size_t)sample * header->featureCount;
+        return MatrixView<const float>(features, header->featureCount, 1);
+    }
+
+    // copy samples [start, start + count) into one column each of inputs (featureCount x count), scaling u8 values,
+    // and their one-hot labels into expectedOutputs (labelCount x count)
+    void gatherBatch(int start, int count, MatrixView<float> inputs, MatrixView<float> expectedOutputs) const
+    {
+        for (int j = 0; j < count; j++)
+        {
+            gatherSample(start + j, j, inputs, expectedOutputs);
+        }
+    }
+
+    // copy a single sample into column 'column' of the batches
+    void gatherSample(int sample, int column, MatrixView<float> inputs, MatrixView<float> expectedOutputs) const
+    {
+        int noFeatures = header->featureCount;
+        if (isFloat())
+        {
+            const float *features = input(sample).data;
+            for (int i = 0; i < noFeatures; i++)
+            {
+                inputs.row(i)[column] = features[i];
+            }
+        }
+        else
+        {
+            const uint8_t *features = base + header->featuresOffset + (size_t)sample * noFeatures;
+            float scale = header->scale;
+            for (int i = 0; i < noFeatures; i++)
+            {
+                inputs.row(i)[column] = features[i] * scale;
+            }
+        }
+        for (int i = 0; i < (int)header->labelCount; i++)
+        {
+            expectedOutputs.row(i)[column] = 0;
+        }
+        expectedOutputs.row(label(sample))[column] = 1;
+    }
+};
+
+#endif
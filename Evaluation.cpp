@@ -0,0 +1,94 @@
+// Header guard
+#ifndef EVALUATION_H
+#define EVALUATION_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+// Result of scoring a labelled dataset (Network::evaluate)
+// the confusion matrix counts every (actual, predicted) class pair, the metrics are all derived from it
+struct Evaluation
+{
+    int noClasses = 0;
+    std::vector<long> confusion; // noClasses x noClasses, row = actual class, column = predicted class
+    double loss = 0;             // summed over the samples, same measure as training
+    long noSamples = 0;
+
+    explicit Evaluation(int _noClasses = 0) : noClasses(_noClasses), confusion((size_t)_noClasses * _noClasses, 0) {}
+
+    long count(int actual, int predicted) const
+    {
+        return confusion[(size_t)actual * noClasses + predicted];
+    }
+
+    void add(int actual, int predicted)
+    {
+        confusion[(size_t)actual * noClasses + predicted]++;
+        noSamples++;
+    }
+
+    // fold in the counts of another part of the same dataset
+    void merge(const Evaluation &other)
+    {
+        for (size_t i = 0; i < confusion.size(); i++)
+        {
+            confusion[i] += other.confusion[i];
+        }
+        loss += other.loss;
+        noSamples += other.noSamples;
+    }
+
+    double accuracy() const
+    {
+        long noCorrect = 0;
+        for (int c = 0; c < noClasses; c++)
+        {
+            noCorrect += count(c, c);
+        }
+        return noSamples == 0 ? 0 : (double)noCorrect / noSamples;
+    }
+
+    double averageLoss() const
+    {
+        return noSamples == 0 ? 0 : loss / noSamples;
+    }
+
+    // of the samples predicted as c, the fraction that are c (0 if c was never predicted)
+    double precision(int c) const
+    {
+        long noPredicted = 0;
+        for (int actual = 0; actual < noClasses; actual++)
+        {
+            noPredicted += count(actual, c);
+        }
+        return noPredicted == 0 ? 0 : (double)count(c, c) / noPredicted;
+    }
+
+    // of the samples that are c, the fraction predicted as c (0 if there are none)
+    double recall(int c) const
+    {
+        long noActual = 0;
+        for (int predicted = 0; predicted < noClasses; predicted++)
+        {
+            noActual += count(c, predicted);
+        }
+        return noActual == 0 ? 0 : (double)count(c, c) / noActual;
+    }
+
+    // accuracy and loss on one line, then precision & recall of every class
+    std::string toString() const
+    {
+        char line[128];
+        std::snprintf(line, sizeof(line), "Accuracy: %f Average loss: %f (%ld samples)\n", accuracy(), averageLoss(), noSamples);
+        std::string text = line;
+        for (int c = 0; c < noClasses; c++)
+        {
+            std::snprintf(line, sizeof(line), "Class %d precision: %f recall: %f\n", c, precision(c), recall(c));
+            text += line;
+        }
+        return text;
+    }
+};
+
+#endif
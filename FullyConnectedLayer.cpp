@@ -1,9 +1,42 @@
+// Header guard
+#ifndef FULLY_CONNECTED_LAYER_H
+#define FULLY_CONNECTED_LAYER_H
+
 #include <random>
+#include <atomic>
+#include <algorithm>
 
 #include "Matrix.cpp"
+#include "SparseMatrix.cpp"
+#include "Optimizer.cpp"
 #include "TanhLayer.cpp"
+#include "Topology.cpp"
+
+// Derivatives of the cost wrt the weights & biases of one layer, kept outside the layer so that
+// every training thread can accumulate into a private copy
+struct LayerGradients {
+    Matrix<float> weightsDerivatives;
+    Matrix<float> biasesDerivatives;
+
+    // add another set of derivatives of the same layer and reset it to zero
+    void absorb(LayerGradients &other) {
+        weightsDerivatives.add(other.weightsDerivatives);
+        biasesDerivatives.add(other.biasesDerivatives);
+        other.weightsDerivatives.setAll(0);
+        other.biasesDerivatives.setAll(0);
+    }
+};
 
 class FullyConnectedLayer {
+public:
+    // the sparse input path (see forwardPropagateSparse) is taken for batches of at most SPARSE_MAX_BATCH samples
+    // with at most SPARSE_DENSITY of their inputs nonzero, e.g. MNIST pixels (about 0.11). measured there, compressing
+    // the batch and the sparse product beat the dense product 2x at 16 samples and break even around 32, where the
+    // dense product has amortised its packing. the weight gradient only gains from it on much sparser inputs
+    static constexpr double SPARSE_DENSITY = 0.2;
+    static constexpr int SPARSE_MAX_BATCH = 32;
+    static constexpr double SPARSE_GRADIENT_DENSITY = 0.05;
+
 private:
     int noInputNodes;
     int noOutputNodes;
@@ -13,7 +46,27 @@ private:
     Matrix<float> weightsDerivatives;
     Matrix<float> biasesDerivatives;
 
+    // mixed precision: every product reads the weights rounded to bfloat16, while the updates go to the float
+    // weights above (the master copy), so small steps are never lost to rounding
+    bool mixedPrecision = false;
+    Matrix<BFloat16> storedWeights;
+
     TanhLayer activation;
+
+    void refreshStoredWeights() {
+        if (mixedPrecision) {
+            storedWeights.assign(weights);
+        }
+    }
+
+    template <typename S>
+    void forwardPropagateStored (MatrixView<const S> input, MatrixView<float> output) const {
+        if (mixedPrecision) {
+            forwardPropagate(storedWeights.view(), biases.view(), input.data, input.leadingDimension, 1, output);
+        } else {
+            forwardPropagate(weights.view(), biases.view(), input.data, input.leadingDimension, 1, output);
+        }
+    }
     
 public:
     // constructor when we only know the dimension of the layer
@@ -29,13 +82,13 @@ public:
         biasesDerivatives = Matrix<float>({noOutputNodes, 1}, 0);
     }
 
-    // constructor when we have biases and weights of the layer
+    // constructor when we have biases and weights of the layer, moved in when they are temporaries
     FullyConnectedLayer (Matrix<float> _weights, Matrix<float> _biases) {
         noInputNodes = _weights.noColumns;
         noOutputNodes = _weights.noRows;
 
-        weights = _weights;
-        biases = _biases;
+        weights = std::move(_weights);
+        biases = std::move(_biases);
 
         weightsDerivatives = Matrix<float>({noOutputNodes,noInputNodes},0);
         biasesDerivatives = Matrix<float>({noOutputNodes,1},0);
@@ -53,37 +106,260 @@ public:
             }
             biases.set(i, 0, (float)(biasDistribution(gen)));
         }
+        refreshStoredWeights();
+    }
+
+    int getNoInputNodes() const {
+        return noInputNodes;
+    }
+
+    int getNoOutputNodes() const {
+        return noOutputNodes;
+    }
+
+    // copy in weights & biases of the same shape, e.g. from a checkpoint
+    void setParameters (MatrixView<const float> _weights, MatrixView<const float> _biases) {
+        std::copy(_weights.data, _weights.data + weights.data.size(), weights.data.begin());
+        std::copy(_biases.data, _biases.data + biases.data.size(), biases.data.begin());
+        refreshStoredWeights();
+    }
+
+    // store the weights the products read as bfloat16 (true) or float (false), the master weights stay float
+    void setMixedPrecision (bool enabled) {
+        mixedPrecision = enabled;
+        storedWeights = Matrix<BFloat16>();
+        refreshStoredWeights();
+    }
+
+    bool isMixedPrecision() const {
+        return mixedPrecision;
+    }
+
+    const Matrix<float> &getWeights() const {
+        return weights;
+    }
+
+    const Matrix<float> &getBiases() const {
+        return biases;
+    }
+
+    // derivatives accumulated since the last applyDerivatives, e.g. to average them across processes first
+    MatrixView<float> getWeightsDerivatives() {
+        return weightsDerivatives.view();
+    }
+
+    MatrixView<float> getBiasesDerivatives() {
+        return biasesDerivatives.view();
     }
 
     // get output for the layer
-    Matrix<float> forwardPropagate (const Matrix<float> &input){
-        Matrix<float> output = weights.multiply(input);
-        output.add(biases);
-        return TanhLayer::forwardPropagate(output);
+    // input is either a single sample (noInputNodes x 1) or a mini-batch with one sample per column
+    // (noInputNodes x batchSize), in which case the biases are broadcast across the columns
+    Matrix<float> forwardPropagate (const Matrix<float> &input) const {
+        Matrix<float> output({noOutputNodes, input.noColumns});
+        forwardPropagate(input.view(), output.view());
+        return output;
+    }
+
+    // same, writing into preallocated (noOutputNodes x batchSize) storage
+    void forwardPropagate (MatrixView<const float> input, MatrixView<float> output) const {
+        forwardPropagateStored(input, output);
+    }
+
+    // same for an input stored in bfloat16, e.g. the activations of a mixed-precision plan. the output is float
+    void forwardPropagate (MatrixView<const BFloat16> input, MatrixView<float> output) const {
+        forwardPropagateStored(input, output);
+    }
+
+    // the same pass on parameters held elsewhere, e.g. by an InferenceEngine. input entry (i, j) is read at
+    // input[i * rsInput + j * csInput], so samples stored one per row are used as columns without being transposed
+    // weights and output may be strided views (see MatrixView::leadingDimension)
+    // weights and input may be stored as float or in 16 bits, the product always accumulates in float
+    template <typename W, typename S>
+    static void forwardPropagate (MatrixView<const W> weights, MatrixView<const float> biases, const S *input, int rsInput, int csInput, MatrixView<float> output) {
+        NN_PROFILE_SCOPE("layer.forward", 2.0 * weights.size() * output.noColumns,
+                         (double)sizeof(W) * weights.size() + sizeof(S) * weights.noColumns * output.noColumns + sizeof(float) * output.size());
+        // start from the biases so the product accumulates onto them, then apply the activation in place
+        output.assign(broadcastColumn(biases));
+        Gemm::multiplyMixed(weights.noRows, output.noColumns, weights.noColumns, weights.data, weights.leadingDimension, 1, input, rsInput, csInput, output.data, output.leadingDimension);
+        TanhLayer::forwardPropagate(output);
+    }
+
+    // same, first compressing the input into sparseInput when it is sparse enough to be worth it (SPARSE_DENSITY,
+    // SPARSE_MAX_BATCH) and then reading only its nonzeros. otherwise sparseInput is left empty and the dense product
+    // runs. sparseInput is meant to be kept (reserved) between batches and passed on to getDerivatives
+    void forwardPropagate (MatrixView<const float> input, MatrixView<float> output, SparseColumns &sparseInput) const {
+        if (input.noColumns > SPARSE_MAX_BATCH || !sparseInput.assign(input, SPARSE_DENSITY)) {
+            sparseInput.clear();
+            forwardPropagateStored(input, output);
+            return;
+        }
+        NN_PROFILE_SCOPE("layer.forwardSparse", 2.0 * noOutputNodes * sparseInput.noNonZeros(),
+                         (double)sizeof(float) * (noOutputNodes * sparseInput.noNonZeros() + output.size()));
+        output.assign(broadcastColumn(biases));
+        if (mixedPrecision) {
+            SparseGemm::multiply(noOutputNodes, storedWeights.data.data(), noInputNodes, sparseInput, output.data, output.leadingDimension);
+        } else {
+            SparseGemm::multiply(noOutputNodes, weights.data.data(), noInputNodes, sparseInput, output.data, output.leadingDimension);
+        }
+        TanhLayer::forwardPropagate(output);
     }
 
     // get derivatives of cost wrt the input of this layer so that it can be used to recursively compute derivatives
     // of input of previous layer
     // update derivatives of cost with respect to each of the weights & biases in this current layer, obtained by
     // multiplying such derivative of the layer following it and the input of this layer (by chain rule)
+    // for a mini-batch the derivatives of all its samples are summed, so the weights gradient is a single
+    // (noOutputNodes x batchSize) * (batchSize x noInputNodes) product
     Matrix<float> getDerivatives (const Matrix<float> &input, const Matrix<float> &output, const Matrix<float> &nextLayerDerivatives) {
-        // account for sigmoid derivatives of the input
-        Matrix<float> outputDerivatives = TanhLayer::getDerivatives(output, nextLayerDerivatives);
+        return getDerivatives(input, output, nextLayerDerivatives, weightsDerivatives, biasesDerivatives);
+    }
 
-        biasesDerivatives.add(outputDerivatives);
-        weightsDerivatives.add(Matrix<float>::multiply(outputDerivatives, Matrix<float>::transpose(input)));
+    // same as above but accumulates into the given derivatives instead of the layer's own, leaving the layer
+    // untouched so several threads can run it at once
+    Matrix<float> getDerivatives (const Matrix<float> &input, const Matrix<float> &output, const Matrix<float> &nextLayerDerivatives,
+                                  Matrix<float> &weightsDerivativesOut, Matrix<float> &biasesDerivativesOut) const {
+        Matrix<float> outputDerivatives = nextLayerDerivatives;
+        Matrix<float> inputDerivatives({noInputNodes, input.noColumns});
+        getDerivatives(input.view(), output.view(), outputDerivatives.view(), inputDerivatives.view(), weightsDerivativesOut.view(), biasesDerivativesOut.view());
+        return inputDerivatives;
+    }
 
-        Matrix<float> inputDerivatives = Matrix<float>::multiply(weights, outputDerivatives);
-        inputDerivatives.divide(weights.noRows);
+    // same on preallocated storage, accumulating into the layer's own derivatives
+    template <typename SI, typename SO>
+    void getDerivatives (MatrixView<const SI> input, MatrixView<const SO> output, MatrixView<float> nextLayerDerivatives, MatrixView<float> inputDerivatives) {
+        getDerivatives(input, output, nextLayerDerivatives, inputDerivatives, weightsDerivatives.view(), biasesDerivatives.view());
+    }
 
-        return inputDerivatives;
+    // nextLayerDerivatives is overwritten with the derivatives wrt the layer's
+    // pre-activation, and inputDerivatives is only computed if it has storage (the first layer does not need it)
+    void getDerivatives (MatrixView<const float> input, MatrixView<const float> output, MatrixView<float> nextLayerDerivatives,
+                         MatrixView<float> inputDerivatives, MatrixView<float> weightsDerivativesOut, MatrixView<float> biasesDerivativesOut) const {
+        getDerivatives<float, float>(input, output, nextLayerDerivatives, inputDerivatives, weightsDerivativesOut, biasesDerivativesOut);
     }
 
-    void applyDerivatives(float learnRate) {
-        biases.subtract(biasesDerivatives.multiply(learnRate));
-        biasesDerivatives.setAll(0);
+    // same for inputs and outputs stored as float or bfloat16 (see Network::setMixedPrecision), the derivatives
+    // are always float
+    template <typename SI, typename SO>
+    void getDerivatives (MatrixView<const SI> input, MatrixView<const SO> output, MatrixView<float> nextLayerDerivatives,
+                         MatrixView<float> inputDerivatives, MatrixView<float> weightsDerivativesOut, MatrixView<float> biasesDerivativesOut) const {
+        int batchSize = input.noColumns;
+        // a second product (and a second read of the weights) when the input derivatives are wanted
+        NN_PROFILE_SCOPE("layer.backward", (inputDerivatives.data != nullptr ? 4.0 : 2.0) * noOutputNodes * noInputNodes * batchSize,
+                         (inputDerivatives.data != nullptr ? 2.0 : 1.0) * sizeof(float) * noOutputNodes * noInputNodes + sizeof(SI) * input.size() + sizeof(SO) * output.size());
+
+        // account for tanh derivatives of the output, one fused pass
+        MatrixView<float> outputDerivatives = nextLayerDerivatives;
+        TanhLayer::getDerivatives(output, outputDerivatives);
 
-        weights.subtract(weightsDerivatives.multiply(learnRate));
-        weightsDerivatives.setAll(0);
+        for (int i = 0; i < noOutputNodes; i++) {
+            const float *row = outputDerivatives.row(i);
+            float sum = 0;
+            for (int j = 0; j < batchSize; j++) {
+                sum += row[j];
+            }
+            biasesDerivativesOut.data[i] += sum;
+        }
+        // outputDerivatives * transpose(input) accumulated straight into the weights derivatives, the input is read
+        // through swapped strides instead of being transposed
+        Gemm::multiply(Gemm::NO_TRANSPOSE, Gemm::TRANSPOSE, noOutputNodes, noInputNodes, batchSize, (const float *)outputDerivatives.data, outputDerivatives.leadingDimension,
+                       input.data, input.leadingDimension, weightsDerivativesOut.data, weightsDerivativesOut.leadingDimension);
+
+        if (inputDerivatives.data == nullptr) {
+            return;
+        }
+        // the input derivatives go back through the transposed weights (noInputNodes x batchSize)
+        inputDerivatives.setAll(0);
+        const float *derivatives = outputDerivatives.data;
+        int ldd = outputDerivatives.leadingDimension;
+        if (mixedPrecision) {
+            Gemm::multiply(Gemm::TRANSPOSE, Gemm::NO_TRANSPOSE, noInputNodes, batchSize, noOutputNodes, storedWeights.data.data(), noInputNodes, derivatives, ldd,
+                           inputDerivatives.data, inputDerivatives.leadingDimension);
+        } else {
+            Gemm::multiply(Gemm::TRANSPOSE, Gemm::NO_TRANSPOSE, noInputNodes, batchSize, noOutputNodes, weights.data.data(), noInputNodes, derivatives, ldd,
+                           inputDerivatives.data, inputDerivatives.leadingDimension);
+        }
+        inputDerivatives.multiply(1.0f / (float)noOutputNodes);
     }
-};
\ No newline at end of file
+
+    // derivatives of a layer whose forward pass compressed its input into sparseInput: below SPARSE_GRADIENT_DENSITY
+    // the weights gradient only visits the input's nonzeros. there are no input derivatives, this is the first layer
+    template <typename SO>
+    void getDerivatives (MatrixView<const float> input, const SparseColumns &sparseInput, MatrixView<const SO> output, MatrixView<float> nextLayerDerivatives) {
+        if (sparseInput.noColumns != input.noColumns || sparseInput.density() > SPARSE_GRADIENT_DENSITY) {
+            getDerivatives(input, output, nextLayerDerivatives, MatrixView<float>());
+            return;
+        }
+        int batchSize = input.noColumns;
+        NN_PROFILE_SCOPE("layer.backwardSparse", 2.0 * noOutputNodes * sparseInput.noNonZeros(),
+                         2.0 * sizeof(float) * noOutputNodes * sparseInput.noNonZeros() + sizeof(SO) * output.size());
+
+        MatrixView<float> outputDerivatives = nextLayerDerivatives;
+        TanhLayer::getDerivatives(output, outputDerivatives);
+        for (int i = 0; i < noOutputNodes; i++) {
+            const float *row = outputDerivatives.row(i);
+            float sum = 0;
+            for (int j = 0; j < batchSize; j++) {
+                sum += row[j];
+            }
+            biasesDerivatives.data[i] += sum;
+        }
+        SparseGemm::multiplyTransposed(noOutputNodes, outputDerivatives.data, outputDerivatives.leadingDimension, sparseInput, weightsDerivatives.data.data(), noInputNodes);
+    }
+
+    // a bfloat16 copy of the parameters (stored) gets every updated entry rounded into it the same way
+    static void applyAsync(Matrix<float> &parameters, Matrix<float> &derivatives, float learnRate, BFloat16 *stored = nullptr) {
+        for (int i = 0; i < (int)parameters.data.size(); i++) {
+            float derivative = derivatives.data[i];
+            if (derivative != 0) {
+                float step = -learnRate * derivative;
+                float updated = std::atomic_ref<float>(parameters.data[i]).fetch_add(step, std::memory_order_relaxed) + step;
+                if (stored != nullptr) {
+                    std::atomic_ref<uint16_t>(stored[i].bits).store(BFloat16::fromFloat(updated), std::memory_order_relaxed);
+                }
+                derivatives.data[i] = 0;
+            }
+        }
+    }
+
+    // zeroed derivatives shaped like this layer, for a thread to accumulate into
+    LayerGradients makeGradients() const {
+        return LayerGradients{Matrix<float>({noOutputNodes, noInputNodes}, 0), Matrix<float>({noOutputNodes, 1}, 0)};
+    }
+
+    // add derivatives accumulated outside the layer (and reset them) before applyDerivatives
+    void addDerivatives(LayerGradients &gradients) {
+        weightsDerivatives.add(gradients.weightsDerivatives);
+        biasesDerivatives.add(gradients.biasesDerivatives);
+        gradients.weightsDerivatives.setAll(0);
+        gradients.biasesDerivatives.setAll(0);
+    }
+
+    // lock-free update used by asynchronous (Hogwild) training: subtract the given derivatives straight from the
+    // shared weights & biases with relaxed atomic adds, skipping zero entries (most of the first layer's weights
+    // derivatives, since most pixels are 0), and reset the derivatives on the way.
+    // other threads may read the weights mid-update, which Hogwild accepts in exchange for having no barrier
+    void applyDerivativesAsync(LayerGradients &gradients, float learnRate) {
+        applyAsync(weights, gradients.weightsDerivatives, learnRate, mixedPrecision ? storedWeights.data.data() : nullptr);
+        applyAsync(biases, gradients.biasesDerivatives, learnRate);
+    }
+
+    // spread the weights, their bfloat16 copy and their derivatives over the nodes of topology page by page (see
+    // WeightPlacement::INTERLEAVED), false if any of them stays where it is
+    bool interleaveWeights (const Topology &topology) {
+        bool placed = topology.interleave(weights.data.data(), weights.data.size() * sizeof(float));
+        placed = topology.interleave(weightsDerivatives.data.data(), weightsDerivatives.data.size() * sizeof(float)) && placed;
+        if (mixedPrecision) {
+            placed = topology.interleave(storedWeights.data.data(), storedWeights.data.size() * sizeof(BFloat16)) && placed;
+        }
+        return placed;
+    }
+
+    // hand the weights & biases with their derivatives to an optimizer for its next step, see Network::applyDerivatives
+    void addParameters(Optimizer &optimizer) {
+        optimizer.addTensor(weights.data.data(), weightsDerivatives.data.data(), weights.data.size(), true, mixedPrecision ? storedWeights.data.data() : nullptr);
+        optimizer.addTensor(biases.data.data(), biasesDerivatives.data.data(), biases.data.size(), false);
+    }
+};
+
+#endif
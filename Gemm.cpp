@@ -0,0 +1,519 @@
+// Header guard
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include "HalfFloat.cpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GEMM_X86 1
+#endif
+
+// General matrix multiply C += A * B, the kernel behind Matrix::multiply
+// every operand is addressed by a row stride and a column stride, so the packing step can read
+// row-major, column-major or transposed matrices without copying them first
+class Gemm
+{
+public:
+    enum Isa
+    {
+        SCALAR,
+        AVX2,
+        AVX512
+    };
+
+    // cache blocking: a KC x NR panel of B stays in L1, an MC x KC block of A in L2
+    // and a KC x NC block of B in L3. MC is a multiple of every MR and NC of every NR below
+    static const int MC = 144;
+    static const int KC = 256;
+    static const int NC = 2048;
+
+    // instruction set picked once from the cpu features, can be lowered with setIsa (e.g. to compare kernels)
+    static Isa &activeIsa()
+    {
+        static Isa isa = detectIsa();
+        return isa;
+    }
+
+    static Isa detectIsa()
+    {
+#ifdef GEMM_X86
+        __builtin_cpu_init();
+        // the AVX-512 level also runs avx2/fma code (dot products, the tails of the activation & optimizer kernels)
+        bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+        if (avx2 && __builtin_cpu_supports("avx512f"))
+        {
+            return AVX512;
+        }
+        if (avx2)
+        {
+            return AVX2;
+        }
+#endif
+        return SCALAR;
+    }
+
+    // never select a kernel the cpu cannot run
+    static void setIsa(Isa isa)
+    {
+        activeIsa() = std::min(isa, detectIsa());
+    }
+
+    // Naive triple loop, kept as the reference the blocked kernels are checked against
+    template <typename T>
+    static void reference(int m, int n, int k, const T *a, int rsA, int csA, const T *b, int rsB, int csB, T *c, int ldc)
+    {
+        for (int i = 0; i < m; i++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                T sum = 0;
+                for (int p = 0; p < k; p++)
+                {
+                    sum += a[i * rsA + p * csA] * b[p * rsB + j * csB];
+                }
+                c[i * ldc + j] += sum;
+            }
+        }
+    }
+
+    // C (m x n, row-major with leading dimension ldc) += A (m x k) * B (k x n), both row-major
+    template <typename T>
+    static void multiply(int m, int n, int k, const T *a, int lda, const T *b, int ldb, T *c, int ldc)
+    {
+        multiplyStrided(m, n, k, a, lda, 1, b, ldb, 1, c, ldc);
+    }
+
+    // C (m x n) += op(A) * op(B), op(X) being X or its transpose, the BLAS interface for row-major storage:
+    // op(A) is m x k, so A is stored m x k (NO_TRANSPOSE) or k x m (TRANSPOSE) with leading dimension lda, same for B.
+    // a transposed operand is read through swapped strides, nothing is copied. e.g. a layer's backward pass is
+    // (TRANSPOSE, NO_TRANSPOSE) for weightsᵀ * derivatives and (NO_TRANSPOSE, TRANSPOSE) for derivatives * inputᵀ
+    enum Transpose
+    {
+        NO_TRANSPOSE,
+        TRANSPOSE
+    };
+
+    template <typename TA, typename TB>
+    static void multiply(Transpose transA, Transpose transB, int m, int n, int k, const TA *a, int lda, const TB *b, int ldb, float *c, int ldc)
+    {
+        multiplyMixed(m, n, k, a, transA == TRANSPOSE ? 1 : lda, transA == TRANSPOSE ? lda : 1, b, transB == TRANSPOSE ? 1 : ldb,
+                      transB == TRANSPOSE ? ldb : 1, c, ldc);
+    }
+
+    // y (m entries, stride incY) += op(A) * x (k entries, stride incX), A stored as for multiply above
+    template <typename TA, typename TX>
+    static void multiplyVector(Transpose transA, int m, int k, const TA *a, int lda, const TX *x, int incX, float *y, int incY)
+    {
+        if (m > 0 && k > 0)
+        {
+            gemv(m, k, a, transA == TRANSPOSE ? 1 : lda, transA == TRANSPOSE ? lda : 1, x, incX, y, incY);
+        }
+    }
+
+    // B (cols x rows, leading dimension ldb) = transpose of A (rows x cols, leading dimension lda), for the cases
+    // that do need a transposed copy. 32 x 32 blocks are split into 8 x 8 tiles: a tile reads 8 rows and writes
+    // 8 rows of one cache line each, and a block keeps its 64 lines in L1 even when power-of-two strides map them
+    // to few cache sets, where a plain loop over one side misses on every access of the other
+    template <typename T>
+    static void transpose(int rows, int cols, const T *a, int lda, T *b, int ldb)
+    {
+        const int BLOCK = 32;
+        const int TILE = 8;
+        for (int ib = 0; ib < rows; ib += BLOCK)
+        {
+            for (int jb = 0; jb < cols; jb += BLOCK)
+            {
+                int iEnd = std::min(rows, ib + BLOCK);
+                int jEnd = std::min(cols, jb + BLOCK);
+                for (int i = ib; i < iEnd; i += TILE)
+                {
+                    for (int j = jb; j < jEnd; j += TILE)
+                    {
+                        if (i + TILE <= iEnd && j + TILE <= jEnd)
+                        {
+                            // full tile, fixed trip counts the compiler unrolls
+                            for (int jj = 0; jj < TILE; jj++)
+                            {
+                                for (int ii = 0; ii < TILE; ii++)
+                                {
+                                    b[(size_t)(j + jj) * ldb + i + ii] = a[(size_t)(i + ii) * lda + j + jj];
+                                }
+                            }
+                        }
+                        else
+                        {
+                            for (int jj = j; jj < std::min(jEnd, j + TILE); jj++)
+                            {
+                                for (int ii = i; ii < std::min(iEnd, i + TILE); ii++)
+                                {
+                                    b[(size_t)jj * ldb + ii] = a[(size_t)ii * lda + jj];
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Scalar fallback for any T: i-p-j order so the inner loop walks B and C contiguously
+    template <typename T>
+    static void multiplyStrided(int m, int n, int k, const T *a, int rsA, int csA, const T *b, int rsB, int csB, T *c, int ldc)
+    {
+        for (int pc = 0; pc < k; pc += KC)
+        {
+            int kc = std::min(KC, k - pc);
+            for (int i = 0; i < m; i++)
+            {
+                T *cRow = c + i * ldc;
+                for (int p = pc; p < pc + kc; p++)
+                {
+                    T aip = a[i * rsA + p * csA];
+                    const T *bRow = b + p * rsB;
+                    for (int j = 0; j < n; j++)
+                    {
+                        cRow[j] += aip * bRow[j * csB];
+                    }
+                }
+            }
+        }
+    }
+
+    // float gets packed panels and register-tiled micro-kernels
+    static void multiplyStrided(int m, int n, int k, const float *a, int rsA, int csA, const float *b, int rsB, int csB, float *c, int ldc)
+    {
+        multiplyMixed(m, n, k, a, rsA, csA, b, rsB, csB, c, ldc);
+    }
+
+    // C (float) += A * B for operands stored as float, BFloat16 or Half. the 16-bit operands are widened to float
+    // while they are packed, so the micro-kernels and the accumulation are the float ones and only the memory
+    // traffic of reading A and B is halved
+    template <typename TA, typename TB>
+    static void multiplyMixed(int m, int n, int k, const TA *a, int rsA, int csA, const TB *b, int rsB, int csB, float *c, int ldc)
+    {
+        if (m <= 0 || n <= 0 || k <= 0)
+        {
+            return;
+        }
+        // a matrix-vector product would waste most of a packed B panel on zero padding
+        if (n == 1)
+        {
+            gemv(m, k, a, rsA, csA, b, rsB, c, ldc);
+            return;
+        }
+        // a rank-1 update (e.g. the weights gradient of a single sample) is one pass over C, packing would double it
+        if (k == 1)
+        {
+            outer(m, n, a, rsA, b, csB, c, ldc);
+            return;
+        }
+        switch (activeIsa())
+        {
+#ifdef GEMM_X86
+        case AVX512:
+            blocked<8, 32>(m, n, k, a, rsA, csA, b, rsB, csB, c, ldc, kernelAvx512);
+            break;
+        case AVX2:
+            blocked<6, 16>(m, n, k, a, rsA, csA, b, rsB, csB, c, ldc, kernelAvx2);
+            break;
+#endif
+        default:
+            blocked<4, 8>(m, n, k, a, rsA, csA, b, rsB, csB, c, ldc, kernelScalar<4, 8>);
+            break;
+        }
+    }
+
+private:
+    typedef void (*Kernel)(int kc, const float *a, const float *b, float *c, int ldc, int mr, int nr);
+
+    static int roundUp(int x, int multiple)
+    {
+        return (x + multiple - 1) / multiple * multiple;
+    }
+
+    // Copy an mc x kc block of A into MR-row panels, each stored column by column (kc x MR), zero padded
+    // 16-bit entries are widened to float on the way
+    template <int MR, typename TA>
+    static void packA(int mc, int kc, const TA *a, int rsA, int csA, float *dst)
+    {
+        for (int ir = 0; ir < mc; ir += MR)
+        {
+            int mr = std::min(MR, mc - ir);
+            for (int p = 0; p < kc; p++)
+            {
+                for (int r = 0; r < MR; r++)
+                {
+                    *dst++ = r < mr ? (float)a[(ir + r) * rsA + p * csA] : 0.0f;
+                }
+            }
+        }
+    }
+
+    // Copy a kc x nc block of B into NR-column panels, each stored row by row (kc x NR), zero padded
+    template <int NR, typename TB>
+    static void packB(int kc, int nc, const TB *b, int rsB, int csB, float *dst)
+    {
+        for (int jr = 0; jr < nc; jr += NR)
+        {
+            int nr = std::min(NR, nc - jr);
+            for (int p = 0; p < kc; p++)
+            {
+                const TB *bRow = b + p * rsB + jr * csB;
+                for (int col = 0; col < NR; col++)
+                {
+                    *dst++ = col < nr ? (float)bRow[col * csB] : 0.0f;
+                }
+            }
+        }
+    }
+
+    // Five loops around the micro-kernel (Goto/BLIS ordering)
+    template <int MR, int NR, typename TA, typename TB>
+    static void blocked(int m, int n, int k, const TA *a, int rsA, int csA, const TB *b, int rsB, int csB, float *c, int ldc, Kernel kernel)
+    {
+        static_assert(MC % MR == 0 && NC % NR == 0, "block sizes must be multiples of the register tile");
+        // packing buffers live as long as the thread so steady-state multiplies do not allocate
+        thread_local std::vector<float> packedA;
+        thread_local std::vector<float> packedB;
+        packedA.resize((size_t)MC * KC);
+        packedB.resize((size_t)NC * KC);
+
+        for (int jc = 0; jc < n; jc += NC)
+        {
+            int nc = std::min(NC, n - jc);
+            for (int pc = 0; pc < k; pc += KC)
+            {
+                int kc = std::min(KC, k - pc);
+                packB<NR>(kc, nc, b + pc * rsB + jc * csB, rsB, csB, packedB.data());
+                for (int ic = 0; ic < m; ic += MC)
+                {
+                    int mc = std::min(MC, m - ic);
+                    packA<MR>(mc, kc, a + ic * rsA + pc * csA, rsA, csA, packedA.data());
+                    for (int jr = 0; jr < nc; jr += NR)
+                    {
+                        int nr = std::min(NR, nc - jr);
+                        for (int ir = 0; ir < mc; ir += MR)
+                        {
+                            int mr = std::min(MR, mc - ir);
+                            kernel(kc, packedA.data() + ir * kc, packedB.data() + jr * kc, c + (ic + ir) * ldc + jc + jr, ldc, mr, nr);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // add an MR x NR register tile spilled to memory onto the valid mr x nr corner of C
+    template <int NR>
+    static void addTile(const float *tile, float *c, int ldc, int mr, int nr)
+    {
+        for (int r = 0; r < mr; r++)
+        {
+            for (int col = 0; col < nr; col++)
+            {
+                c[r * ldc + col] += tile[r * NR + col];
+            }
+        }
+    }
+
+    // Portable micro-kernel, plain loops the compiler can vectorize for the baseline instruction set
+    template <int MR, int NR>
+    static void kernelScalar(int kc, const float *a, const float *b, float *c, int ldc, int mr, int nr)
+    {
+        float tile[MR * NR] = {};
+        for (int p = 0; p < kc; p++)
+        {
+            for (int r = 0; r < MR; r++)
+            {
+                for (int col = 0; col < NR; col++)
+                {
+                    tile[r * NR + col] += a[r] * b[col];
+                }
+            }
+            a += MR;
+            b += NR;
+        }
+        addTile<NR>(tile, c, ldc, mr, nr);
+    }
+
+    // C += x * yᵀ for a column x (m entries, stride incX) and a row y (n entries, stride incY)
+    template <typename TX, typename TY>
+    static void outer(int m, int n, const TX *x, int incX, const TY *y, int incY, float *c, int ldc)
+    {
+        for (int i = 0; i < m; i++)
+        {
+            float xi = (float)x[i * incX];
+            float *cRow = c + (size_t)i * ldc;
+            for (int j = 0; j < n; j++)
+            {
+                cRow[j] += xi * (float)y[j * incY];
+            }
+        }
+    }
+
+    // matrix-vector product y += A * x, y is a column of C
+    template <typename TA, typename TX>
+    static void gemv(int m, int k, const TA *a, int rsA, int csA, const TX *x, int incX, float *y, int incY)
+    {
+#ifdef GEMM_X86
+        if constexpr (std::is_same<TA, float>::value && std::is_same<TX, float>::value)
+        {
+            if (csA == 1 && incX == 1 && activeIsa() != SCALAR)
+            {
+                for (int i = 0; i < m; i++)
+                {
+                    y[i * incY] += dotAvx2(k, a + i * rsA, x);
+                }
+                return;
+            }
+        }
+#endif
+        // a transposed A has contiguous columns: add x[p] times column p to y, so every pass is a contiguous axpy
+        // instead of dot products striding through A
+        if (rsA == 1 && incY == 1)
+        {
+            for (int p = 0; p < k; p++)
+            {
+                float xp = (float)x[p * incX];
+                const TA *column = a + (size_t)p * csA;
+                for (int i = 0; i < m; i++)
+                {
+                    y[i] += xp * (float)column[i];
+                }
+            }
+            return;
+        }
+        for (int i = 0; i < m; i++)
+        {
+            float sum = 0;
+            for (int p = 0; p < k; p++)
+            {
+                sum += (float)a[i * rsA + p * csA] * (float)x[p * incX];
+            }
+            y[i * incY] += sum;
+        }
+    }
+
+#ifdef GEMM_X86
+    __attribute__((target("avx2,fma"))) static float dotAvx2(int n, const float *x, const float *y)
+    {
+        __m256 sum0 = _mm256_setzero_ps();
+        __m256 sum1 = _mm256_setzero_ps();
+        int i = 0;
+        for (; i + 16 <= n; i += 16)
+        {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+            sum1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i + 8), _mm256_loadu_ps(y + i + 8), sum1);
+        }
+        for (; i + 8 <= n; i += 8)
+        {
+            sum0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + i), _mm256_loadu_ps(y + i), sum0);
+        }
+        sum0 = _mm256_add_ps(sum0, sum1);
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(sum0), _mm256_extractf128_ps(sum0, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_movehdup_ps(half));
+        float sum = _mm_cvtss_f32(half);
+        for (; i < n; i++)
+        {
+            sum += x[i] * y[i];
+        }
+        return sum;
+    }
+
+    // 6 x 16 tile: 12 ymm accumulators, 2 for the B row and 1 broadcast of A
+    __attribute__((target("avx2,fma"))) static void kernelAvx2(int kc, const float *a, const float *b, float *c, int ldc, int mr, int nr)
+    {
+        __m256 acc[6][2];
+#pragma GCC unroll 6
+        for (int r = 0; r < 6; r++)
+        {
+            acc[r][0] = _mm256_setzero_ps();
+            acc[r][1] = _mm256_setzero_ps();
+        }
+        for (int p = 0; p < kc; p++)
+        {
+            __m256 b0 = _mm256_loadu_ps(b);
+            __m256 b1 = _mm256_loadu_ps(b + 8);
+#pragma GCC unroll 6
+            for (int r = 0; r < 6; r++)
+            {
+                __m256 ar = _mm256_broadcast_ss(a + r);
+                acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+                acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+            }
+            a += 6;
+            b += 16;
+        }
+        if (mr == 6 && nr == 16)
+        {
+#pragma GCC unroll 6
+            for (int r = 0; r < 6; r++)
+            {
+                float *cRow = c + r * ldc;
+                _mm256_storeu_ps(cRow, _mm256_add_ps(_mm256_loadu_ps(cRow), acc[r][0]));
+                _mm256_storeu_ps(cRow + 8, _mm256_add_ps(_mm256_loadu_ps(cRow + 8), acc[r][1]));
+            }
+            return;
+        }
+        float tile[6 * 16];
+        for (int r = 0; r < 6; r++)
+        {
+            _mm256_storeu_ps(tile + r * 16, acc[r][0]);
+            _mm256_storeu_ps(tile + r * 16 + 8, acc[r][1]);
+        }
+        addTile<16>(tile, c, ldc, mr, nr);
+    }
+
+    // 8 x 32 tile: 16 zmm accumulators out of 32 registers
+    __attribute__((target("avx512f"))) static void kernelAvx512(int kc, const float *a, const float *b, float *c, int ldc, int mr, int nr)
+    {
+        __m512 acc[8][2];
+#pragma GCC unroll 8
+        for (int r = 0; r < 8; r++)
+        {
+            acc[r][0] = _mm512_setzero_ps();
+            acc[r][1] = _mm512_setzero_ps();
+        }
+        for (int p = 0; p < kc; p++)
+        {
+            __m512 b0 = _mm512_loadu_ps(b);
+            __m512 b1 = _mm512_loadu_ps(b + 16);
+#pragma GCC unroll 8
+            for (int r = 0; r < 8; r++)
+            {
+                __m512 ar = _mm512_set1_ps(a[r]);
+                acc[r][0] = _mm512_fmadd_ps(ar, b0, acc[r][0]);
+                acc[r][1] = _mm512_fmadd_ps(ar, b1, acc[r][1]);
+            }
+            a += 8;
+            b += 32;
+        }
+        if (mr == 8 && nr == 32)
+        {
+#pragma GCC unroll 8
+            for (int r = 0; r < 8; r++)
+            {
+                float *cRow = c + r * ldc;
+                _mm512_storeu_ps(cRow, _mm512_add_ps(_mm512_loadu_ps(cRow), acc[r][0]));
+                _mm512_storeu_ps(cRow + 16, _mm512_add_ps(_mm512_loadu_ps(cRow + 16), acc[r][1]));
+            }
+            return;
+        }
+        float tile[8 * 32];
+        for (int r = 0; r < 8; r++)
+        {
+            _mm512_storeu_ps(tile + r * 32, acc[r][0]);
+            _mm512_storeu_ps(tile + r * 32 + 16, acc[r][1]);
+        }
+        addTile<32>(tile, c, ldc, mr, nr);
+    }
+#endif
+};
+
+#endif
@@ -0,0 +1,133 @@
+// Header guard
+#ifndef HALF_FLOAT_H
+#define HALF_FLOAT_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <type_traits>
+
+// 16-bit storage formats for Matrix, e.g. Matrix<BFloat16>
+// values are only stored in 16 bits: they convert to float implicitly, so every expression and every GEMM reads
+// them as float and accumulates in float, and they round (to nearest, ties to even) when a float is written back
+
+// bfloat16: the top half of a float. same range as float with 8 bits of precision, what mixed-precision training
+// stores weights & activations in, since gradients neither overflow nor underflow any more than in float
+struct BFloat16
+{
+    uint16_t bits = 0;
+
+    BFloat16() {}
+
+    BFloat16(float x) : bits(fromFloat(x)) {}
+
+    operator float() const
+    {
+        return toFloat(bits);
+    }
+
+    static uint16_t fromFloat(float x)
+    {
+        uint32_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        if ((u & 0x7fffffff) > 0x7f800000)
+        {
+            return (uint16_t)((u >> 16) | 0x40); // keep NaNs quiet NaNs
+        }
+        u += 0x7fff + ((u >> 16) & 1);
+        return (uint16_t)(u >> 16);
+    }
+
+    static float toFloat(uint16_t bits)
+    {
+        uint32_t u = (uint32_t)bits << 16;
+        float x;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+    }
+};
+
+// IEEE 754 half precision: 11 bits of precision but a largest value of 65504, fine for inference storage
+// (training in it needs loss scaling, use BFloat16 there)
+struct Half
+{
+    uint16_t bits = 0;
+
+    Half() {}
+
+    Half(float x) : bits(fromFloat(x)) {}
+
+    operator float() const
+    {
+        return toFloat(bits);
+    }
+
+    static uint16_t fromFloat(float x)
+    {
+        uint32_t u;
+        std::memcpy(&u, &x, sizeof(u));
+        uint16_t sign = (uint16_t)((u >> 16) & 0x8000);
+        uint32_t magnitude = u & 0x7fffffff;
+        if (magnitude >= 0x7f800000)
+        {
+            return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0); // infinity or a quiet NaN
+        }
+        if (magnitude >= 0x477ff000)
+        {
+            return sign | 0x7c00; // 65520 and up round to infinity
+        }
+        if (magnitude < 0x38800000)
+        {
+            // below the smallest normal half (2^-14): subnormal, in units of 2^-24
+            float absolute;
+            std::memcpy(&absolute, &magnitude, sizeof(absolute));
+            return sign | (uint16_t)std::nearbyint(absolute * 16777216.0f);
+        }
+        // rebias the exponent from 127 to 15 and round the mantissa from 23 to 10 bits, a carry bumps the exponent
+        magnitude += 0xfff + ((magnitude >> 13) & 1);
+        return sign | (uint16_t)((magnitude - 0x38000000) >> 13);
+    }
+
+    static float toFloat(uint16_t bits)
+    {
+        uint32_t sign = (uint32_t)(bits & 0x8000) << 16;
+        uint32_t exponent = (bits >> 10) & 0x1f;
+        uint32_t mantissa = bits & 0x3ff;
+        uint32_t u;
+        if (exponent == 0)
+        {
+            float x = (float)mantissa * (1.0f / 16777216.0f);
+            std::memcpy(&u, &x, sizeof(u));
+            u |= sign;
+        }
+        else if (exponent == 31)
+        {
+            u = sign | 0x7f800000 | (mantissa << 13);
+        }
+        else
+        {
+            u = sign | ((exponent + 112) << 23) | (mantissa << 13);
+        }
+        float x;
+        std::memcpy(&x, &u, sizeof(x));
+        return x;
+    }
+};
+
+// true for the 16-bit storage types, which have to accumulate into float
+template <typename T>
+struct IsHalfFloat : std::false_type
+{
+};
+
+template <>
+struct IsHalfFloat<BFloat16> : std::true_type
+{
+};
+
+template <>
+struct IsHalfFloat<Half> : std::true_type
+{
+};
+
+#endif
@@ -0,0 +1,156 @@
+// Header guard
+#ifndef INFERENCE_ENGINE_H
+#define INFERENCE_ENGINE_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Network.cpp"
+#include "Checkpoint.cpp"
+
+// Inference-only counterpart of Network for scoring jobs
+// it keeps the weights & biases of every layer and nothing else: no derivatives, no per-layer outputs, no training
+// buffers. activations alternate between two buffers sized for the widest layer, so the footprint of a batch is
+// 2 x widest x batchSize floats whatever the depth. the parameters are either copied out of a trained Network or
+// read in place from a MappedCheckpoint, in which case every engine mapping the same file shares them
+class InferenceEngine
+{
+private:
+    struct Layer
+    {
+        MatrixView<const float> weights;
+        MatrixView<const float> biases;
+    };
+
+    std::vector<Layer> layers;
+    Workspace parameters;  // copies of the parameters, empty when they live in a checkpoint
+    Workspace activations; // the two ping-pong buffers
+    MatrixView<float> buffers[2];
+    int batchSize = 0;
+    int widest = 0;
+
+public:
+    // copy the parameters of a trained network, maxBatchSize only sizes the initial buffers
+    explicit InferenceEngine(const Network &network, int maxBatchSize = 1024)
+    {
+        const std::vector<FullyConnectedLayer> &networkLayers = network.getLayers();
+        size_t total = 0;
+        for (const FullyConnectedLayer &layer : networkLayers)
+        {
+            total += Workspace::sizeOf(layer.getNoOutputNodes(), layer.getNoInputNodes()) + Workspace::sizeOf(layer.getNoOutputNodes(), 1);
+        }
+        parameters.reserve(total);
+        for (const FullyConnectedLayer &layer : networkLayers)
+        {
+            MatrixView<float> weights = parameters.allocate(layer.getNoOutputNodes(), layer.getNoInputNodes());
+            MatrixView<float> biases = parameters.allocate(layer.getNoOutputNodes(), 1);
+            std::copy(layer.getWeights().data.begin(), layer.getWeights().data.end(), weights.data);
+            std::copy(layer.getBiases().data.begin(), layer.getBiases().data.end(), biases.data);
+            layers.push_back({weights, biases});
+        }
+        plan(maxBatchSize);
+    }
+
+    // read the parameters straight out of the mapping, which must outlive the engine
+    explicit InferenceEngine(const MappedCheckpoint &checkpoint, int maxBatchSize = 1024)
+    {
+        for (int i = 0; i < checkpoint.noLayers(); i++)
+        {
+            layers.push_back({checkpoint.weights(i), checkpoint.biases(i)});
+        }
+        plan(maxBatchSize);
+    }
+
+    // the buffers are the engine's own, so a copy has to plan again
+    InferenceEngine(const InferenceEngine &) = delete;
+    InferenceEngine &operator=(const InferenceEngine &) = delete;
+
+    int getNoInputs() const
+    {
+        return layers[0].weights.noColumns;
+    }
+
+    int getNoOutputs() const
+    {
+        return layers.back().weights.noRows;
+    }
+
+    // grow the ping-pong buffers to hold batches of up to batchSize entries, nothing happens if they already do
+    void plan(int _batchSize)
+    {
+        if (batchSize >= _batchSize)
+        {
+            return;
+        }
+        widest = 0;
+        for (const Layer &layer : layers)
+        {
+            widest = std::max(widest, layer.weights.noRows);
+        }
+        activations.reserve(2 * Workspace::sizeOf(widest, _batchSize));
+        buffers[0] = activations.allocate(widest, _batchSize);
+        buffers[1] = activations.allocate(widest, _batchSize);
+        batchSize = _batchSize;
+    }
+
+    // outputs (noOutputs x count) of a batch with one entry per column (noInputs x count)
+    // the view is valid until the next call
+    MatrixView<const float> predict(MatrixView<const float> input)
+    {
+        return run(input.data, input.leadingDimension, 1, input.noColumns);
+    }
+
+    // same for count entries stored one after the other (count x noInputs), e.g. the features of a CsvDataset or
+    // of a f32 MappedDataset, which the first layer reads in place
+    MatrixView<const float> predictSamples(const float *samples, int count)
+    {
+        return run(samples, 1, getNoInputs(), count);
+    }
+
+    // index of the largest output of every entry of the batch
+    std::vector<int> argmax(MatrixView<const float> input)
+    {
+        return classify(predict(input));
+    }
+
+    std::vector<int> argmaxSamples(const float *samples, int count)
+    {
+        return classify(predictSamples(samples, count));
+    }
+
+    // index of the largest output in every column of outputs
+    static std::vector<int> classify(MatrixView<const float> outputs)
+    {
+        std::vector<int> classes(outputs.noColumns, 0);
+        for (int i = 1; i < outputs.noRows; i++)
+        {
+            for (int j = 0; j < outputs.noColumns; j++)
+            {
+                if (outputs.get(i, j) > outputs.get(classes[j], j))
+                {
+                    classes[j] = i;
+                }
+            }
+        }
+        return classes;
+    }
+
+private:
+    // layer i reads the buffer layer i - 1 wrote and writes the other one, the first layer reads the input
+    MatrixView<const float> run(const float *input, int rsInput, int csInput, int count)
+    {
+        plan(count);
+        MatrixView<float> output;
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            output = buffers[i % 2].reshaped(layers[i].weights.noRows, count);
+            FullyConnectedLayer::forwardPropagate(layers[i].weights, layers[i].biases, input, rsInput, csInput, output);
+            input = output.data;
+            rsInput = count;
+            csInput = 1;
+        }
+        return output;
+    }
+};
+
+#endif
@@ -5,10 +5,167 @@
 #include <vector>
 #include <string>
 #include <cmath>
+#include <type_traits>
+#include <cassert>
+
+#include "Gemm.cpp"
+#include "MatrixExpr.cpp"
+
+// Non-owning window onto row-major storage, e.g. a slice of a Workspace, a batch of columns of a dataset buffer or
+// a block of a weights matrix. row i starts leadingDimension entries after row i - 1, which is noColumns for
+// contiguous storage and more for a column slice of something wider
+// like Matrix it is a leaf of the lazy element-wise expressions, but it never reallocates
+template <typename T>
+class MatrixView : public MatrixExpr<MatrixView<T>>
+{
+public:
+    T *data;
+    int noRows;
+    int noColumns;
+    int leadingDimension;
+
+    MatrixView()
+    {
+        data = nullptr;
+        noRows = 0;
+        noColumns = 0;
+        leadingDimension = 0;
+    }
+
+    MatrixView(T *_data, int _noRows, int _noColumns)
+    {
+        data = _data;
+        noRows = _noRows;
+        noColumns = _noColumns;
+        leadingDimension = _noColumns;
+    }
+
+    MatrixView(T *_data, int _noRows, int _noColumns, int _leadingDimension)
+    {
+        data = _data;
+        noRows = _noRows;
+        noColumns = _noColumns;
+        leadingDimension = _leadingDimension;
+    }
+
+    // a writable view can always be read through a const one
+    template <typename U, typename = typename std::enable_if<std::is_same<const U, T>::value>::type>
+    MatrixView(const MatrixView<U> &other)
+    {
+        data = other.data;
+        noRows = other.noRows;
+        noColumns = other.noColumns;
+        leadingDimension = other.leadingDimension;
+    }
+
+    // whether the rows follow each other without gaps, so the entries can be walked as one array of size()
+    bool isContiguous() const
+    {
+        return leadingDimension == noColumns || noRows <= 1;
+    }
+
+    // the same storage seen with another shape, e.g. a (rows x count) batch in a buffer planned for more columns
+    MatrixView reshaped(int rows, int columns) const
+    {
+        assert(isContiguous());
+        return MatrixView(data, rows, columns);
+    }
+
+    // rows [begin, begin + count), e.g. the outputs of a layer that belong to a block of its weights
+    MatrixView rowRange(int begin, int count) const
+    {
+        return MatrixView(data + (size_t)begin * leadingDimension, count, noColumns, leadingDimension);
+    }
+
+    // columns [begin, begin + count), e.g. a batch of samples out of a buffer that holds a whole dataset
+    MatrixView columnRange(int begin, int count) const
+    {
+        return MatrixView(data + begin, noRows, count, leadingDimension);
+    }
+
+    MatrixView block(int row, int column, int rows, int columns) const
+    {
+        return rowRange(row, rows).columnRange(column, columns);
+    }
+
+    int size() const
+    {
+        return noRows * noColumns;
+    }
+
+    T *row(int i) const
+    {
+        return data + (size_t)i * leadingDimension;
+    }
+
+    T get(int row, int col) const
+    {
+        return data[(size_t)row * leadingDimension + col];
+    }
+
+    MatrixView &setAll(T x)
+    {
+        for (int i = 0; i < noRows; i++)
+        {
+            std::fill(row(i), row(i) + noColumns, x);
+        }
+        return *this;
+    }
+
+    // Evaluate an element-wise expression into the viewed storage, the shape stays the view's own
+    template <typename E>
+    MatrixView &assign(const MatrixExpr<E> &expr)
+    {
+        const E &e = expr.self();
+        for (int i = 0; i < noRows; i++)
+        {
+            T *values = row(i);
+            for (int j = 0; j < noColumns; j++)
+            {
+                values[j] = e.get(i, j);
+            }
+        }
+        return *this;
+    }
+
+    // the in-place operations of Matrix, on any view of the same shape
+    MatrixView &add(MatrixView<const T> m2)
+    {
+        return assign(*this + m2);
+    }
+
+    MatrixView &subtract(MatrixView<const T> m2)
+    {
+        return assign(*this - m2);
+    }
+
+    MatrixView &hProduct(MatrixView<const T> m2)
+    {
+        return assign(::hProduct(*this, m2));
+    }
+
+    MatrixView &multiply(T x)
+    {
+        return assign(x * *this);
+    }
+
+    MatrixView &addToColumns(MatrixView<const T> column)
+    {
+        return assign(*this + broadcastColumn(column));
+    }
+};
+
+// Dimensions of a new Matrix, e.g. Matrix<float>({rows, columns})
+struct MatrixShape
+{
+    int noRows;
+    int noColumns;
+};
 
 // Class template Matrix parametized by type T
+// A Matrix is also the leaf of the lazy element-wise expressions in MatrixExpr.cpp
 template <typename T>
-class Matrix
+class Matrix : public MatrixExpr<Matrix<T>>
 {
 public:
     // Class members
@@ -25,31 +182,79 @@ public:
     }
 
     // Initiate a matrix with all zero entries
-    explicit Matrix(const std::vector<int> size)
+    explicit Matrix(MatrixShape size)
     {
-        noRows = size[0];
-        noColumns = size[1];
-        data = std::vector<T>(noRows * noColumns);
+        noRows = size.noRows;
+        noColumns = size.noColumns;
+        data = std::vector<T>((size_t)noRows * noColumns);
     }
 
     // Initiate a matrix with the same entry
-    Matrix(const std::vector<int> size, T temp)
+    Matrix(MatrixShape size, T temp)
     {
-        noRows = size[0];
-        noColumns = size[1];
-        data = std::vector<T>(noRows * noColumns);
-        for (T &i : data)
-        { // iterates over every reference i of type T in data
-            i = temp;
+        noRows = size.noRows;
+        noColumns = size.noColumns;
+        data = std::vector<T>((size_t)noRows * noColumns, temp);
+    }
+
+    // Initiate a matrix with all given entries, moved in when they are a temporary
+    Matrix(MatrixShape size, std::vector<T> _data)
+    {
+        noRows = size.noRows;
+        noColumns = size.noColumns;
+        data = std::move(_data);
+    }
+
+    // Copy the entries of a view, e.g. to keep a slice of a larger buffer
+    explicit Matrix(MatrixView<const T> other)
+    {
+        noRows = other.noRows;
+        noColumns = other.noColumns;
+        data.resize((size_t)noRows * noColumns);
+        view().assign(other);
+    }
+
+    // Evaluate an element-wise expression (see MatrixExpr.cpp) into a new matrix in one pass
+    template <typename E>
+    explicit Matrix(const MatrixExpr<E> &expr)
+    {
+        noRows = 0;
+        noColumns = 0;
+        assign(expr);
+    }
+
+    // Evaluate an element-wise expression into this matrix in one pass, resizing it if needed
+    // the expression may read this matrix, since every entry only depends on the entries at the same position
+    template <typename E>
+    Matrix &assign(const MatrixExpr<E> &expr)
+    {
+        const E &e = expr.self();
+        if (noRows != e.noRows || noColumns != e.noColumns)
+        {
+            noRows = e.noRows;
+            noColumns = e.noColumns;
+            data.resize(noRows * noColumns);
         }
+        for (int i = 0; i < noRows; i++)
+        {
+            T *row = data.data() + i * noColumns;
+            for (int j = 0; j < noColumns; j++)
+            {
+                row[j] = e.get(i, j);
+            }
+        }
+        return *this;
     }
 
-    // Initiate a matrix with all given entries
-    Matrix(const std::vector<int> size, const std::vector<T> &_data)
+    // Non-owning views of the whole matrix, valid until the matrix is resized
+    MatrixView<T> view()
     {
-        noRows = size[0];
-        noColumns = size[1];
-        data = _data;
+        return MatrixView<T>(data.data(), noRows, noColumns);
+    }
+
+    MatrixView<const T> view() const
+    {
+        return MatrixView<const T>(data.data(), noRows, noColumns);
     }
 
     // Instance method set all entries of the matrix to a given value
@@ -62,9 +267,11 @@ public:
         return *this;
     }
     // Make a static method for every instance method
-    static Matrix setAll(const Matrix &m, T x)
+    // the static forms take their first matrix by value: a temporary is moved in and reused for the result
+    static Matrix setAll(Matrix m, T x)
     {
-        return Matrix(m).setAll(x);
+        m.setAll(x);
+        return m;
     }
 
     // Set a specific entry to a given value
@@ -74,9 +281,10 @@ public:
         return *this;
     }
     
-    static Matrix set(const Matrix &m, int row, int column, T value)
+    static Matrix set(Matrix m, int row, int column, T value)
     {
-        return Matrix(m).set(row, column, value);
+        m.set(row, column, value);
+        return m;
     }
 
     // Instance method add 2 matrices
@@ -89,9 +297,16 @@ public:
         return *this;
     }
 
-    static Matrix add(const Matrix &m1, const Matrix &m2)
+    static Matrix add(Matrix m1, const Matrix &m2)
     {
-        return Matrix(m1).add(m2);
+        m1.add(m2);
+        return m1;
+    }
+
+    // out = m1 + m2 into existing storage, any of the three may be a slice
+    static void add(MatrixView<const T> m1, MatrixView<const T> m2, MatrixView<T> out)
+    {
+        out.assign(m1 + m2);
     }
 
     // Instance method subtract 2 matrices
@@ -104,9 +319,61 @@ public:
         return *this;
     }
 
-    static Matrix subtract(const Matrix &m1, const Matrix &m2)
+    static Matrix subtract(Matrix m1, const Matrix &m2)
+    {
+        m1.subtract(m2);
+        return m1;
+    }
+
+    static void subtract(MatrixView<const T> m1, MatrixView<const T> m2, MatrixView<T> out)
+    {
+        out.assign(m1 - m2);
+    }
+
+    // Add a column vector to every column of the matrix, e.g. biases across a mini-batch
+    Matrix &addToColumns(const Matrix &column)
     {
-        return Matrix(m1).subtract(m2);
+        for (int i = 0; i < noRows; i++)
+        {
+            T value = column.data[i];
+            for (int j = 0; j < noColumns; j++)
+            {
+                data[i * noColumns + j] += value;
+            }
+        }
+        return *this;
+    }
+
+    static Matrix addToColumns(Matrix m, const Matrix &column)
+    {
+        m.addToColumns(column);
+        return m;
+    }
+
+    static void addToColumns(MatrixView<const T> m, MatrixView<const T> column, MatrixView<T> out)
+    {
+        out.assign(m + broadcastColumn(column));
+    }
+
+    // Sum each row into a column vector, the reverse of addToColumns
+    Matrix sumColumns() const
+    {
+        Matrix result({noRows, 1});
+        for (int i = 0; i < noRows; i++)
+        {
+            T sum = 0;
+            for (int j = 0; j < noColumns; j++)
+            {
+                sum += data[i * noColumns + j];
+            }
+            result.data[i] = sum;
+        }
+        return result;
+    }
+
+    static Matrix sumColumns(const Matrix &m)
+    {
+        return m.sumColumns();
     }
 
     // get the value at a specific entry of the matrix
@@ -130,32 +397,60 @@ public:
         return *this;
     }
 
-    static Matrix hProduct(const Matrix &m1, const Matrix &m2)
+    static Matrix hProduct(Matrix m1, const Matrix &m2)
+    {
+        m1.hProduct(m2);
+        return m1;
+    }
+
+    static void hProduct(MatrixView<const T> m1, MatrixView<const T> m2, MatrixView<T> out)
     {
-        return Matrix(m1).hProduct(m2);
+        out.assign(::hProduct(m1, m2));
     }
 
     // Multiply two matrices by dot product
+    // float goes through the blocked SIMD kernels in Gemm, any other T through the scalar fallback
+    // 16-bit matrices (BFloat16, Half) are widened in the packing step and accumulate in float, rounded once at the end
     Matrix multiply(const Matrix &m2) const
     {
         Matrix result({noRows, m2.noColumns});
-        for (int i = 0; i < result.noRows; i++)
+        if constexpr (IsHalfFloat<T>::value)
         {
-            for (int j = 0; j < result.noColumns; j++)
-            {
-                for (int order = 0; order < noColumns; order++)
-                    result.data[i * result.noColumns + j] = data[i * noColumns + order] * m2.data[m2.noColumns * order + j];
-            }
+            Matrix<float> sum({noRows, m2.noColumns});
+            Gemm::multiplyMixed(noRows, m2.noColumns, noColumns, data.data(), noColumns, 1, m2.data.data(), m2.noColumns, 1, sum.data.data(), sum.noColumns);
+            result.assign(sum);
+        }
+        else
+        {
+            Gemm::multiply(noRows, m2.noColumns, noColumns, data.data(), noColumns, m2.data.data(), m2.noColumns, result.data.data(), result.noColumns);
         }
         return result;
     }
 
+    // a copy with every entry converted to U, e.g. the BFloat16 storage of float weights
+    template <typename U>
+    Matrix<U> converted() const
+    {
+        return Matrix<U>(*this);
+    }
+
     static Matrix multiply(const Matrix &m1, const Matrix &m2)
     {
         return m1.multiply(m2);
     }
 
-    // Transpose a matrix
+    // out = m1 * m2 into existing storage, every operand read through its leading dimension so blocks of larger
+    // matrices multiply in place. 16-bit products accumulate in float, see Gemm::multiplyMixed
+    static void multiply(MatrixView<const T> m1, MatrixView<const T> m2, MatrixView<T> out)
+    {
+        static_assert(!IsHalfFloat<T>::value, "16-bit operands multiply into a float result with Gemm::multiplyMixed");
+        out.setAll(0);
+        Gemm::multiplyStrided(m1.noRows, m2.noColumns, m1.noColumns, m1.data, m1.leadingDimension, 1, m2.data, m2.leadingDimension, 1, out.data,
+                              out.leadingDimension);
+    }
+
+    // Transpose a matrix, cache blocked (see Gemm::transpose)
+    // products with a transposed operand do not need this, Gemm::multiply takes transpose flags
     static Matrix transpose(const Matrix &m)
     {
         Matrix result({m.noColumns, m.noRows});
@@ -164,19 +459,19 @@ public:
             result.data = m.data;
             return result;
         }
-        for (int i = 0; i < result.noRows; i++)
-        {
-            for (int j = 0; j < result.noColumns; j++)
-            {
-                result.data[result.noColumns * i + j] = m.data[m.noColumns * j + i];
-            }
-        }
+        Gemm::transpose(m.noRows, m.noColumns, m.data.data(), m.noColumns, result.data.data(), result.noColumns);
         return result;
     }
 
+    // out (m.noColumns x m.noRows) = transpose of m, both possibly slices
+    static void transpose(MatrixView<const T> m, MatrixView<T> out)
+    {
+        Gemm::transpose(m.noRows, m.noColumns, m.data, m.leadingDimension, out.data, out.leadingDimension);
+    }
+
     Matrix &transpose ()
     {
-        *this = transpose(this);
+        *this = transpose(*this);
         return *this;
     }
 
@@ -190,9 +485,10 @@ public:
         return *this;
     }
 
-    static Matrix opElement(const Matrix &m, T (*func)(T))
+    static Matrix opElement(Matrix m, T (*func)(T))
     {
-        return Matrix(m).opElement(func);
+        m.opElement(func);
+        return m;
     }
 
     // Multiply all elements by a scalar value
@@ -205,9 +501,15 @@ public:
         return *this;
     }
 
-    static Matrix multiply(const Matrix &m, const T x)
+    static Matrix multiply(Matrix m, const T x)
+    {
+        m.multiply(x);
+        return m;
+    }
+
+    static void multiply(MatrixView<const T> m, T x, MatrixView<T> out)
     {
-        return Matrix(m).multiply(x);
+        out.assign(x * m);
     }
 
     // Divide all elements by a scalar value using multiply method
@@ -216,9 +518,10 @@ public:
         return multiply(1 / x);
     }
 
-    static Matrix divide(const Matrix &m, T x)
+    static Matrix divide(Matrix m, T x)
     {
-        return Matrix::multiply(m, 1 / x);
+        m.divide(x);
+        return m;
     }
 
     // To string a matrix
@@ -0,0 +1,205 @@
+// Header guard
+#ifndef MATRIX_EXPR_H
+#define MATRIX_EXPR_H
+
+#include <cmath>
+#include <algorithm>
+#include <type_traits>
+#include <cassert>
+
+#include "Activations.cpp"
+
+// Lazy element-wise expressions over Matrix
+// combining matrices with the operators below only builds a small tree of nodes; nothing is computed until the
+// tree is assigned to a Matrix, which then evaluates every entry in a single loop without temporaries,
+// e.g. output.assign(tanh(output + broadcastColumn(biases)))
+
+template <typename T>
+class Matrix;
+
+template <typename T>
+class MatrixView;
+
+// Base of every expression (and of Matrix itself), E is the concrete node type
+// every node has noRows, noColumns and get(row, col) like Matrix does
+template <typename E>
+struct MatrixExpr
+{
+    const E &self() const
+    {
+        return static_cast<const E &>(*this);
+    }
+};
+
+// Matrix leaves are held by reference, every other node is small and held by value
+template <typename E>
+struct ExprOperand
+{
+    typedef E type;
+};
+
+template <typename T>
+struct ExprOperand<Matrix<T>>
+{
+    typedef const Matrix<T> &type;
+};
+
+// A scalar used as an operand, e.g. the 1 in 1 - y * y. It fits any shape so it reports 0 x 0
+template <typename S>
+struct ScalarExpr : MatrixExpr<ScalarExpr<S>>
+{
+    int noRows = 0;
+    int noColumns = 0;
+    S value;
+
+    explicit ScalarExpr(S _value) : value(_value) {}
+
+    S get(int, int) const
+    {
+        return value;
+    }
+};
+
+// A column vector repeated over every column, e.g. biases across a mini-batch. Fits any number of columns
+template <typename T>
+struct ColumnBroadcastExpr : MatrixExpr<ColumnBroadcastExpr<T>>
+{
+    int noRows;
+    int noColumns = 0;
+    const T *column;
+
+    ColumnBroadcastExpr(const T *_column, int _noRows) : noRows(_noRows), column(_column) {}
+
+    T get(int row, int) const
+    {
+        return column[row];
+    }
+};
+
+// Apply Op to the entries of one expression
+template <typename Op, typename E>
+struct UnaryExpr : MatrixExpr<UnaryExpr<Op, E>>
+{
+    int noRows;
+    int noColumns;
+    typename ExprOperand<E>::type operand;
+
+    explicit UnaryExpr(const E &_operand) : noRows(_operand.noRows), noColumns(_operand.noColumns), operand(_operand) {}
+
+    auto get(int row, int col) const
+    {
+        return Op::apply(operand.get(row, col));
+    }
+};
+
+// Apply Op to the matching entries of two expressions, the shape is the one of the operand that is not broadcast
+// the shapes must agree in every dimension a side does not broadcast (report as 0), checked in debug builds
+template <typename Op, typename L, typename R>
+struct BinaryExpr : MatrixExpr<BinaryExpr<Op, L, R>>
+{
+    int noRows;
+    int noColumns;
+    typename ExprOperand<L>::type left;
+    typename ExprOperand<R>::type right;
+
+    BinaryExpr(const L &_left, const R &_right)
+        : noRows(std::max(_left.noRows, _right.noRows)), noColumns(std::max(_left.noColumns, _right.noColumns)),
+          left(_left), right(_right)
+    {
+        assert(_left.noRows == _right.noRows || _left.noRows == 0 || _right.noRows == 0);
+        assert(_left.noColumns == _right.noColumns || _left.noColumns == 0 || _right.noColumns == 0);
+    }
+
+    auto get(int row, int col) const
+    {
+        return Op::apply(left.get(row, col), right.get(row, col));
+    }
+};
+
+struct AddOp
+{
+    template <typename A, typename B>
+    static auto apply(A a, B b) { return a + b; }
+};
+
+struct SubtractOp
+{
+    template <typename A, typename B>
+    static auto apply(A a, B b) { return a - b; }
+};
+
+struct MultiplyOp
+{
+    template <typename A, typename B>
+    static auto apply(A a, B b) { return a * b; }
+};
+
+struct SquareOp
+{
+    template <typename A>
+    static auto apply(A a) { return a * a; }
+};
+
+// the same approximation as the vectorized kernels (Activations.cpp), so every path agrees
+struct TanhOp
+{
+    template <typename A>
+    static float apply(A a) { return Activations::tanh((float)a); }
+};
+
+template <typename L, typename R>
+BinaryExpr<AddOp, L, R> operator+(const MatrixExpr<L> &left, const MatrixExpr<R> &right)
+{
+    return BinaryExpr<AddOp, L, R>(left.self(), right.self());
+}
+
+template <typename L, typename R>
+BinaryExpr<SubtractOp, L, R> operator-(const MatrixExpr<L> &left, const MatrixExpr<R> &right)
+{
+    return BinaryExpr<SubtractOp, L, R>(left.self(), right.self());
+}
+
+template <typename S, typename R, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+BinaryExpr<SubtractOp, ScalarExpr<S>, R> operator-(S left, const MatrixExpr<R> &right)
+{
+    return BinaryExpr<SubtractOp, ScalarExpr<S>, R>(ScalarExpr<S>(left), right.self());
+}
+
+template <typename S, typename R, typename = typename std::enable_if<std::is_arithmetic<S>::value>::type>
+BinaryExpr<MultiplyOp, ScalarExpr<S>, R> operator*(S left, const MatrixExpr<R> &right)
+{
+    return BinaryExpr<MultiplyOp, ScalarExpr<S>, R>(ScalarExpr<S>(left), right.self());
+}
+
+// Hadamard (element-wise) product, the lazy counterpart of Matrix::hProduct
+template <typename L, typename R>
+BinaryExpr<MultiplyOp, L, R> hProduct(const MatrixExpr<L> &left, const MatrixExpr<R> &right)
+{
+    return BinaryExpr<MultiplyOp, L, R>(left.self(), right.self());
+}
+
+template <typename E>
+UnaryExpr<SquareOp, E> square(const MatrixExpr<E> &operand)
+{
+    return UnaryExpr<SquareOp, E>(operand.self());
+}
+
+template <typename E>
+UnaryExpr<TanhOp, E> tanh(const MatrixExpr<E> &operand)
+{
+    return UnaryExpr<TanhOp, E>(operand.self());
+}
+
+template <typename T>
+ColumnBroadcastExpr<T> broadcastColumn(const Matrix<T> &column)
+{
+    return ColumnBroadcastExpr<T>(column.data.data(), column.noRows);
+}
+
+template <typename T>
+ColumnBroadcastExpr<T> broadcastColumn(MatrixView<const T> column)
+{
+    return ColumnBroadcastExpr<T>(column.data, column.noRows);
+}
+
+#endif
@@ -1,19 +1,78 @@
+// Header guard
+#ifndef NETWORK_H
+#define NETWORK_H
+
 #include <vector>
 #include <random>
 #include <cmath>
 #include <iostream>
 #include <thread>
+#include <chrono>
+#include <algorithm>
 
 #include "FullyConnectedLayer.cpp"
+#include "ThreadPool.cpp"
+#include "Workspace.cpp"
+#include "AllocationCounter.cpp"
+#include "Profiler.cpp"
+#include "Dataset.cpp"
+#include "CsvLoader.cpp"
+#include "DataPipeline.cpp"
+#include "Collective.cpp"
+#include "Evaluation.cpp"
+#include "Checkpointing.cpp"
+
+// Every buffer a training or inference step needs for a given batch size, carved out of one Workspace
+// copying a network does not copy its plan, the copy plans again on first use
+struct NetworkPlan
+{
+    int batchSize = 0;
+    Workspace arena;
+    MatrixView<float> input;
+    MatrixView<float> expectedOutput;
+    std::vector<MatrixView<float>> outputs; // one per layer
+    MatrixView<float> gradients[2];         // derivatives wrt the current layer's output and input, swapped every layer
+
+    // mixed precision: the hidden layers' outputs are kept in bfloat16 (their float outputs stay empty), each one
+    // computed in float in scratch first. the last layer's output, the loss and every derivative stay float
+    std::vector<MatrixView<BFloat16>> storedOutputs;
+    MatrixView<float> scratch;
+
+    // the batch's input in compressed form when the first layer took its sparse path, empty otherwise
+    SparseColumns sparseInput;
+
+    // which outputs are kept for the backward pass under an activation budget, the others share segment buffers
+    CheckpointPlan checkpoints;
+
+    NetworkPlan() {}
+
+    NetworkPlan(const NetworkPlan &) {}
+
+    NetworkPlan &operator=(const NetworkPlan &)
+    {
+        batchSize = 0;
+        arena = Workspace();
+        outputs.clear();
+        storedOutputs.clear();
+        checkpoints = CheckpointPlan();
+        return *this;
+    }
+};
 
 class Network
 {
 private:
     std::vector<FullyConnectedLayer> layers;
+    NetworkPlan stepPlan;
+    bool mixedPrecision = false;
+    Optimizer optimizer;
+    TopologySettings topologySettings;
+    Topology topology;
+    size_t activationBudget = 0;
 
 public:
     // constructor
-    explicit Network(std::vector<std::vector<int>> dimensions)
+    explicit Network(const std::vector<std::vector<int>> &dimensions)
     {
         // dimensions contain number of input nodes & output nodes in pairs for each of the layers
         for (int i = 0; i < dimensions.size(); i++)
@@ -22,6 +81,124 @@ public:
         }
     }
 
+    const std::vector<FullyConnectedLayer> &getLayers() const
+    {
+        return layers;
+    }
+
+    void setLayerParameters(int layer, MatrixView<const float> weights, MatrixView<const float> biases)
+    {
+        layers[layer].setParameters(weights, biases);
+    }
+
+    // mixed-precision training & inference: weights and hidden activations are stored as bfloat16, halving the
+    // memory traffic of every product, while products accumulate in float and updates go to float master weights
+    void setMixedPrecision(bool enabled)
+    {
+        mixedPrecision = enabled;
+        for (FullyConnectedLayer &layer : layers)
+        {
+            layer.setMixedPrecision(enabled);
+        }
+        stepPlan = NetworkPlan();
+    }
+
+    bool isMixedPrecision() const
+    {
+        return mixedPrecision;
+    }
+
+    // how applyDerivatives (every synchronous training loop) updates the parameters, plain SGD by default.
+    // starts the optimizer afresh, without velocities or moments. noThreads > 1 (or <= 0 for every hardware
+    // thread) splits the steps of single-threaded loops over a pool of the optimizer's; trainThreaded lends it its own
+    void setOptimizer(const OptimizerSettings &settings, int noThreads = 1)
+    {
+        optimizer = Optimizer(settings, noThreads);
+    }
+
+    const OptimizerSettings &getOptimizerSettings() const
+    {
+        return optimizer.getSettings();
+    }
+
+    // the optimizer as the last step left it, e.g. to save its state
+    const Optimizer &getOptimizer() const
+    {
+        return optimizer;
+    }
+
+    // the optimizer with every layer's weights & biases registered (layer i's are tensors 2i and 2i + 1) the way
+    // a step registers them, e.g. to restore its state before training resumes
+    Optimizer &prepareOptimizer()
+    {
+        optimizer.clearTensors();
+        for (FullyConnectedLayer &layer : layers)
+        {
+            layer.addParameters(optimizer);
+        }
+        return optimizer;
+    }
+
+    // where trainThreaded & trainAsync put their threads, weights and samples on a multi-socket machine, by default
+    // wherever the scheduler and the first writer do. the topology is detected here unless given, e.g. to lay the
+    // workers out for another machine
+    void setTopology(const TopologySettings &settings)
+    {
+        setTopology(settings, Topology::detect());
+    }
+
+    void setTopology(const TopologySettings &settings, const Topology &_topology)
+    {
+        topologySettings = settings;
+        topology = _topology;
+    }
+
+    const TopologySettings &getTopologySettings() const
+    {
+        return topologySettings;
+    }
+
+    // memory-bounded training: the planned step keeps at most about bytes of layer outputs (0: no limit) from its
+    // forward pass, recomputing the others during the backward pass from the checkpoints CheckpointPlanner picks.
+    // batches and stacks too large for memory (or cache) train at the price of forwarding some layers twice
+    void setActivationBudget(size_t bytes)
+    {
+        activationBudget = bytes;
+        stepPlan = NetworkPlan();
+    }
+
+    size_t getActivationBudget() const
+    {
+        return activationBudget;
+    }
+
+    // the checkpoints of the current plan, e.g. to report what the budget costs
+    const CheckpointPlan &getCheckpointPlan() const
+    {
+        return stepPlan.checkpoints;
+    }
+
+    // the layout the threaded training loops use for noThreads workers (<= 0: one per cpu), which they also print
+    // replicable is false for a loop that needs one shared copy of the weights (trainAsync)
+    std::string describeTopology(int noThreads = 0, bool replicable = true) const
+    {
+        if (!topologySettings.pinned())
+        {
+            return "threads placed by the scheduler, weights & samples shared";
+        }
+        std::string text = topology.describe(noThreads > 0 ? noThreads : topology.noCpus()) + ", pinned";
+        if (topology.noNodes() == 1 || topologySettings.weights == WeightPlacement::SHARED ||
+            (topologySettings.weights == WeightPlacement::REPLICATED && !replicable))
+        {
+            text += ", weights shared";
+        }
+        else
+        {
+            text += topologySettings.weights == WeightPlacement::REPLICATED ? ", weights replicated per node" : ", weights interleaved";
+        }
+        return text + (topologySettings.partitionData ? ", samples partitioned per node" : ", samples shared");
+    }
+
     // assign random weights & biases to each layer
     void randomNetwork()
     {
@@ -37,40 +214,342 @@ public:
 
     // Forrward pass, get all outputs of all layers
     // input is a vector with size equal to noInputNodes of 1st layer, similarly output size equals nOutputNodes of last layer
-    std::vector<Matrix<float>> runNetwork(Matrix<float> input)
+    // each output is moved into the result as soon as it is made, no layer's output is copied
+    std::vector<Matrix<float>> runNetwork(const Matrix<float> &input) const
+    {
+        return runLayers(layers, input);
+    }
+
+    // same through a copy of the layers, e.g. the replica on the calling thread's node
+    static std::vector<Matrix<float>> runLayers(const std::vector<FullyConnectedLayer> &replica, const Matrix<float> &input)
     {
         std::vector<Matrix<float>> outputs;
-        for (int i = 0; i < layers.size(); i++)
+        outputs.reserve(replica.size());
+        for (int i = 0; i < (int)replica.size(); i++)
         {
-            input = layers[i].forwardPropagate(input);
-            outputs.push_back(input);
+            outputs.push_back(replica[i].forwardPropagate(i == 0 ? input : outputs.back()));
         }
         return outputs;
     }
 
     // get loss using mean-squared error loss
+    // for a mini-batch (one sample per column) this is the sum of the losses of its samples
     static float getLoss(const Matrix<float> &output, const Matrix<float> &expectedOutput)
     {
         float totalError = 0;
-        for (int i = 0; i < expectedOutput.noRows; i++)
+        for (int i = 0; i < (int)expectedOutput.data.size(); i++)
         {
-            totalError += (float)std::pow(output.get(i, 0) - expectedOutput.get(i, 0), 2.0f);
+            totalError += (float)std::pow(output.data[i] - expectedOutput.data[i], 2.0f);
         }
         return totalError / (float)expectedOutput.noRows;
     }
 
-    // get the gradient of the loss wrt the final layer's outputs
-    static Matrix<float> getLossGradient(const Matrix<float> &output, const Matrix<float> &expectedOutput)
+    static float getLoss(MatrixView<const float> output, MatrixView<const float> expectedOutput)
     {
-        Matrix<float> derivatives({output.noRows, 1});
+        float totalError = 0;
         for (int i = 0; i < output.noRows; i++)
         {
-            float currentDerivative = -2.0f / output.noRows * (expectedOutput.get(i, 0) - output.get(i, 0));
-            derivatives.set(i, 0, currentDerivative);
+            const float *outputs = output.row(i);
+            const float *expected = expectedOutput.row(i);
+            for (int j = 0; j < output.noColumns; j++)
+            {
+                float error = outputs[j] - expected[j];
+                totalError += error * error;
+            }
+        }
+        return totalError / (float)expectedOutput.noRows;
+    }
+
+    // get the gradient of the loss wrt the final layer's outputs, column by column for a mini-batch
+    static Matrix<float> getLossGradient(const Matrix<float> &output, const Matrix<float> &expectedOutput)
+    {
+        Matrix<float> derivatives({output.noRows, output.noColumns});
+        for (int i = 0; i < (int)output.data.size(); i++)
+        {
+            derivatives.data[i] = -2.0f / output.noRows * (expectedOutput.data[i] - output.data[i]);
         }
         return derivatives;
     }
 
+    static void getLossGradient(MatrixView<const float> output, MatrixView<const float> expectedOutput, MatrixView<float> derivatives)
+    {
+        derivatives.assign((-2.0f / output.noRows) * (expectedOutput - output));
+    }
+
+    // gather entries [start, start + count) of the training data into one matrix, one sample per column
+    // index 0 picks the inputs, index 1 the expected outputs
+    static Matrix<float> makeBatch(const std::vector<std::vector<Matrix<float>>> &data, int start, int count, int index)
+    {
+        Matrix<float> batch({data[start][index].noRows, count});
+        gatherBatch(data, start, count, index, batch.view());
+        return batch;
+    }
+
+    // same into preallocated (rows x count) storage
+    static void gatherBatch(const std::vector<std::vector<Matrix<float>>> &data, int start, int count, int index, MatrixView<float> batch)
+    {
+        for (int j = 0; j < count; j++)
+        {
+            const std::vector<float> &sample = data[start + j][index].data;
+            for (int i = 0; i < batch.noRows; i++)
+            {
+                batch.row(i)[j] = sample[i];
+            }
+        }
+    }
+
+    // size every activation & derivative buffer for mini-batches of up to batchSize entries from the layer
+    // dimensions and carve them out of a single aligned allocation. trainBatch and runPlanned then never touch the heap
+    // under an activation budget only the checkpointed outputs get buffers of their own, the outputs of every
+    // segment in between are allocated over the same floats
+    void plan(int batchSize)
+    {
+        if (stepPlan.batchSize >= batchSize)
+        {
+            return;
+        }
+        int noInputs = layers[0].getNoInputNodes();
+        int noOutputs = layers.back().getNoOutputNodes();
+        int widest = noInputs;
+        std::vector<size_t> outputBytes;
+        std::vector<double> outputCost;
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            size_t floats = isStoredOutput(i) ? Workspace::sizeOf<BFloat16>(layers[i].getNoOutputNodes(), batchSize)
+                                              : Workspace::sizeOf(layers[i].getNoOutputNodes(), batchSize);
+            outputBytes.push_back(floats * sizeof(float));
+            outputCost.push_back((double)layers[i].getNoInputNodes() * layers[i].getNoOutputNodes());
+            widest = std::max(widest, layers[i].getNoOutputNodes());
+        }
+        stepPlan.checkpoints = CheckpointPlanner::plan(outputBytes, outputCost, activationBudget);
+
+        size_t total = Workspace::sizeOf(noInputs, batchSize) + Workspace::sizeOf(noOutputs, batchSize);
+        total += stepPlan.checkpoints.activationBytes / sizeof(float);
+        total += 2 * Workspace::sizeOf(widest, batchSize);
+        if (mixedPrecision)
+        {
+            total += Workspace::sizeOf(widest, batchSize);
+        }
+
+        stepPlan.arena.reserve(total);
+        stepPlan.batchSize = batchSize;
+        stepPlan.input = stepPlan.arena.allocate(noInputs, batchSize);
+        stepPlan.expectedOutput = stepPlan.arena.allocate(noOutputs, batchSize);
+        stepPlan.outputs.assign(layers.size(), MatrixView<float>());
+        stepPlan.storedOutputs.assign(layers.size(), MatrixView<BFloat16>());
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            if (stepPlan.checkpoints.isKept(i))
+            {
+                allocateOutput(i, batchSize);
+            }
+        }
+        // the segments start at the same mark, the arena continues after the largest
+        size_t segments = stepPlan.arena.mark();
+        size_t segmentsEnd = segments;
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            if (stepPlan.checkpoints.isKept(i))
+            {
+                stepPlan.arena.rewind(segments);
+                continue;
+            }
+            allocateOutput(i, batchSize);
+            segmentsEnd = std::max(segmentsEnd, stepPlan.arena.mark());
+        }
+        stepPlan.arena.rewind(segmentsEnd);
+        stepPlan.gradients[0] = stepPlan.arena.allocate(widest, batchSize);
+        stepPlan.gradients[1] = stepPlan.arena.allocate(widest, batchSize);
+        stepPlan.scratch = mixedPrecision ? stepPlan.arena.allocate(widest, batchSize) : MatrixView<float>();
+        stepPlan.sparseInput.reserve(noInputs, std::min(batchSize, FullyConnectedLayer::SPARSE_MAX_BATCH), FullyConnectedLayer::SPARSE_DENSITY);
+    }
+
+    void allocateOutput(int i, int batchSize)
+    {
+        if (isStoredOutput(i))
+        {
+            stepPlan.storedOutputs[i] = stepPlan.arena.allocate<BFloat16>(layers[i].getNoOutputNodes(), batchSize);
+        }
+        else
+        {
+            stepPlan.outputs[i] = stepPlan.arena.allocate(layers[i].getNoOutputNodes(), batchSize);
+        }
+    }
+
+    // whether the planned output of layer i is kept in bfloat16
+    bool isStoredOutput(int i) const
+    {
+        return mixedPrecision && i + 1 < (int)layers.size();
+    }
+
+    // forward pass on the planned buffers, input has one entry per column. returns a view of the last layer's output,
+    // valid until the next planned step
+    MatrixView<float> runPlanned(MatrixView<const float> input)
+    {
+        plan(input.noColumns);
+        int batchSize = input.noColumns;
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            forwardPlanned(i, input, batchSize);
+        }
+        return stepPlan.outputs.back().reshaped(layers.back().getNoOutputNodes(), batchSize);
+    }
+
+    // layer i's part of runPlanned, reading the planned output of the layer below (the batch input for the first)
+    void forwardPlanned(int i, MatrixView<const float> input, int count)
+    {
+        int noOutputs = layers[i].getNoOutputNodes();
+        MatrixView<float> output = (isStoredOutput(i) ? stepPlan.scratch : stepPlan.outputs[i]).reshaped(noOutputs, count);
+        if (i > 0 && isStoredOutput(i - 1))
+        {
+            layers[i].forwardPropagate(storedOutput(i - 1, count), output);
+        }
+        else if (i == 0)
+        {
+            layers[i].forwardPropagate(input, output, stepPlan.sparseInput);
+        }
+        else
+        {
+            layers[i].forwardPropagate(stepPlan.outputs[i - 1].reshaped(layers[i].getNoInputNodes(), count), output);
+        }
+        if (isStoredOutput(i))
+        {
+            stepPlan.storedOutputs[i].reshaped(noOutputs, count).assign(output);
+        }
+    }
+
+    // forward the dropped outputs of the segment ending at layer top again, from the checkpoint below it
+    void recomputeSegment(int top, MatrixView<const float> input, int count)
+    {
+        int bottom = top;
+        while (bottom > 0 && !stepPlan.checkpoints.isKept(bottom - 1))
+        {
+            bottom--;
+        }
+        NN_PROFILE_SCOPE("network.recompute");
+        for (int i = bottom; i <= top; i++)
+        {
+            forwardPlanned(i, input, count);
+        }
+    }
+
+    // one training step on the planned buffers: gather entries [start, start + count), forward, backward and learn
+    // returns the summed loss of the entries. once planned this does no heap allocation at all
+    // trainingData is the vector of entries or a dataset (MappedDataset, CsvDataset)
+    template <typename Data>
+    float trainBatch(const Data &trainingData, int start, int count, float learnRate)
+    {
+        gatherPlanned(trainingData, start, count);
+        return trainPlanned(plannedInput(count), plannedExpectedOutput(count), learnRate);
+    }
+
+    // copy entries [start, start + count) into plannedInput / plannedExpectedOutput
+    void gatherPlanned(const std::vector<std::vector<Matrix<float>>> &trainingData, int start, int count)
+    {
+        plan(count);
+        NN_PROFILE_SCOPE("data.gatherBatch", 0, 2.0 * sizeof(float) * (plannedInput(count).size() + plannedExpectedOutput(count).size()));
+        gatherBatch(trainingData, start, count, 0, plannedInput(count));
+        gatherBatch(trainingData, start, count, 1, plannedExpectedOutput(count));
+    }
+
+    // same, reading the entries straight out of a dataset with gatherBatch
+    template <typename Dataset>
+    void gatherPlanned(const Dataset &trainingData, int start, int count)
+    {
+        plan(count);
+        NN_PROFILE_SCOPE("data.gatherBatch", 0, 2.0 * sizeof(float) * (plannedInput(count).size() + plannedExpectedOutput(count).size()));
+        trainingData.gatherBatch(start, count, plannedInput(count), plannedExpectedOutput(count));
+    }
+
+    MatrixView<const BFloat16> storedOutput(int i, int count) const
+    {
+        return stepPlan.storedOutputs[i].reshaped(layers[i].getNoOutputNodes(), count);
+    }
+
+    // the planned buffers the next step reads its batch of count entries from
+    MatrixView<float> plannedInput(int count)
+    {
+        return stepPlan.input.reshaped(layers[0].getNoInputNodes(), count);
+    }
+
+    MatrixView<float> plannedExpectedOutput(int count)
+    {
+        return stepPlan.expectedOutput.reshaped(layers.back().getNoOutputNodes(), count);
+    }
+
+    // training step on a gathered batch, e.g. plannedInput / plannedExpectedOutput or a DataPipeline buffer
+    float trainPlanned(MatrixView<const float> input, MatrixView<const float> expectedOutput, float learnRate)
+    {
+        NN_PROFILE_SCOPE("network.batch");
+        float loss = accumulatePlanned(input, expectedOutput);
+        applyDerivatives(learnRate);
+        return loss;
+    }
+
+    // forward & backward pass of a gathered batch, adding its derivatives to the layers' without learning from them
+    float accumulatePlanned(MatrixView<const float> input, MatrixView<const float> expectedOutput)
+    {
+        int count = input.noColumns;
+        plan(count);
+
+        MatrixView<float> output = runPlanned(input);
+        float loss = getLoss(output, expectedOutput);
+
+        int current = 0;
+        MatrixView<float> gradient = stepPlan.gradients[current].reshaped(output.noRows, count);
+        getLossGradient(output, expectedOutput, gradient);
+        // the topmost segment of dropped outputs is still in the segment buffers from the forward pass
+        bool segmentResident = true;
+        for (int i = (int)layers.size() - 1; i >= 0; i--)
+        {
+            // entering a segment of dropped outputs from the checkpoint above it
+            if (i > 0 && !stepPlan.checkpoints.isKept(i - 1) && stepPlan.checkpoints.isKept(i))
+            {
+                if (!segmentResident)
+                {
+                    recomputeSegment(i - 1, input, count);
+                }
+                segmentResident = false;
+            }
+            MatrixView<const float> layerInput = i == 0 ? input : stepPlan.outputs[i - 1].reshaped(layers[i].getNoInputNodes(), count);
+            MatrixView<const float> layerOutput = stepPlan.outputs[i].reshaped(layers[i].getNoOutputNodes(), count);
+            MatrixView<float> inputGradient;
+            if (i > 0)
+            {
+                inputGradient = stepPlan.gradients[1 - current].reshaped(layers[i].getNoInputNodes(), count);
+            }
+            // read the input & output of the layer in the precision they were stored in
+            bool storedInput = i > 0 && isStoredOutput(i - 1);
+            if (i == 0 && isStoredOutput(i))
+            {
+                layers[i].getDerivatives(layerInput, stepPlan.sparseInput, storedOutput(i, count), gradient);
+            }
+            else if (i == 0)
+            {
+                layers[i].getDerivatives(layerInput, stepPlan.sparseInput, layerOutput, gradient);
+            }
+            else if (storedInput && isStoredOutput(i))
+            {
+                layers[i].getDerivatives(storedOutput(i - 1, count), storedOutput(i, count), gradient, inputGradient);
+            }
+            else if (storedInput)
+            {
+                layers[i].getDerivatives(storedOutput(i - 1, count), layerOutput, gradient, inputGradient);
+            }
+            else if (isStoredOutput(i))
+            {
+                layers[i].getDerivatives(layerInput, storedOutput(i, count), gradient, inputGradient);
+            }
+            else
+            {
+                layers[i].getDerivatives(layerInput, layerOutput, gradient, inputGradient);
+            }
+            gradient = inputGradient;
+            current = 1 - current;
+        }
+        return loss;
+    }
+
     // recursively performs gradient descent training on the network for a given input and expected output. get loss after each time the weights are updated
     float gradientDescent(const Matrix<float> &input, const Matrix<float> &expectedOutput)
     {
@@ -92,65 +571,191 @@ public:
         return getLoss(outputs.back(), expectedOutput);
     }
 
-    // threaded version of gradientDescent to train the network using multiple threads
-    void gradientDescentThreaded(const Matrix<float> &input, const Matrix<float> &expectedOutput, float *averageLoss)
-    { // use pointer so I dont have to declare redundant class member
-        std::vector<Matrix<float>> outputs = runNetwork(input);
+    // threaded version of gradientDescent: accumulates into the calling thread's own derivatives instead of
+    // the layers' so that threads never write to shared memory, returns the loss
+    float gradientDescentThreaded(const Matrix<float> &input, const Matrix<float> &expectedOutput, std::vector<LayerGradients> &gradients) const
+    {
+        return gradientDescentThreaded(layers, input, expectedOutput, gradients);
+    }
+
+    static float gradientDescentThreaded(const std::vector<FullyConnectedLayer> &replica, const Matrix<float> &input, const Matrix<float> &expectedOutput,
+                                         std::vector<LayerGradients> &gradients)
+    {
+        std::vector<Matrix<float>> outputs = runLayers(replica, input);
         Matrix<float> gradient = getLossGradient(outputs.back(), expectedOutput);
 
-        for (int i = (int)layers.size() - 1; i >= 0; i--)
+        for (int i = (int)replica.size() - 1; i >= 0; i--)
         {
             if (i == 0)
             {
-                gradient = layers[i].getDerivatives(input, outputs[0], gradient);
+                gradient = replica[i].getDerivatives(input, outputs[0], gradient, gradients[i].weightsDerivatives, gradients[i].biasesDerivatives);
             }
             else
             {
-                gradient = layers[i].getDerivatives(outputs[i - 1], outputs[i], gradient);
+                gradient = replica[i].getDerivatives(outputs[i - 1], outputs[i], gradient, gradients[i].weightsDerivatives, gradients[i].biasesDerivatives);
             }
         }
 
-        float loss = getLoss(outputs.back(), expectedOutput);
-        // cumulative loss across all inputs processed by the threads
-        *averageLoss += loss;
+        return getLoss(outputs.back(), expectedOutput);
     }
 
-    // THE heavy-lifting function. apply derivatives (updates weights and biases) to the entire network
-    void applyDerivatives(float learnRate)
+    // one zeroed set of derivatives for every layer of the network
+    std::vector<LayerGradients> makeGradients() const
     {
+        std::vector<LayerGradients> gradients;
         for (int i = 0; i < (int)layers.size(); i++)
         {
-            layers[i].applyDerivatives(learnRate);
+            gradients.push_back(layers[i].makeGradients());
+        }
+        return gradients;
+    }
+
+    // one zeroed set of derivatives per worker, each allocated & zeroed by its own worker so it sits on its node
+    std::vector<std::vector<LayerGradients>> makeWorkerGradients(ThreadPool &pool) const
+    {
+        std::vector<std::vector<LayerGradients>> shards(pool.size());
+        pool.forEachWorker([&](int worker) {
+            shards[worker] = makeGradients();
+        });
+        return shards;
+    }
+
+    // the layers copied once per node for WeightPlacement::REPLICATED, none otherwise or on a single node. the first
+    // worker of each node makes (and refreshReplicas updates) that node's copy so its pages are the node's
+    std::vector<std::vector<FullyConnectedLayer>> replicateLayers(ThreadPool &pool) const
+    {
+        std::vector<std::vector<FullyConnectedLayer>> replicas;
+        if (topologySettings.weights != WeightPlacement::REPLICATED || topology.noNodes() == 1)
+        {
+            return replicas;
+        }
+        replicas.resize(topology.noNodes());
+        pool.forEachWorker([&](int worker) {
+            if (worker == 0 || pool.nodeOf(worker - 1) != pool.nodeOf(worker))
+            {
+                replicas[pool.nodeOf(worker)] = layers;
+            }
+        });
+        return replicas;
+    }
+
+    // copy the stepped weights & biases into every replica, in place
+    void refreshReplicas(ThreadPool &pool, std::vector<std::vector<FullyConnectedLayer>> &replicas) const
+    {
+        if (replicas.empty())
+        {
+            return;
+        }
+        NN_PROFILE_SCOPE("network.refreshReplicas");
+        pool.forEachWorker([&](int worker) {
+            if (worker == 0 || pool.nodeOf(worker - 1) != pool.nodeOf(worker))
+            {
+                std::vector<FullyConnectedLayer> &replica = replicas[pool.nodeOf(worker)];
+                for (int l = 0; l < (int)layers.size(); l++)
+                {
+                    replica[l].setParameters(layers[l].getWeights().view(), layers[l].getBiases().view());
+                }
+            }
+        });
+    }
+
+    // trainingData copied sample by sample by the worker that owns it in a parallelFor over each mini-batch of
+    // batchSize entries (ThreadPool::ownerOf), so every sample sits on the node of the thread that normally reads
+    // it. a batchSize of trainingData.size() partitions it into one contiguous shard per worker
+    static std::vector<std::vector<Matrix<float>>> partitionSamples(ThreadPool &pool, const std::vector<std::vector<Matrix<float>>> &trainingData, int batchSize)
+    {
+        NN_PROFILE_SCOPE("network.partitionSamples");
+        int noSamples = (int)trainingData.size();
+        std::vector<std::vector<Matrix<float>>> local(noSamples);
+        pool.forEachWorker([&](int worker) {
+            for (int s = 0; s < noSamples; s++)
+            {
+                int start = s - s % batchSize;
+                if (ThreadPool::ownerOf(s - start, std::min(batchSize, noSamples - start), pool.size()) == worker)
+                {
+                    local[s] = trainingData[s];
+                }
+            }
+        });
+        return local;
+    }
+
+    // place the weights as the topology settings ask and print the layout, before a threaded training loop
+    void placeWeights(int noThreads, bool replicable)
+    {
+        if (!topologySettings.pinned())
+        {
+            return;
+        }
+        if (topologySettings.weights == WeightPlacement::INTERLEAVED)
+        {
+            for (FullyConnectedLayer &layer : layers)
+            {
+                layer.interleaveWeights(topology);
+            }
+        }
+        std::cout << "Topology: " + describeTopology(noThreads, replicable) << std::endl;
+    }
+
+    // sum the per-worker derivatives pairwise in log2(noShards) parallel rounds, then hand the total to the layers
+    void reduceGradients(ThreadPool &pool, std::vector<std::vector<LayerGradients>> &shards)
+    {
+        NN_PROFILE_SCOPE("network.reduceGradients");
+        int noShards = (int)shards.size();
+        for (int stride = 1; stride < noShards; stride *= 2)
+        {
+            int noPairs = (noShards - stride + 2 * stride - 1) / (2 * stride);
+            pool.parallelFor(noPairs, [&](int, int pair) {
+                int target = pair * 2 * stride;
+                for (int l = 0; l < (int)layers.size(); l++)
+                {
+                    shards[target][l].absorb(shards[target + stride][l]);
+                }
+            });
+        }
+        for (int l = 0; l < (int)layers.size(); l++)
+        {
+            layers[l].addDerivatives(shards[0][l]);
         }
     }
 
+    // THE heavy-lifting function. apply derivatives (updates weights and biases) to the entire network
+    // one optimizer step over every layer's tensors, resetting the derivatives. a threaded loop passes its pool
+    void applyDerivatives(float learnRate, ThreadPool *pool = nullptr)
+    {
+        NN_PROFILE_SCOPE("network.applyDerivatives");
+        prepareOptimizer().step(learnRate, pool);
+    }
+
     // train the network with given training data for a specified number of epochs, stochastically by a given batch size
     // training data is organized in vectors, each vector include a training entry and expected output for that entry
-    void train(std::vector<std::vector<Matrix<float>>> &trainingData, float learnRate, int noEpochs, int batchSize)
+    // every mini-batch runs through the network as one (noInputNodes x batchSize) matrix, so each layer does
+    // a matrix-matrix product instead of one matrix-vector product per entry
+    // trainingData is either that vector or a dataset (MappedDataset, CsvDataset)
+    template <typename Data>
+    void train(Data &trainingData, float learnRate, int noEpochs, int batchSize)
     {
+        plan(batchSize);
         for (int iter = 0; iter < noEpochs; iter++)
         {
             float averageLoss = 0;
             auto startTime = std::chrono::high_resolution_clock::now(); // track training time
 
             // iterate over training data in mini-batches
-            for (int i = 0; i < trainingData.size(); i++)
+            for (int i = 0; i < (int)trainingData.size(); i += batchSize)
             {
-                // compute loss and carry out gradient descent training for each input
-                float loss = gradientDescent(trainingData[i][0], trainingData[i][0]);
-                averageLoss += loss;
+                int noEntries = std::min(batchSize, (int)trainingData.size() - i);
+
+                // compute loss, carry out gradient descent training for the whole mini-batch and learn from it
+                averageLoss += trainBatch(trainingData, i, noEntries, learnRate);
+                NN_PROFILE_TICK();
 
                 // every 2 batches output training progress
                 if (i % (batchSize * 2) == 0)
                 {
-                    std::cout << "At training entry #" + std::to_string(i) + " average loss: " + std::to_string(averageLoss / (float)i) << std::endl;
+                    std::cout << "At training entry #" + std::to_string(i + noEntries) + " average loss: " + std::to_string(averageLoss / (float)(i + noEntries)) << std::endl;
                 }
 
-                // network learns at the end of every batch or at the end of epoch
-                if (i % batchSize == 0 || i == trainingData.size() - 1)
-                {
-                    applyDerivatives(learnRate);
-                }
             }
             // calculate and print average loss for the epoch
             averageLoss /= (float)trainingData.size();
@@ -162,37 +767,167 @@ public:
         }
     }
 
-    // threaded version of 'train', processing mini-batches concurrently using multiple threads
-    void trainThreaded(std::vector<std::vector<Matrix<float>>> &trainingData, float learnRate, int noEpochs, int batchSize)
+    // whether a dataset (MappedDataset, CsvDataset, DataPipeline) has samples of the network's input size and one
+    // class per output, which every gathered batch relies on
+    template <typename Dataset>
+    bool matches(const Dataset &data) const
+    {
+        return data.featureCount() == layers[0].getNoInputNodes() && data.labelCount() == layers.back().getNoOutputNodes();
+    }
+
+    // train on batches streamed by a DataPipeline: the next batches are read and shuffled on a background thread
+    // while the current one trains, and the dataset never has to be resident in memory as a whole
+    // false, without training, if the dataset does not match the network
+    template <typename Dataset>
+    bool train(DataPipeline<Dataset> &pipeline, float learnRate, int noEpochs)
     {
+        if (!matches(pipeline))
+        {
+            return false;
+        }
+        plan(pipeline.getBatchSize());
         for (int iter = 0; iter < noEpochs; iter++)
         {
             float averageLoss = 0;
+            int noEntries = 0;
+            int noBatches = 0;
             auto startTime = std::chrono::high_resolution_clock::now(); // track training time
 
-            // iterate over training data in mini-batches
-            for (int i = 0; i < trainingData.size(); i += batchSize)
+            typename DataPipeline<Dataset>::Batch batch;
+            while (pipeline.next(batch))
             {
-                // determine the number of threads based on batchSize and available training data (if last batch or not)
-                int noThreads = std::min(batchSize, (int)(trainingData.size()) - i);
-                std::vector<std::thread> threads(noThreads);
+                averageLoss += trainPlanned(batch.input, batch.expectedOutput, learnRate);
+                noEntries += batch.count;
+                NN_PROFILE_TICK();
 
-                // launch threads for each mini-batch
-                for (int j = 0; j < noThreads; j++)
+                // every 2 batches output training progress
+                if (noBatches++ % 2 == 0)
                 {
-                    threads[j] = std::thread(&Network::gradientDescentThreaded, this, trainingData[i + j][0], trainingData[i + j][1], &averageLoss);
+                    std::cout << "At training entry #" + std::to_string(noEntries) + " average loss: " + std::to_string(averageLoss / (float)noEntries) << std::endl;
                 }
+            }
+            // calculate and print average loss for the epoch
+            averageLoss /= (float)noEntries;
 
-                // wait for all threads to finish
-                for (int j = 0; j < threads.size(); j++)
+            auto endTime = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+
+            std::cout << "Epoch " + std::to_string(iter) + " completed. Average loss: " << std::to_string(averageLoss) + ". Time taken: " + std::to_string(duration.count()) + " milliseconds." << std::endl;
+        }
+        return true;
+    }
+
+    // threaded version of 'train', processing the entries of each mini-batch concurrently on a pool of threads
+    // that lives for the whole training run. every worker accumulates into its own derivatives and loss, which are
+    // reduced before the network learns from the batch. noThreads <= 0 uses every hardware thread
+    // threads, weights and samples are placed per setTopology: pinned workers run on their node's replica of the
+    // layers and read samples copied into their node's memory
+    void trainThreaded(std::vector<std::vector<Matrix<float>>> &trainingData, float learnRate, int noEpochs, int batchSize, int noThreads = 0)
+    {
+        placeWeights(noThreads, true);
+        ThreadPool pool(noThreads, topologySettings.pinned() ? &topology : nullptr);
+        std::vector<std::vector<LayerGradients>> shards = makeWorkerGradients(pool);
+        std::vector<float> workerLoss(pool.size());
+        std::vector<std::vector<FullyConnectedLayer>> replicas = replicateLayers(pool);
+        std::vector<std::vector<Matrix<float>>> localData;
+        if (topologySettings.partitionData)
+        {
+            localData = partitionSamples(pool, trainingData, batchSize);
+        }
+        const std::vector<std::vector<Matrix<float>>> &samples = topologySettings.partitionData ? localData : trainingData;
+
+        for (int iter = 0; iter < noEpochs; iter++)
+        {
+            std::fill(workerLoss.begin(), workerLoss.end(), 0.0f);
+            auto startTime = std::chrono::high_resolution_clock::now(); // track training time
+
+            // iterate over training data in mini-batches
+            for (int i = 0; i < (int)trainingData.size(); i += batchSize)
+            {
+                // the last batch may be smaller
+                int noEntries = std::min(batchSize, (int)(trainingData.size()) - i);
                 {
-                    threads[j].join();
-                }
+                    NN_PROFILE_SCOPE("network.batch");
+                    pool.parallelFor(noEntries, [&](int worker, int j) {
+                        const std::vector<FullyConnectedLayer> &replica = replicas.empty() ? layers : replicas[pool.nodeOf(worker)];
+                        workerLoss[worker] += gradientDescentThreaded(replica, samples[i + j][0], samples[i + j][1], shards[worker]);
+                    });
+                    reduceGradients(pool, shards);
 
-                // learns after processing the mini-batch
-                applyDerivatives(learnRate);
+                    // learns after processing the mini-batch, on the same workers
+                    applyDerivatives(learnRate, &pool);
+                    refreshReplicas(pool, replicas);
+                }
+                NN_PROFILE_TICK();
+            }
+            // calculate and print average loss for the epoch
+            float averageLoss = 0;
+            for (float loss : workerLoss)
+            {
+                averageLoss += loss;
             }
+            averageLoss /= (float)trainingData.size();
+
+            auto endTime = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+
+            std::cout << "Epoch " + std::to_string(iter) + " completed. Average Loss: " << std::to_string(averageLoss) + ". Time taken: " + std::to_string(duration.count()) + " milliseconds." << std::endl;
+        }
+    }
+
+    // asynchronous (Hogwild) training without a batch barrier: every thread streams through its own shard of the
+    // training data and, every 'staleness' entries, subtracts what it accumulated straight from the shared weights
+    // with relaxed atomic adds. a thread may run on weights up to 'staleness' entries of its own (plus whatever the
+    // others are publishing) out of date, trading run-to-run determinism for throughput. the only join is per epoch
+    // setTopology pins the threads and can move each shard into its thread's node; the weights are what every thread
+    // publishes to, so REPLICATED keeps them shared
+    void trainAsync(std::vector<std::vector<Matrix<float>>> &trainingData, float learnRate, int noEpochs, int staleness, int noThreads = 0)
+    {
+        staleness = std::max(1, staleness);
+        placeWeights(noThreads, false);
+        ThreadPool pool(noThreads, topologySettings.pinned() ? &topology : nullptr);
+        int noShards = pool.size();
+        std::vector<std::vector<LayerGradients>> gradients = makeWorkerGradients(pool);
+        std::vector<float> shardLoss(noShards);
+        std::vector<std::vector<Matrix<float>>> localData;
+        if (topologySettings.partitionData)
+        {
+            localData = partitionSamples(pool, trainingData, (int)trainingData.size());
+        }
+        const std::vector<std::vector<Matrix<float>>> &samples = topologySettings.partitionData ? localData : trainingData;
+
+        for (int iter = 0; iter < noEpochs; iter++)
+        {
+            std::fill(shardLoss.begin(), shardLoss.end(), 0.0f);
+            auto startTime = std::chrono::high_resolution_clock::now(); // track training time
+
+            // every worker trains on its own shard, which partitionSamples put on its node
+            pool.forEachWorker([&](int shard) {
+                int begin = (int)((long)trainingData.size() * shard / noShards);
+                int end = (int)((long)trainingData.size() * (shard + 1) / noShards);
+                for (int i = begin; i < end; i++)
+                {
+                    shardLoss[shard] += gradientDescentThreaded(samples[i][0], samples[i][1], gradients[shard]);
+
+                    // publish after every 'staleness' entries and at the end of the shard
+                    if ((i - begin + 1) % staleness == 0 || i == end - 1)
+                    {
+                        NN_PROFILE_SCOPE("network.publishAsync");
+                        for (int l = 0; l < (int)layers.size(); l++)
+                        {
+                            layers[l].applyDerivativesAsync(gradients[shard][l], learnRate);
+                        }
+                    }
+                }
+            });
+            NN_PROFILE_TICK();
+
             // calculate and print average loss for the epoch
+            float averageLoss = 0;
+            for (float loss : shardLoss)
+            {
+                averageLoss += loss;
+            }
             averageLoss /= (float)trainingData.size();
 
             auto endTime = std::chrono::high_resolution_clock::now();
@@ -201,4 +936,193 @@ public:
             std::cout << "Epoch " + std::to_string(iter) + " completed. Average Loss: " << std::to_string(averageLoss) + ". Time taken: " + std::to_string(duration.count()) + " milliseconds." << std::endl;
         }
     }
+
+    // data-parallel training across processes, called by every rank of the transport with the same arguments
+    // each rank holds a replica of the network (rank 0's parameters are broadcast first) and trains on its own
+    // shard of trainingData, size() / noRanks entries each (the last few entries are left out so every rank runs
+    // the same number of steps). after every mini-batch the ranks average their derivatives with a ring all-reduce,
+    // so the replicas take identical steps and stay identical. only rank 0 prints progress
+    template <typename Data>
+    void trainDistributed(Data &trainingData, Transport &transport, float learnRate, int noEpochs, int batchSize)
+    {
+        RingAllReduce ring(transport);
+        std::vector<float> buffer(noParameters());
+        copyParameters(buffer.data(), true);
+        ring.broadcast(buffer.data(), buffer.size());
+        copyParameters(buffer.data(), false);
+
+        int rank = transport.rank();
+        int shardSize = (int)trainingData.size() / transport.size();
+        int shardStart = rank * shardSize;
+        plan(batchSize);
+        for (int iter = 0; iter < noEpochs; iter++)
+        {
+            float loss = 0;
+            auto startTime = std::chrono::high_resolution_clock::now(); // track training time
+
+            for (int i = 0; i < shardSize; i += batchSize)
+            {
+                int noEntries = std::min(batchSize, shardSize - i);
+                {
+                    NN_PROFILE_SCOPE("network.batch");
+                    gatherPlanned(trainingData, shardStart + i, noEntries);
+                    loss += accumulatePlanned(plannedInput(noEntries), plannedExpectedOutput(noEntries));
+
+                    copyDerivatives(buffer.data(), true);
+                    ring.average(buffer.data(), buffer.size());
+                    copyDerivatives(buffer.data(), false);
+                    applyDerivatives(learnRate);
+                }
+                NN_PROFILE_TICK();
+            }
+            // the loss of the epoch over every shard
+            ring.sum(&loss, 1);
+            float averageLoss = loss / (float)(shardSize * transport.size());
+
+            auto endTime = std::chrono::high_resolution_clock::now();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(endTime - startTime);
+
+            if (rank == 0)
+            {
+                std::cout << "Epoch " + std::to_string(iter) + " completed. Average loss: " << std::to_string(averageLoss) + ". Time taken: " + std::to_string(duration.count()) + " milliseconds." << std::endl;
+            }
+        }
+    }
+
+    // score a labelled dataset (MappedDataset, CsvDataset) in mini-batches of batchSize spread over noThreads
+    // threads (<= 0: every hardware thread). every worker runs the layers on buffers of its own and counts into its
+    // own confusion matrix, merged at the end, so evaluating leaves the network & its plan alone and can run between
+    // training steps, e.g. once an epoch
+    template <typename Dataset>
+    Evaluation evaluate(const Dataset &data, int batchSize = 256, int noThreads = 0) const
+    {
+        NN_PROFILE_SCOPE("network.evaluate");
+        int noInputs = layers[0].getNoInputNodes();
+        int noClasses = layers.back().getNoOutputNodes();
+        int widest = 0;
+        for (const FullyConnectedLayer &layer : layers)
+        {
+            widest = std::max(widest, layer.getNoOutputNodes());
+        }
+        int noBatches = (data.size() + batchSize - 1) / batchSize;
+        if (noThreads <= 0)
+        {
+            noThreads = std::max(1, (int)std::thread::hardware_concurrency());
+        }
+        ThreadPool pool(std::max(1, std::min(noThreads, noBatches)));
+
+        struct Shard
+        {
+            Workspace arena;
+            MatrixView<float> input;
+            MatrixView<float> expectedOutput;
+            MatrixView<float> buffers[2];
+            Evaluation evaluation;
+        };
+        std::vector<Shard> shards(pool.size());
+        for (Shard &shard : shards)
+        {
+            shard.arena.reserve(Workspace::sizeOf(noInputs, batchSize) + Workspace::sizeOf(noClasses, batchSize) + 2 * Workspace::sizeOf(widest, batchSize));
+            shard.input = shard.arena.allocate(noInputs, batchSize);
+            shard.expectedOutput = shard.arena.allocate(noClasses, batchSize);
+            shard.buffers[0] = shard.arena.allocate(widest, batchSize);
+            shard.buffers[1] = shard.arena.allocate(widest, batchSize);
+            shard.evaluation = Evaluation(noClasses);
+        }
+
+        pool.parallelFor(noBatches, [&](int worker, int batch) {
+            Shard &shard = shards[worker];
+            int start = batch * batchSize;
+            int count = std::min(batchSize, data.size() - start);
+            MatrixView<float> input = shard.input.reshaped(noInputs, count);
+            MatrixView<float> expectedOutput = shard.expectedOutput.reshaped(noClasses, count);
+            data.gatherBatch(start, count, input, expectedOutput);
+
+            MatrixView<float> output = input;
+            for (int i = 0; i < (int)layers.size(); i++)
+            {
+                MatrixView<float> next = shard.buffers[i % 2].reshaped(layers[i].getNoOutputNodes(), count);
+                layers[i].forwardPropagate(output, next);
+                output = next;
+            }
+            shard.evaluation.loss += getLoss(output, expectedOutput);
+
+            // the class of an entry is the largest output of its column
+            for (int j = 0; j < count; j++)
+            {
+                int predicted = 0;
+                for (int c = 1; c < noClasses; c++)
+                {
+                    if (output.get(c, j) > output.get(predicted, j))
+                    {
+                        predicted = c;
+                    }
+                }
+                shard.evaluation.add(data.label(start + j), predicted);
+            }
+        });
+
+        Evaluation total(noClasses);
+        for (const Shard &shard : shards)
+        {
+            total.merge(shard.evaluation);
+        }
+        return total;
+    }
+
+    // number of weights & biases of the whole network
+    size_t noParameters() const
+    {
+        size_t total = 0;
+        for (const FullyConnectedLayer &layer : layers)
+        {
+            total += layer.getWeights().data.size() + layer.getBiases().data.size();
+        }
+        return total;
+    }
+
+private:
+    // copy the weights & biases of every layer into buffer (one after the other), or back from it
+    void copyParameters(float *buffer, bool toBuffer)
+    {
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            const Matrix<float> &weights = layers[i].getWeights();
+            const Matrix<float> &biases = layers[i].getBiases();
+            if (toBuffer)
+            {
+                buffer = std::copy(weights.data.begin(), weights.data.end(), buffer);
+                buffer = std::copy(biases.data.begin(), biases.data.end(), buffer);
+            }
+            else
+            {
+                MatrixView<const float> newWeights(buffer, weights.noRows, weights.noColumns);
+                MatrixView<const float> newBiases(buffer + weights.data.size(), biases.noRows, biases.noColumns);
+                layers[i].setParameters(newWeights, newBiases);
+                buffer += weights.data.size() + biases.data.size();
+            }
+        }
+    }
+
+    // same for the accumulated derivatives, in the same layout
+    void copyDerivatives(float *buffer, bool toBuffer)
+    {
+        for (FullyConnectedLayer &layer : layers)
+        {
+            for (MatrixView<float> derivatives : {layer.getWeightsDerivatives(), layer.getBiasesDerivatives()})
+            {
+                if (toBuffer)
+                {
+                    std::copy(derivatives.data, derivatives.data + derivatives.size(), buffer);
+                }
+                else
+                {
+                    std::copy(buffer, buffer + derivatives.size(), derivatives.data);
+                }
+                buffer += derivatives.size();
+            }
+        }
+    }
 };
+
+#endif
@@ -0,0 +1,523 @@
+// Header guard
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <thread>
+#include <algorithm>
+
+#include "Gemm.cpp"
+#include "HalfFloat.cpp"
+#include "Workspace.cpp"
+#include "ThreadPool.cpp"
+#include "Profiler.cpp"
+
+// How an Optimizer turns derivatives into parameter updates, the defaults are plain SGD
+struct OptimizerSettings
+{
+    enum Method
+    {
+        SGD,      // parameter -= learnRate * derivative
+        MOMENTUM, // heavy ball: velocity = momentum * velocity + derivative, parameter -= learnRate * velocity
+        ADAM      // per-parameter steps from bias-corrected running means of the derivative and its square
+    };
+
+    Method method = SGD;
+    float momentum = 0.9f;
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    // decoupled weight decay (as in AdamW): every step also shrinks the weights by learnRate * weightDecay of
+    // themselves. biases are not decayed
+    float weightDecay = 0;
+    // > 0: a step whose derivatives have a global L2 norm (over every tensor) above clipNorm scales them down to it
+    float clipNorm = 0;
+
+    static OptimizerSettings sgd()
+    {
+        return OptimizerSettings();
+    }
+
+    static OptimizerSettings withMomentum(float momentum = 0.9f)
+    {
+        OptimizerSettings settings;
+        settings.method = MOMENTUM;
+        settings.momentum = momentum;
+        return settings;
+    }
+
+    static OptimizerSettings adam(float beta1 = 0.9f, float beta2 = 0.999f)
+    {
+        OptimizerSettings settings;
+        settings.method = ADAM;
+        settings.beta1 = beta1;
+        settings.beta2 = beta2;
+        return settings;
+    }
+};
+
+// Applies the derivatives accumulated by a training step to the parameters
+// every parameter tensor is updated in one fused pass: read the derivative, update the optimizer state and the
+// parameter (and its bfloat16 copy under mixed precision), reset the derivative to 0. the state of all tensors lives
+// in one aligned Workspace, and large models split the pass into chunks spread over a ThreadPool: the training
+// loop's own when it hands one to step, otherwise one of the optimizer's if it was given more than one thread.
+// the tensors are registered again before every step (no allocation), the state follows them by position and is
+// kept as long as their sizes do not change
+class Optimizer
+{
+public:
+    // floats per parallel task, and the smallest model worth waking the pool for
+    static const size_t CHUNK = 1 << 14;
+    static const size_t MIN_PARALLEL = 1 << 16;
+
+    struct Tensor
+    {
+        float *values;
+        float *derivatives;
+        BFloat16 *stored; // bfloat16 copy of values to refresh, or nullptr
+        size_t size;
+        bool decays; // weight decay applies
+    };
+
+private:
+    static const int MAX_SLOTS = 2; // state floats per parameter: velocity (MOMENTUM) or both moments (ADAM)
+
+    struct Chunk
+    {
+        int tensor;
+        size_t begin;
+        size_t end;
+    };
+
+    // the per-step constants of the update
+    struct Step
+    {
+        float learnRate;
+        float scale;  // clipping factor of the derivatives
+        float shrink; // 1 - learnRate * weightDecay
+        float momentum;
+        float beta1;
+        float beta2;
+        float epsilon;
+        float stepSize;          // ADAM: learnRate / (1 - beta1^t)
+        float inverseCorrection; // ADAM: 1 / (1 - beta2^t)
+    };
+
+    OptimizerSettings settings;
+    int noThreads;
+    std::unique_ptr<ThreadPool> pool;
+
+    std::vector<Tensor> tensors;
+    std::vector<size_t> plannedSizes;
+    std::vector<Chunk> chunks;
+    std::vector<double> chunkNorms;
+    Workspace state;
+    std::vector<float *> slots[MAX_SLOTS]; // per tensor
+    long noSteps = 0;
+    Step current;
+
+public:
+    // threads of the optimizer's own pool for steps not given one: 1 keeps them on the calling thread, <= 0 sizes
+    // the pool to the hardware
+    explicit Optimizer(const OptimizerSettings &_settings = OptimizerSettings(), int _noThreads = 1)
+        : settings(_settings), noThreads(_noThreads) {}
+
+    // a copy has the same settings but starts without state, like a network that was never trained
+    Optimizer(const Optimizer &other) : settings(other.settings), noThreads(other.noThreads) {}
+
+    Optimizer &operator=(const Optimizer &other)
+    {
+        settings = other.settings;
+        noThreads = other.noThreads;
+        pool.reset();
+        reset();
+        return *this;
+    }
+
+    const OptimizerSettings &getSettings() const
+    {
+        return settings;
+    }
+
+    long getNoSteps() const
+    {
+        return noSteps;
+    }
+
+    // e.g. when resuming from a checkpoint, the state of the steps taken so far having been restored
+    void setNoSteps(long _noSteps)
+    {
+        noSteps = _noSteps;
+    }
+
+    int getNoTensors() const
+    {
+        return (int)tensors.size();
+    }
+
+    // state floats per parameter: the velocity (MOMENTUM) or the first and second moments (ADAM), none for SGD
+    int getNoSlots() const
+    {
+        return settings.method == OptimizerSettings::ADAM ? 2 : settings.method == OptimizerSettings::MOMENTUM ? 1 : 0;
+    }
+
+    // the state of registered tensor i in a slot, one float per parameter. nullptr until a step (or planState)
+    // planned it for the tensors registered now
+    float *getState(int tensor, int slot)
+    {
+        return isPlanned() && tensor < (int)tensors.size() && slot < getNoSlots() ? slots[slot][tensor] : nullptr;
+    }
+
+    const float *getState(int tensor, int slot) const
+    {
+        return isPlanned() && tensor < (int)tensors.size() && slot < getNoSlots() ? slots[slot][tensor] : nullptr;
+    }
+
+    // forget the state (velocities, moments, step count), the next step starts from scratch
+    void reset()
+    {
+        plannedSizes.clear();
+        noSteps = 0;
+    }
+
+    void clearTensors()
+    {
+        tensors.clear();
+    }
+
+    void addTensor(float *values, float *derivatives, size_t size, bool decays, BFloat16 *stored = nullptr)
+    {
+        tensors.push_back({values, derivatives, stored, size, decays});
+    }
+
+    // update every registered tensor from its derivatives and reset them to 0
+    // workers, e.g. the pool of a threaded training loop, splits a large model over its threads instead of the
+    // optimizer's own pool
+    void step(float learnRate, ThreadPool *workers = nullptr)
+    {
+        planState();
+        noSteps++;
+        NN_PROFILE_SCOPE("optimizer.step", (settings.method == OptimizerSettings::ADAM ? 10.0 : 3.0) * totalSize(),
+                         (2 + (settings.method != OptimizerSettings::SGD) + (settings.method == OptimizerSettings::ADAM)) * 2.0 * sizeof(float) * totalSize());
+
+        current.learnRate = learnRate;
+        current.scale = 1;
+        current.shrink = 1 - learnRate * settings.weightDecay;
+        current.momentum = settings.momentum;
+        current.beta1 = settings.beta1;
+        current.beta2 = settings.beta2;
+        current.epsilon = settings.epsilon;
+        current.stepSize = learnRate / (1 - (float)std::pow((double)settings.beta1, (double)noSteps));
+        current.inverseCorrection = 1 / (1 - (float)std::pow((double)settings.beta2, (double)noSteps));
+
+        workers = parallelPool(workers);
+        if (settings.clipNorm > 0)
+        {
+            if (workers != nullptr)
+            {
+                workers->parallelFor((int)chunks.size(), [this](int, int chunk) { chunkNorms[chunk] = squaredNorm(chunks[chunk]); });
+            }
+            else
+            {
+                for (int i = 0; i < (int)chunks.size(); i++)
+                {
+                    chunkNorms[i] = squaredNorm(chunks[i]);
+                }
+            }
+            double norm = 0;
+            for (double chunkNorm : chunkNorms)
+            {
+                norm += chunkNorm;
+            }
+            norm = std::sqrt(norm);
+            if (norm > settings.clipNorm)
+            {
+                current.scale = (float)(settings.clipNorm / norm);
+            }
+        }
+
+        if (workers != nullptr)
+        {
+            workers->parallelFor((int)chunks.size(), [this](int, int chunk) { update(chunks[chunk]); });
+        }
+        else
+        {
+            for (const Chunk &chunk : chunks)
+            {
+                update(chunk);
+            }
+        }
+    }
+
+    // (re)build the chunks and the state when the registered tensors changed shape, zeroing the state. every step
+    // does, call it first to fill the state in before the first one (e.g. from a checkpoint)
+    void planState()
+    {
+        if (isPlanned())
+        {
+            return;
+        }
+
+        int noSlots = getNoSlots();
+        plannedSizes.clear();
+        chunks.clear();
+        size_t total = 0;
+        for (int i = 0; i < (int)tensors.size(); i++)
+        {
+            plannedSizes.push_back(tensors[i].size);
+            for (size_t begin = 0; begin < tensors[i].size; begin += CHUNK)
+            {
+                chunks.push_back({i, begin, std::min(tensors[i].size, begin + CHUNK)});
+            }
+            total += noSlots * Workspace::sizeOf(1, (int)tensors[i].size);
+        }
+        chunkNorms.assign(chunks.size(), 0);
+
+        state.reserve(total);
+        for (int slot = 0; slot < MAX_SLOTS; slot++)
+        {
+            slots[slot].assign(tensors.size(), nullptr);
+            for (int i = 0; slot < noSlots && i < (int)tensors.size(); i++)
+            {
+                slots[slot][i] = state.allocate(1, (int)tensors[i].size).data;
+            }
+        }
+        noSteps = 0;
+    }
+
+private:
+    size_t totalSize() const
+    {
+        size_t total = 0;
+        for (const Tensor &tensor : tensors)
+        {
+            total += tensor.size;
+        }
+        return total;
+    }
+
+    // whether the chunks and the state were made for the tensors registered now
+    bool isPlanned() const
+    {
+        bool same = plannedSizes.size() == tensors.size();
+        for (size_t i = 0; same && i < tensors.size(); i++)
+        {
+            same = plannedSizes[i] == tensors[i].size;
+        }
+        return same;
+    }
+
+    // the pool to split the step over when the model is large enough: the given one, else the optimizer's own
+    // (created on first use) if it was given more than one thread
+    ThreadPool *parallelPool(ThreadPool *given)
+    {
+        if (totalSize() < MIN_PARALLEL)
+        {
+            return nullptr;
+        }
+        if (given != nullptr)
+        {
+            return given->size() > 1 ? given : nullptr;
+        }
+        int threads = noThreads > 0 ? noThreads : std::max(1, (int)std::thread::hardware_concurrency());
+        if (threads == 1)
+        {
+            return nullptr;
+        }
+        if (pool == nullptr)
+        {
+            pool.reset(new ThreadPool(threads));
+        }
+        return pool.get();
+    }
+
+    double squaredNorm(const Chunk &chunk) const
+    {
+        // 8 running sums the compiler can keep in one vector register
+        const float *derivatives = tensors[chunk.tensor].derivatives;
+        double sums[8] = {};
+        size_t i = chunk.begin;
+        for (; i + 8 <= chunk.end; i += 8)
+        {
+            for (int lane = 0; lane < 8; lane++)
+            {
+                sums[lane] += (double)derivatives[i + lane] * derivatives[i + lane];
+            }
+        }
+        for (; i < chunk.end; i++)
+        {
+            sums[0] += (double)derivatives[i] * derivatives[i];
+        }
+        double sum = 0;
+        for (double laneSum : sums)
+        {
+            sum += laneSum;
+        }
+        return sum;
+    }
+
+    void update(const Chunk &chunk) const
+    {
+        const Tensor &tensor = tensors[chunk.tensor];
+        Step step = current;
+        if (!tensor.decays)
+        {
+            step.shrink = 1;
+        }
+        float *values = tensor.values + chunk.begin;
+        float *derivatives = tensor.derivatives + chunk.begin;
+        BFloat16 *stored = tensor.stored == nullptr ? nullptr : tensor.stored + chunk.begin;
+        float *first = slots[0][chunk.tensor] == nullptr ? nullptr : slots[0][chunk.tensor] + chunk.begin;
+        float *second = slots[1][chunk.tensor] == nullptr ? nullptr : slots[1][chunk.tensor] + chunk.begin;
+        int n = (int)(chunk.end - chunk.begin);
+        switch (Gemm::activeIsa())
+        {
+#ifdef GEMM_X86
+        case Gemm::AVX512:
+            updateAvx512(settings.method, step, n, values, derivatives, first, second, stored);
+            break;
+        case Gemm::AVX2:
+            updateAvx2(settings.method, step, n, values, derivatives, first, second, stored);
+            break;
+#endif
+        default:
+            updateAll(settings.method, step, n, values, derivatives, first, second, stored);
+            break;
+        }
+    }
+
+#ifdef GEMM_X86
+    // the same loops compiled for wider vectors, picked with the GEMM kernels' instruction set. ADAM has its own
+    // kernels: without -fno-math-errno the compiler keeps every sqrt scalar
+    __attribute__((target("avx512f"))) static void updateAvx512(OptimizerSettings::Method method, const Step &step, int n, float *values,
+                                                                float *derivatives, float *first, float *second, BFloat16 *stored)
+    {
+        if (method != OptimizerSettings::ADAM)
+        {
+            updateAll(method, step, n, values, derivatives, first, second, stored);
+            return;
+        }
+        __m512 scale = _mm512_set1_ps(step.scale), shrink = _mm512_set1_ps(step.shrink);
+        __m512 beta1 = _mm512_set1_ps(step.beta1), beta2 = _mm512_set1_ps(step.beta2);
+        __m512 oneMinusBeta1 = _mm512_set1_ps(1 - step.beta1), oneMinusBeta2 = _mm512_set1_ps(1 - step.beta2);
+        __m512 epsilon = _mm512_set1_ps(step.epsilon), stepSize = _mm512_set1_ps(step.stepSize);
+        __m512 inverseCorrection = _mm512_set1_ps(step.inverseCorrection);
+        for (int i = 0; i < n; i += 16)
+        {
+            __mmask16 mask = n - i >= 16 ? (__mmask16)0xffff : (__mmask16)((1u << (n - i)) - 1);
+            __m512 derivative = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, derivatives + i), scale);
+            _mm512_mask_storeu_ps(derivatives + i, mask, _mm512_setzero_ps());
+            __m512 mean = _mm512_fmadd_ps(beta1, _mm512_maskz_loadu_ps(mask, first + i), _mm512_mul_ps(oneMinusBeta1, derivative));
+            __m512 square = _mm512_fmadd_ps(beta2, _mm512_maskz_loadu_ps(mask, second + i), _mm512_mul_ps(oneMinusBeta2, _mm512_mul_ps(derivative, derivative)));
+            _mm512_mask_storeu_ps(first + i, mask, mean);
+            _mm512_mask_storeu_ps(second + i, mask, square);
+            __m512 denominator = _mm512_add_ps(_mm512_sqrt_ps(_mm512_mul_ps(square, inverseCorrection)), epsilon);
+            __m512 value = _mm512_mul_ps(_mm512_maskz_loadu_ps(mask, values + i), shrink);
+            value = _mm512_sub_ps(value, _mm512_div_ps(_mm512_mul_ps(stepSize, mean), denominator));
+            _mm512_mask_storeu_ps(values + i, mask, value);
+        }
+        storeRounded(n, values, stored);
+    }
+
+    __attribute__((target("avx2,fma"))) static void updateAvx2(OptimizerSettings::Method method, const Step &step, int n, float *values,
+                                                               float *derivatives, float *first, float *second, BFloat16 *stored)
+    {
+        if (method != OptimizerSettings::ADAM)
+        {
+            updateAll(method, step, n, values, derivatives, first, second, stored);
+            return;
+        }
+        __m256 scale = _mm256_set1_ps(step.scale), shrink = _mm256_set1_ps(step.shrink);
+        __m256 beta1 = _mm256_set1_ps(step.beta1), beta2 = _mm256_set1_ps(step.beta2);
+        __m256 oneMinusBeta1 = _mm256_set1_ps(1 - step.beta1), oneMinusBeta2 = _mm256_set1_ps(1 - step.beta2);
+        __m256 epsilon = _mm256_set1_ps(step.epsilon), stepSize = _mm256_set1_ps(step.stepSize);
+        __m256 inverseCorrection = _mm256_set1_ps(step.inverseCorrection);
+        int i = 0;
+        for (; i + 8 <= n; i += 8)
+        {
+            __m256 derivative = _mm256_mul_ps(_mm256_loadu_ps(derivatives + i), scale);
+            _mm256_storeu_ps(derivatives + i, _mm256_setzero_ps());
+            __m256 mean = _mm256_fmadd_ps(beta1, _mm256_loadu_ps(first + i), _mm256_mul_ps(oneMinusBeta1, derivative));
+            __m256 square = _mm256_fmadd_ps(beta2, _mm256_loadu_ps(second + i), _mm256_mul_ps(oneMinusBeta2, _mm256_mul_ps(derivative, derivative)));
+            _mm256_storeu_ps(first + i, mean);
+            _mm256_storeu_ps(second + i, square);
+            __m256 denominator = _mm256_add_ps(_mm256_sqrt_ps(_mm256_mul_ps(square, inverseCorrection)), epsilon);
+            __m256 value = _mm256_mul_ps(_mm256_loadu_ps(values + i), shrink);
+            value = _mm256_sub_ps(value, _mm256_div_ps(_mm256_mul_ps(stepSize, mean), denominator));
+            _mm256_storeu_ps(values + i, value);
+        }
+        fused<OptimizerSettings::ADAM>(step, n - i, values + i, derivatives + i, first + i, second + i, nullptr);
+        storeRounded(n, values, stored);
+    }
+#endif
+
+    __attribute__((always_inline)) static inline void updateAll(OptimizerSettings::Method method, const Step &step, int n, float *values,
+                                                                float *derivatives, float *first, float *second, BFloat16 *stored)
+    {
+        switch (method)
+        {
+        case OptimizerSettings::MOMENTUM:
+            fused<OptimizerSettings::MOMENTUM>(step, n, values, derivatives, first, second, stored);
+            break;
+        case OptimizerSettings::ADAM:
+            fused<OptimizerSettings::ADAM>(step, n, values, derivatives, first, second, stored);
+            break;
+        default:
+            fused<OptimizerSettings::SGD>(step, n, values, derivatives, first, second, stored);
+            break;
+        }
+    }
+
+    // one pass of branch-free element-wise code per method, which the compiler vectorizes
+    template <OptimizerSettings::Method METHOD>
+    __attribute__((always_inline)) static inline void fused(const Step &step, int n, float *__restrict values, float *__restrict derivatives,
+                                                            float *__restrict first, float *__restrict second, BFloat16 *stored)
+    {
+        // locals, so the compiler does not reload the constants after every store it cannot prove unrelated
+        const float learnRate = step.learnRate, scale = step.scale, shrink = step.shrink, momentum = step.momentum;
+        const float beta1 = step.beta1, beta2 = step.beta2, epsilon = step.epsilon, stepSize = step.stepSize;
+        const float inverseCorrection = step.inverseCorrection;
+        for (int i = 0; i < n; i++)
+        {
+            float derivative = derivatives[i] * scale;
+            derivatives[i] = 0;
+            float value = values[i] * shrink;
+            if constexpr (METHOD == OptimizerSettings::SGD)
+            {
+                value -= learnRate * derivative;
+            }
+            else if constexpr (METHOD == OptimizerSettings::MOMENTUM)
+            {
+                float velocity = momentum * first[i] + derivative;
+                first[i] = velocity;
+                value -= learnRate * velocity;
+            }
+            else
+            {
+                float mean = beta1 * first[i] + (1 - beta1) * derivative;
+                float square = beta2 * second[i] + (1 - beta2) * derivative * derivative;
+                first[i] = mean;
+                second[i] = square;
+                value -= stepSize * mean / (std::sqrt(square * inverseCorrection) + epsilon);
+            }
+            values[i] = value;
+        }
+        storeRounded(n, values, stored);
+    }
+
+    // refresh the bfloat16 copy of the updated values, if there is one
+    __attribute__((always_inline)) static inline void storeRounded(int n, const float *values, BFloat16 *stored)
+    {
+        if (stored != nullptr)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                stored[i].bits = BFloat16::fromFloat(values[i]);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,343 @@
+// Header guard
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "AllocationCounter.cpp"
+
+// Scoped instrumentation of the hot paths, compiled in with NN_PROFILE (the CMake option of the same name)
+// NN_PROFILE_SCOPE(name, flops, bytes) times the rest of the enclosing block and adds it, with the flops and bytes
+// it was given and the heap allocations made meanwhile (when built with NN_COUNT_ALLOCATIONS), to the counters of
+// the calling thread. without NN_PROFILE the macros expand to nothing, so neither the scope nor its arguments cost
+// anything. every thread owns its counters and only ever writes those, readers sum them over all threads:
+// - statsLine() is one JSON line of totals per scope name, tick() prints it every setStatsInterval seconds
+// - with setTracing(true) every scope is also kept as an event, and writeChromeTrace() saves them in the Chrome
+//   trace-event format (chrome://tracing, Perfetto)
+// scope names must be string literals, they are told apart by address
+class Profiler
+{
+public:
+    static const int MAX_SCOPES = 32; // distinct names per thread, the rest is not counted
+
+    struct Counters
+    {
+        std::atomic<const char *> name{nullptr};
+        std::atomic<int64_t> calls{0};
+        std::atomic<int64_t> nanoseconds{0};
+        std::atomic<double> flops{0};
+        std::atomic<double> bytes{0};
+        std::atomic<int64_t> allocations{0};
+    };
+
+    struct Event
+    {
+        const char *name;
+        int64_t start; // nanoseconds since the profiler started
+        int64_t duration;
+        double flops;
+        double bytes;
+    };
+
+    struct ThreadProfile
+    {
+        int id = 0;
+        Counters counters[MAX_SCOPES];
+        std::unique_ptr<Event[]> events; // allocated on the first traced scope
+        size_t eventCapacity = 0;
+        std::atomic<size_t> noEvents{0};
+        std::atomic<int64_t> noDroppedEvents{0};
+
+        // the counters of a scope name, nullptr once MAX_SCOPES names are in use
+        Counters *find(const char *name)
+        {
+            for (Counters &slot : counters)
+            {
+                const char *slotName = slot.name.load(std::memory_order_relaxed);
+                if (slotName == name)
+                {
+                    return &slot;
+                }
+                if (slotName == nullptr)
+                {
+                    slot.name.store(name, std::memory_order_release);
+                    return &slot;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    static bool enabled()
+    {
+#ifdef NN_PROFILE
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // nanoseconds since the first call
+    static int64_t now()
+    {
+        static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // the calling thread's profile, registered on first use and kept after the thread ends
+    static ThreadProfile &thread()
+    {
+        thread_local ThreadProfile *profile = nullptr;
+        if (profile == nullptr)
+        {
+            std::lock_guard<std::mutex> guard(registryLock());
+            registry().emplace_back(new ThreadProfile());
+            profile = registry().back().get();
+            profile->id = (int)registry().size() - 1;
+        }
+        return *profile;
+    }
+
+    // keep every scope as a trace event from now on, up to maxEventsPerThread per thread (later ones are dropped)
+    static void setTracing(bool enabled, size_t maxEventsPerThread = 1 << 18)
+    {
+        traceCapacity() = maxEventsPerThread;
+        tracing().store(enabled, std::memory_order_relaxed);
+    }
+
+    // print a stats line from tick() at most every interval seconds, 0 turns it off
+    static void setStatsInterval(double seconds)
+    {
+        statsInterval() = (int64_t)(seconds * 1e9);
+    }
+
+    // called at batch boundaries (NN_PROFILE_TICK): prints a stats line if the interval has passed
+    static void tick(std::ostream &out)
+    {
+        int64_t interval = statsInterval();
+        int64_t time = now();
+        if (interval > 0 && time - lastStats() >= interval)
+        {
+            lastStats() = time;
+            out << "stats " + statsLine() << std::endl;
+        }
+    }
+
+    static void record(const char *name, int64_t start, int64_t duration, double flops, double bytes, long allocations)
+    {
+        ThreadProfile &profile = thread();
+        if (Counters *counters = profile.find(name))
+        {
+            // only this thread writes its counters, the atomics just make them safe to read from others
+            add(counters->calls, (int64_t)1);
+            add(counters->nanoseconds, duration);
+            add(counters->flops, flops);
+            add(counters->bytes, bytes);
+            add(counters->allocations, (int64_t)allocations);
+        }
+        if (tracing().load(std::memory_order_relaxed))
+        {
+            if (profile.events == nullptr)
+            {
+                profile.events.reset(new Event[traceCapacity()]);
+                profile.eventCapacity = traceCapacity();
+            }
+            size_t index = profile.noEvents.load(std::memory_order_relaxed);
+            if (index < profile.eventCapacity)
+            {
+                profile.events[index] = {name, start, duration, flops, bytes};
+                profile.noEvents.store(index + 1, std::memory_order_release);
+            }
+            else
+            {
+                add(profile.noDroppedEvents, (int64_t)1);
+            }
+        }
+    }
+
+    // totals per scope name over all threads since the start, one line of JSON, e.g.
+    // {"elapsed_s":1.5,"threads":2,"scopes":{"layer.forward":{"calls":10,"ms":3.2,"gflops":40.1,"gb_per_s":5.2,"allocations":0}}}
+    static std::string statsLine()
+    {
+        struct Total
+        {
+            const char *name;
+            int64_t calls, nanoseconds, allocations;
+            double flops, bytes;
+        };
+        std::vector<Total> totals;
+        int noThreads;
+        {
+            std::lock_guard<std::mutex> guard(registryLock());
+            noThreads = (int)registry().size();
+            for (const std::unique_ptr<ThreadProfile> &profile : registry())
+            {
+                for (const Counters &counters : profile->counters)
+                {
+                    const char *name = counters.name.load(std::memory_order_acquire);
+                    if (name == nullptr)
+                    {
+                        break;
+                    }
+                    size_t i = 0;
+                    while (i < totals.size() && totals[i].name != name)
+                    {
+                        i++;
+                    }
+                    if (i == totals.size())
+                    {
+                        totals.push_back({name, 0, 0, 0, 0, 0});
+                    }
+                    totals[i].calls += counters.calls.load(std::memory_order_relaxed);
+                    totals[i].nanoseconds += counters.nanoseconds.load(std::memory_order_relaxed);
+                    totals[i].allocations += counters.allocations.load(std::memory_order_relaxed);
+                    totals[i].flops += counters.flops.load(std::memory_order_relaxed);
+                    totals[i].bytes += counters.bytes.load(std::memory_order_relaxed);
+                }
+            }
+        }
+        char buffer[256];
+        std::snprintf(buffer, sizeof(buffer), "{\"elapsed_s\":%.3f,\"threads\":%d,\"scopes\":{", now() * 1e-9, noThreads);
+        std::string line = buffer;
+        for (size_t i = 0; i < totals.size(); i++)
+        {
+            const Total &total = totals[i];
+            double seconds = std::max(total.nanoseconds, (int64_t)1) * 1e-9;
+            std::snprintf(buffer, sizeof(buffer), "%s\"%s\":{\"calls\":%lld,\"ms\":%.3f,\"gflops\":%.3f,\"gb_per_s\":%.3f,\"allocations\":%lld}",
+                          i == 0 ? "" : ",", total.name, (long long)total.calls, total.nanoseconds * 1e-6, total.flops / seconds * 1e-9,
+                          total.bytes / seconds * 1e-9, (long long)total.allocations);
+            line += buffer;
+        }
+        return line + "}}";
+    }
+
+    // the traced events of every thread as Chrome trace-event JSON, false if the file cannot be written
+    // meant for when training is idle, events recorded during the call may or may not be included
+    static bool writeChromeTrace(const std::string &fileName)
+    {
+        std::ofstream file(fileName, std::ios::out | std::ios::trunc);
+        if (!file.is_open())
+        {
+            return false;
+        }
+        file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+        bool first = true;
+        char buffer[256];
+        std::lock_guard<std::mutex> guard(registryLock());
+        for (const std::unique_ptr<ThreadProfile> &profile : registry())
+        {
+            std::snprintf(buffer, sizeof(buffer), "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                          first ? "" : ",", profile->id, profile->id);
+            file << buffer;
+            first = false;
+            size_t noEvents = profile->noEvents.load(std::memory_order_acquire);
+            for (size_t i = 0; i < noEvents; i++)
+            {
+                const Event &event = profile->events[i];
+                // timestamps are in microseconds
+                std::snprintf(buffer, sizeof(buffer), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"flops\":%.0f,\"bytes\":%.0f}}",
+                              event.name, profile->id, event.start * 1e-3, event.duration * 1e-3, event.flops, event.bytes);
+                file << buffer;
+            }
+        }
+        file << "\n]}\n";
+        file.close();
+        return !file.fail();
+    }
+
+private:
+    template <typename T>
+    static void add(std::atomic<T> &counter, T amount)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    static std::mutex &registryLock()
+    {
+        static std::mutex lock;
+        return lock;
+    }
+
+    static std::vector<std::unique_ptr<ThreadProfile>> &registry()
+    {
+        static std::vector<std::unique_ptr<ThreadProfile>> profiles;
+        return profiles;
+    }
+
+    static std::atomic<bool> &tracing()
+    {
+        static std::atomic<bool> enabled(false);
+        return enabled;
+    }
+
+    static size_t &traceCapacity()
+    {
+        static size_t capacity = 1 << 18;
+        return capacity;
+    }
+
+    static int64_t &statsInterval()
+    {
+        static int64_t interval = 0;
+        return interval;
+    }
+
+    static int64_t &lastStats()
+    {
+        static int64_t time = 0;
+        return time;
+    }
+};
+
+// Times its own lifetime for the profiler, use it through NN_PROFILE_SCOPE
+class ProfileScope
+{
+private:
+    const char *name;
+    double flops;
+    double bytes;
+    int64_t start;
+    long allocations;
+
+public:
+    explicit ProfileScope(const char *_name, double _flops = 0, double _bytes = 0)
+        : name(_name), flops(_flops), bytes(_bytes), start(Profiler::now()), allocations(AllocationCounter::threadCount()) {}
+
+    ProfileScope(const ProfileScope &) = delete;
+    ProfileScope &operator=(const ProfileScope &) = delete;
+
+    ~ProfileScope()
+    {
+        int64_t end = Profiler::now();
+        Profiler::record(name, start, end - start, flops, bytes, AllocationCounter::threadCount() - allocations);
+    }
+};
+
+#define NN_PROFILE_CONCAT_(a, b) a##b
+#define NN_PROFILE_CONCAT(a, b) NN_PROFILE_CONCAT_(a, b)
+
+#ifdef NN_PROFILE
+#define NN_PROFILE_SCOPE(...) ProfileScope NN_PROFILE_CONCAT(profileScope, __LINE__)(__VA_ARGS__)
+#define NN_PROFILE_TICK() Profiler::tick(std::cout)
+#else
+#define NN_PROFILE_SCOPE(...) \
+    do                        \
+    {                         \
+    } while (false)
+#define NN_PROFILE_TICK() \
+    do                    \
+    {                     \
+    } while (false)
+#endif
+
+#endif
@@ -0,0 +1,458 @@
+// Header guard
+#ifndef QUANTIZED_INFERENCE_ENGINE_H
+#define QUANTIZED_INFERENCE_ENGINE_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+
+#include "Network.cpp"
+#include "InferenceEngine.cpp"
+
+// Post-training int8 quantization of a trained network for batch scoring
+// weights are int8 with one scale per output row (w ~ weightScales[i] * q), activations are uint8 with one scale and
+// zero point per layer input (x ~ inputScale * (q - inputZeroPoint)), calibrated on a sample of the training set.
+// products accumulate exactly in int32, so every kernel below returns the same result; only the float epilogue
+// (scales, biases, tanh) turns them back into activations, quantized again on the fly for the next layer
+
+// Dot products of uint8 activations with int8 weights
+class Int8Kernel
+{
+public:
+    enum Isa
+    {
+        SCALAR,
+        AVX2,
+        VNNI
+    };
+
+    // rows and samples are processed in ROWS x SAMPLES tiles, and every vector is padded to a multiple of ALIGNMENT
+    static const int ROWS = 4;
+    static const int SAMPLES = 4;
+    static const int ALIGNMENT = 64;
+
+    // follows Gemm::activeIsa, so lowering the float kernels with Gemm::setIsa lowers these too
+    static Isa activeIsa()
+    {
+        static Isa vnni = detectVnni();
+        if (Gemm::activeIsa() == Gemm::AVX512 && vnni == VNNI)
+        {
+            return VNNI;
+        }
+        return Gemm::activeIsa() == Gemm::SCALAR ? SCALAR : AVX2;
+    }
+
+    // sums[r * SAMPLES + s] = dot(weights row r, samples s) over n entries, rows and samples stride bytes apart
+    static void tile(int n, const int8_t *weights, const uint8_t *samples, int stride, int32_t *sums)
+    {
+#ifdef GEMM_X86
+        if (activeIsa() == VNNI)
+        {
+            tileVnni(n, weights, samples, stride, sums);
+            return;
+        }
+        if (activeIsa() == AVX2)
+        {
+            tileAvx2(n, weights, samples, stride, sums);
+            return;
+        }
+#endif
+        for (int r = 0; r < ROWS; r++)
+        {
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                int32_t sum = 0;
+                for (int p = 0; p < n; p++)
+                {
+                    sum += (int32_t)weights[r * stride + p] * (int32_t)samples[s * stride + p];
+                }
+                sums[r * SAMPLES + s] = sum;
+            }
+        }
+    }
+
+private:
+    static Isa detectVnni()
+    {
+#ifdef GEMM_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+        {
+            return VNNI;
+        }
+#endif
+        return AVX2;
+    }
+
+#ifdef GEMM_X86
+    // vpmaddubsw would saturate its int16 pair sums (2 x 255 x 127 > 32767), so the bytes are widened to int16 and
+    // multiplied with vpmaddwd, which sums pairs straight into int32
+    __attribute__((target("avx2"))) static void tileAvx2(int n, const int8_t *weights, const uint8_t *samples, int stride, int32_t *sums)
+    {
+        __m256i acc[ROWS][SAMPLES];
+#pragma GCC unroll 4
+        for (int r = 0; r < ROWS; r++)
+        {
+#pragma GCC unroll 4
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                acc[r][s] = _mm256_setzero_si256();
+            }
+        }
+        for (int p = 0; p < n; p += 16)
+        {
+            __m256i x[SAMPLES];
+#pragma GCC unroll 4
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                x[s] = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(samples + s * stride + p)));
+            }
+#pragma GCC unroll 4
+            for (int r = 0; r < ROWS; r++)
+            {
+                __m256i w = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(weights + r * stride + p)));
+#pragma GCC unroll 4
+                for (int s = 0; s < SAMPLES; s++)
+                {
+                    acc[r][s] = _mm256_add_epi32(acc[r][s], _mm256_madd_epi16(w, x[s]));
+                }
+            }
+        }
+#pragma GCC unroll 4
+        for (int r = 0; r < ROWS; r++)
+        {
+#pragma GCC unroll 4
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc[r][s]), _mm256_extracti128_si256(acc[r][s], 1));
+                half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+                half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+                sums[r * SAMPLES + s] = _mm_cvtsi128_si32(half);
+            }
+        }
+    }
+
+    // vpdpbusd multiplies 4 uint8 x int8 pairs and adds them to an int32 lane without intermediate saturation
+    __attribute__((target("avx512f,avx512bw,avx512vnni"))) static void tileVnni(int n, const int8_t *weights, const uint8_t *samples, int stride, int32_t *sums)
+    {
+        __m512i acc[ROWS][SAMPLES];
+#pragma GCC unroll 4
+        for (int r = 0; r < ROWS; r++)
+        {
+#pragma GCC unroll 4
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                acc[r][s] = _mm512_setzero_si512();
+            }
+        }
+        for (int p = 0; p < n; p += 64)
+        {
+            __m512i x[SAMPLES];
+#pragma GCC unroll 4
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                x[s] = _mm512_loadu_si512(samples + s * stride + p);
+            }
+#pragma GCC unroll 4
+            for (int r = 0; r < ROWS; r++)
+            {
+                __m512i w = _mm512_loadu_si512(weights + r * stride + p);
+#pragma GCC unroll 4
+                for (int s = 0; s < SAMPLES; s++)
+                {
+                    acc[r][s] = _mm512_dpbusd_epi32(acc[r][s], x[s], w);
+                }
+            }
+        }
+#pragma GCC unroll 4
+        for (int r = 0; r < ROWS; r++)
+        {
+#pragma GCC unroll 4
+            for (int s = 0; s < SAMPLES; s++)
+            {
+                sums[r * SAMPLES + s] = _mm512_reduce_add_epi32(acc[r][s]);
+            }
+        }
+    }
+#endif
+};
+
+// A FullyConnectedLayer with int8 weights, reading uint8 inputs stored one sample per row of stride bytes
+class QuantizedLayer
+{
+private:
+    int noInputNodes;
+    int noOutputNodes;
+    int stride;                  // bytes per weights row and per input sample, padded with zeros
+    std::vector<int8_t> weights; // noOutputNodes (padded to Int8Kernel::ROWS) rows
+    std::vector<float> weightScales;
+    std::vector<int32_t> rowSums; // sum of every weights row, to take the input zero point back out of the products
+    std::vector<float> biases;
+    float inputScale;
+    float inverseInputScale;
+    int inputZeroPoint;
+    std::vector<float> outputThresholds;
+
+public:
+    // quantize the weights of a trained layer whose inputs were calibrated to lie in [inputMin, inputMax]
+    QuantizedLayer(const FullyConnectedLayer &layer, float inputMin, float inputMax)
+    {
+        noInputNodes = layer.getNoInputNodes();
+        noOutputNodes = layer.getNoOutputNodes();
+        stride = paddedSize(noInputNodes, Int8Kernel::ALIGNMENT);
+        int noRows = paddedSize(noOutputNodes, Int8Kernel::ROWS);
+        weights.assign((size_t)noRows * stride, 0);
+        weightScales.assign(noRows, 0);
+        rowSums.assign(noRows, 0);
+        biases.assign(noRows, 0);
+
+        const Matrix<float> &floatWeights = layer.getWeights();
+        for (int i = 0; i < noOutputNodes; i++)
+        {
+            const float *row = floatWeights.data.data() + (size_t)i * noInputNodes;
+            float largest = 0;
+            for (int j = 0; j < noInputNodes; j++)
+            {
+                largest = std::max(largest, std::fabs(row[j]));
+            }
+            float scale = largest > 0 ? largest / 127 : 1;
+            for (int j = 0; j < noInputNodes; j++)
+            {
+                int8_t q = (int8_t)std::lround(row[j] / scale);
+                weights[(size_t)i * stride + j] = q;
+                rowSums[i] += q;
+            }
+            weightScales[i] = scale;
+            biases[i] = layer.getBiases().data[i];
+        }
+
+        // the range always holds 0, so zero inputs (e.g. blank pixels) quantize exactly
+        inputMin = std::min(inputMin, 0.0f);
+        inputMax = std::max(inputMax, 0.0f);
+        inputScale = inputMax > inputMin ? (inputMax - inputMin) / 255 : 1;
+        inverseInputScale = 1 / inputScale;
+        inputZeroPoint = (int)std::lround(-inputMin / inputScale);
+    }
+
+    int getNoInputNodes() const
+    {
+        return noInputNodes;
+    }
+
+    int getNoOutputNodes() const
+    {
+        return noOutputNodes;
+    }
+
+    int getStride() const
+    {
+        return stride;
+    }
+
+    static int paddedSize(int size, int multiple)
+    {
+        return (size + multiple - 1) / multiple * multiple;
+    }
+
+    // round to nearest and saturate to [0, 255], in integers so the loops over samples vectorize
+    static uint8_t quantize(float x, float inverseScale, float zeroPoint)
+    {
+        int q = (int)(x * inverseScale + zeroPoint + 0.5f);
+        return (uint8_t)std::min(std::max(q, 0), 255);
+    }
+
+    // quantize count float samples, entry (i, j) read at input[i * rsInput + j * csInput], into rows of stride bytes
+    void quantizeInput(const float *input, int rsInput, int csInput, int count, uint8_t *output) const
+    {
+        // the byte stores may alias any member, so everything the loops read is copied out first
+        int n = noInputNodes;
+        float inverseScale = inverseInputScale;
+        float zeroPoint = (float)inputZeroPoint;
+        for (int j = 0; j < count; j++)
+        {
+            uint8_t *sample = output + (size_t)j * stride;
+            if (rsInput == 1)
+            {
+                const float *values = input + (size_t)j * csInput;
+                for (int i = 0; i < n; i++)
+                {
+                    sample[i] = quantize(values[i], inverseScale, zeroPoint);
+                }
+                continue;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                sample[i] = quantize(input[i * rsInput + j * csInput], inverseScale, zeroPoint);
+            }
+        }
+    }
+
+    // tanh is monotonic, so the code the next layer would quantize tanh(z) to is the number of thresholds z has
+    // reached: outputThresholds[k] is the smallest pre-activation whose code is at least k. this replaces one tanh per
+    // hidden activation with an 8-step search
+    void quantizeOutputsFor(const QuantizedLayer &next)
+    {
+        outputThresholds.assign(256, -INFINITY);
+        for (int k = 1; k < 256; k++)
+        {
+            float y = ((float)(k - next.inputZeroPoint) - 0.5f) * next.inputScale;
+            outputThresholds[k] = y <= -1 ? -INFINITY : y >= 1 ? INFINITY : std::atanh(y);
+        }
+    }
+
+    static uint8_t quantizeOutput(float z, const float *thresholds)
+    {
+        int code = 0;
+        for (int step = 128; step > 0; step >>= 1)
+        {
+            code += z >= thresholds[code + step] ? step : 0;
+        }
+        return (uint8_t)code;
+    }
+
+    // tanh(weights * input + biases) for count quantized samples (count padded to Int8Kernel::SAMPLES rows). with a
+    // next layer (see quantizeOutputsFor) the activations are quantized straight into its input rows, otherwise
+    // written as floats (noOutputNodes x count) to output
+    void forwardPropagate(const uint8_t *input, int count, const QuantizedLayer *next, uint8_t *nextInput, float *output) const
+    {
+        // as in quantizeInput, nothing the loops read may live behind a member once bytes are being stored
+        int n = noOutputNodes;
+        int nextStride = next != nullptr ? next->stride : 0;
+        const float *thresholds = outputThresholds.data();
+        int32_t sums[Int8Kernel::ROWS * Int8Kernel::SAMPLES];
+        for (int j = 0; j < count; j += Int8Kernel::SAMPLES)
+        {
+            for (int i = 0; i < n; i += Int8Kernel::ROWS)
+            {
+                Int8Kernel::tile(stride, weights.data() + (size_t)i * stride, input + (size_t)j * stride, stride, sums);
+                for (int r = 0; r < Int8Kernel::ROWS && i + r < n; r++)
+                {
+                    int row = i + r;
+                    float scale = weightScales[row] * inputScale;
+                    float offset = biases[row] - scale * (float)(inputZeroPoint * rowSums[row]);
+                    for (int s = 0; s < Int8Kernel::SAMPLES && j + s < count; s++)
+                    {
+                        float z = scale * (float)sums[r * Int8Kernel::SAMPLES + s] + offset;
+                        if (next != nullptr)
+                        {
+                            nextInput[(size_t)(j + s) * nextStride + row] = quantizeOutput(z, thresholds);
+                        }
+                        else
+                        {
+                            output[(size_t)row * count + j + s] = TanhOp::apply(z);
+                        }
+                    }
+                }
+            }
+        }
+    }
+};
+
+// Drop-in counterpart of InferenceEngine running every layer in int8
+// activations alternate between two uint8 buffers, only the last layer's outputs are floats
+class QuantizedInferenceEngine
+{
+private:
+    std::vector<QuantizedLayer> layers;
+    std::vector<uint8_t> buffers[2];
+    std::vector<float> outputs;
+    int batchSize = 0;
+
+public:
+    // calibrate the activation ranges of every layer by running the float network on noCalibrationSamples entries
+    // spread over calibrationData (MappedDataset, CsvDataset), then quantize the layers
+    template <typename Dataset>
+    QuantizedInferenceEngine(const Network &network, const Dataset &calibrationData, int noCalibrationSamples = 1000, int maxBatchSize = 1024)
+    {
+        const std::vector<FullyConnectedLayer> &networkLayers = network.getLayers();
+        int count = std::min(noCalibrationSamples, calibrationData.size());
+        Matrix<float> input({calibrationData.featureCount(), count});
+        Matrix<float> expectedOutput({calibrationData.labelCount(), count});
+        for (int j = 0; j < count; j++)
+        {
+            calibrationData.gatherSample((int)((long)j * calibrationData.size() / count), j, input.view(), expectedOutput.view());
+        }
+        for (const FullyConnectedLayer &layer : networkLayers)
+        {
+            auto range = std::minmax_element(input.data.begin(), input.data.end());
+            float inputMin = count > 0 ? *range.first : 0;
+            float inputMax = count > 0 ? *range.second : 0;
+            layers.emplace_back(layer, inputMin, inputMax);
+            input = layer.forwardPropagate(input);
+        }
+        for (int i = 0; i + 1 < (int)layers.size(); i++)
+        {
+            layers[i].quantizeOutputsFor(layers[i + 1]);
+        }
+        plan(maxBatchSize);
+    }
+
+    int getNoInputs() const
+    {
+        return layers[0].getNoInputNodes();
+    }
+
+    int getNoOutputs() const
+    {
+        return layers.back().getNoOutputNodes();
+    }
+
+    // grow the buffers to hold batches of up to batchSize entries
+    void plan(int _batchSize)
+    {
+        if (batchSize >= _batchSize)
+        {
+            return;
+        }
+        int rows = QuantizedLayer::paddedSize(_batchSize, Int8Kernel::SAMPLES);
+        size_t widest = 0;
+        for (const QuantizedLayer &layer : layers)
+        {
+            widest = std::max(widest, (size_t)layer.getStride());
+        }
+        // zeroed once, the padding bytes of every row stay zero
+        buffers[0].assign(rows * widest, 0);
+        buffers[1].assign(rows * widest, 0);
+        outputs.assign((size_t)getNoOutputs() * _batchSize, 0);
+        batchSize = _batchSize;
+    }
+
+    // outputs (noOutputs x count) of a batch with one entry per column (noInputs x count), valid until the next call
+    MatrixView<const float> predict(MatrixView<const float> input)
+    {
+        return run(input.data, input.leadingDimension, 1, input.noColumns);
+    }
+
+    // same for count entries stored one after the other (count x noInputs)
+    MatrixView<const float> predictSamples(const float *samples, int count)
+    {
+        return run(samples, 1, getNoInputs(), count);
+    }
+
+    // index of the largest output of every entry of the batch
+    std::vector<int> argmax(MatrixView<const float> input)
+    {
+        return InferenceEngine::classify(predict(input));
+    }
+
+    std::vector<int> argmaxSamples(const float *samples, int count)
+    {
+        return InferenceEngine::classify(predictSamples(samples, count));
+    }
+
+private:
+    MatrixView<const float> run(const float *input, int rsInput, int csInput, int count)
+    {
+        plan(count);
+        layers[0].quantizeInput(input, rsInput, csInput, count, buffers[0].data());
+        for (int i = 0; i < (int)layers.size(); i++)
+        {
+            const QuantizedLayer *next = i + 1 < (int)layers.size() ? &layers[i + 1] : nullptr;
+            layers[i].forwardPropagate(buffers[i % 2].data(), count, next, buffers[(i + 1) % 2].data(), outputs.data());
+        }
+        return MatrixView<const float>(outputs.data(), getNoOutputs(), count);
+    }
+};
+
+#endif
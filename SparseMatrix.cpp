@@ -0,0 +1,193 @@
+// Header guard
+#ifndef SPARSE_MATRIX_H
+#define SPARSE_MATRIX_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Matrix.cpp"
+
+// Sparse matrix stored by columns (CSC): the nonzero entries of column j are indices[start[j] .. start[j + 1]) with
+// the matching values, in increasing row order. for a batch with one sample per column that is one index/value
+// list per sample, e.g. the few lit pixels of an MNIST image
+struct SparseColumns
+{
+    int noRows = 0;
+    int noColumns = 0;
+    std::vector<int> start;
+    std::vector<int> indices;
+    std::vector<float> values;
+
+    // size the lists for rows x columns matrices of up to maxDensity nonzeros, assign never allocates after this
+    void reserve(int rows, int columns, double maxDensity)
+    {
+        start.reserve(columns + 1);
+        size_t capacity = capacityFor(rows, columns, maxDensity);
+        if (indices.size() < capacity)
+        {
+            indices.resize(capacity);
+            values.resize(capacity);
+        }
+    }
+
+    int noNonZeros() const
+    {
+        return start.empty() ? 0 : start[noColumns];
+    }
+
+    double density() const
+    {
+        return noRows == 0 || noColumns == 0 ? 0 : (double)noNonZeros() / ((double)noRows * noColumns);
+    }
+
+    // back to an empty 0 x 0 matrix, keeping the storage
+    void clear()
+    {
+        start.clear();
+        noRows = 0;
+        noColumns = 0;
+    }
+
+    // compress a dense (row-major, possibly strided) matrix column by column. returns false, leaving the matrix empty, as soon as more
+    // than maxDensity of the entries turn out to be nonzero, so a dense input costs little more than one column
+    bool assign(MatrixView<const float> dense, double maxDensity = 1.0)
+    {
+        reserve(dense.noRows, dense.noColumns, maxDensity);
+        noRows = dense.noRows;
+        noColumns = dense.noColumns;
+        size_t limit = (size_t)(maxDensity * noRows * noColumns);
+        start.resize(noColumns + 1);
+        int *rowIndices = indices.data();
+        float *rowValues = values.data();
+        size_t n = 0;
+        for (int j = 0; j < noColumns; j++)
+        {
+            start[j] = (int)n;
+            // every entry is written and the count only moves past the nonzeros, no branch to mispredict
+            for (int i = 0; i < noRows; i++)
+            {
+                float x = dense.data[(size_t)i * dense.leadingDimension + j];
+                rowIndices[n] = i;
+                rowValues[n] = x;
+                n += x != 0;
+            }
+            if (n > limit)
+            {
+                clear();
+                return false;
+            }
+        }
+        start[noColumns] = (int)n;
+        return true;
+    }
+
+private:
+    // the limit plus one column of slack for the unconditional writes
+    static size_t capacityFor(int rows, int columns, double maxDensity)
+    {
+        return (size_t)(std::min(maxDensity, 1.0) * rows * columns) + rows + 1;
+    }
+};
+
+// Sparse-dense products for layers whose input is a SparseColumns batch
+// both go through the dense matrix four rows at a time, those rows of a layer's weights (or of their derivatives)
+// staying in L1 while every sample's nonzeros gather from (or scatter into) them, so the work is rows x nonzeros
+// instead of rows x inputs x samples and each index & value loaded serves four rows
+class SparseGemm
+{
+public:
+    // C (m x n) += A (m x k) * B (k x n sparse), A row-major with leading dimension lda, stored as float or 16 bits
+    template <typename TA>
+    static void multiply(int m, const TA *a, int lda, const SparseColumns &b, float *c, int ldc)
+    {
+        const int *indices = b.indices.data();
+        const float *values = b.values.data();
+        int i = 0;
+        for (; i + 4 <= m; i += 4)
+        {
+            const TA *row0 = a + (size_t)i * lda;
+            const TA *row1 = row0 + lda;
+            const TA *row2 = row1 + lda;
+            const TA *row3 = row2 + lda;
+            float *out = c + (size_t)i * ldc;
+            for (int j = 0; j < b.noColumns; j++)
+            {
+                float sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+                for (int p = b.start[j]; p < b.start[j + 1]; p++)
+                {
+                    int k = indices[p];
+                    float x = values[p];
+                    sum0 += x * (float)row0[k];
+                    sum1 += x * (float)row1[k];
+                    sum2 += x * (float)row2[k];
+                    sum3 += x * (float)row3[k];
+                }
+                out[j] += sum0;
+                out[ldc + j] += sum1;
+                out[2 * (size_t)ldc + j] += sum2;
+                out[3 * (size_t)ldc + j] += sum3;
+            }
+        }
+        for (; i < m; i++)
+        {
+            const TA *row = a + (size_t)i * lda;
+            for (int j = 0; j < b.noColumns; j++)
+            {
+                float sum = 0;
+                for (int p = b.start[j]; p < b.start[j + 1]; p++)
+                {
+                    sum += values[p] * (float)row[indices[p]];
+                }
+                c[(size_t)i * ldc + j] += sum;
+            }
+        }
+    }
+
+    // C (m x k) += D (m x n) * transpose(B), B (k x n sparse): the weight-gradient outer product of a layer, adding
+    // every derivative of row i times a sample's nonzeros into row i of C. only the columns of C that some sample
+    // has a nonzero in are touched
+    static void multiplyTransposed(int m, const float *d, int ldd, const SparseColumns &b, float *c, int ldc)
+    {
+        const int *indices = b.indices.data();
+        const float *values = b.values.data();
+        int i = 0;
+        for (; i + 4 <= m; i += 4)
+        {
+            float *row0 = c + (size_t)i * ldc;
+            float *row1 = row0 + ldc;
+            float *row2 = row1 + ldc;
+            float *row3 = row2 + ldc;
+            const float *derivatives = d + (size_t)i * ldd;
+            for (int j = 0; j < b.noColumns; j++)
+            {
+                float d0 = derivatives[j];
+                float d1 = derivatives[ldd + j];
+                float d2 = derivatives[2 * (size_t)ldd + j];
+                float d3 = derivatives[3 * (size_t)ldd + j];
+                for (int p = b.start[j]; p < b.start[j + 1]; p++)
+                {
+                    int k = indices[p];
+                    float x = values[p];
+                    row0[k] += d0 * x;
+                    row1[k] += d1 * x;
+                    row2[k] += d2 * x;
+                    row3[k] += d3 * x;
+                }
+            }
+        }
+        for (; i < m; i++)
+        {
+            float *row = c + (size_t)i * ldc;
+            for (int j = 0; j < b.noColumns; j++)
+            {
+                float derivative = d[(size_t)i * ldd + j];
+                for (int p = b.start[j]; p < b.start[j + 1]; p++)
+                {
+                    row[indices[p]] += derivative * values[p];
+                }
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,131 @@
+// Header guard
+#ifndef STATIC_NETWORK_H
+#define STATIC_NETWORK_H
+
+#include <vector>
+#include <algorithm>
+
+#include "Network.cpp"
+
+// Inference front end for networks whose topology is fixed at compile time, e.g. StaticNetwork<784, 30, 10>
+// every dimension is a template argument, so the weights and the activations in between live in fixed-size arrays
+// inside the object (make it static or global for big layers) and a prediction never touches the heap. the weights
+// are copied from a trained Network, and a layer runs the same kernels as the dynamic path: Gemm::multiplyVector
+// for the product and Activations::tanh for the activation, called with constant sizes
+
+template <int In, int Out>
+class StaticFullyConnectedLayer
+{
+private:
+    // row-major Out x In like FullyConnectedLayer's, so every output is one contiguous dot product
+    alignas(64) float weights[Out * In];
+    alignas(64) float biases[Out];
+
+public:
+    void load(const FullyConnectedLayer &layer)
+    {
+        std::copy(layer.getWeights().data.begin(), layer.getWeights().data.end(), weights);
+        std::copy(layer.getBiases().data.begin(), layer.getBiases().data.end(), biases);
+    }
+
+    void forwardPropagate(const float *input, float *output) const
+    {
+        std::copy(biases, biases + Out, output);
+        Gemm::multiplyVector(Gemm::NO_TRANSPOSE, Out, In, weights, In, input, 1, output, 1);
+        Activations::tanh(output, Out);
+    }
+};
+
+// the layers of a StaticNetwork, one per consecutive pair of sizes
+template <int In, int Out, int... Rest>
+struct StaticLayers
+{
+    StaticFullyConnectedLayer<In, Out> layer;
+    StaticLayers<Out, Rest...> rest;
+
+    void load(const std::vector<FullyConnectedLayer> &layers, int index)
+    {
+        layer.load(layers[index]);
+        rest.load(layers, index + 1);
+    }
+
+    void forwardPropagate(const float *input, float *output) const
+    {
+        alignas(64) float hidden[Out];
+        layer.forwardPropagate(input, hidden);
+        rest.forwardPropagate(hidden, output);
+    }
+};
+
+template <int In, int Out>
+struct StaticLayers<In, Out>
+{
+    StaticFullyConnectedLayer<In, Out> layer;
+
+    void load(const std::vector<FullyConnectedLayer> &layers, int index)
+    {
+        layer.load(layers[index]);
+    }
+
+    void forwardPropagate(const float *input, float *output) const
+    {
+        layer.forwardPropagate(input, output);
+    }
+};
+
+template <int... Sizes>
+class StaticNetwork
+{
+private:
+    static constexpr int sizes[] = {Sizes...};
+    StaticLayers<Sizes...> layers;
+
+public:
+    static constexpr int noInputs = sizes[0];
+    static constexpr int noOutputs = sizes[sizeof...(Sizes) - 1];
+
+    StaticNetwork() {}
+
+    // false if the trained network does not have exactly this topology
+    bool load(const Network &network)
+    {
+        const std::vector<FullyConnectedLayer> &dynamicLayers = network.getLayers();
+        if ((int)dynamicLayers.size() != (int)sizeof...(Sizes) - 1)
+        {
+            return false;
+        }
+        for (int i = 0; i < (int)dynamicLayers.size(); i++)
+        {
+            if (dynamicLayers[i].getNoInputNodes() != sizes[i] || dynamicLayers[i].getNoOutputNodes() != sizes[i + 1])
+            {
+                return false;
+            }
+        }
+        layers.load(dynamicLayers, 0);
+        return true;
+    }
+
+    // output of the last layer for one entry, input has noInputs values and output room for noOutputs
+    void predict(const float *input, float *output) const
+    {
+        layers.forwardPropagate(input, output);
+    }
+
+    // index of the largest output, i.e. the predicted class
+    int argmax(const float *input) const
+    {
+        float output[noOutputs];
+        predict(input, output);
+        int predicted = 0;
+        for (int i = 1; i < noOutputs; i++)
+        {
+            if (output[i] > output[predicted])
+            {
+                predicted = i;
+            }
+        }
+        return predicted;
+    }
+};
+
+#endif
@@ -1,17 +1,46 @@
+// Header guard
+#ifndef TANH_LAYER_H
+#define TANH_LAYER_H
+
 #include <cmath>
 #include "Matrix.cpp"
+#include "Activations.cpp"
+#include "Profiler.cpp"
 
 // Separate these activation operations into its own layer to make fully connected layer more organized
+// both work in place on float storage through the vectorized kernels of Activations.cpp, one call for contiguous
+// views and one per row for strided ones
 class TanhLayer{
 public:
-    static Matrix<float> forwardPropagate(const Matrix<float> &output) {
-        return Matrix<float>::opElement(output, tanh);
+    static void forwardPropagate(MatrixView<float> output) {
+        NN_PROFILE_SCOPE("tanh.forward", 0, 2.0 * sizeof(float) * output.size());
+        if (output.isContiguous()) {
+            Activations::tanh(output.data, output.size());
+            return;
+        }
+        for (int i = 0; i < output.noRows; i++) {
+            Activations::tanh(output.row(i), output.noColumns);
+        }
     }
 
-    static Matrix<float> getDerivatives(const Matrix<float> &previousLayerOutput, const Matrix<float> &nextLayerDerivatives) {
-        Matrix<float> layerInputDerivatives = Matrix<float>::opElement(previousLayerOutput,[](float n) {return 1 - (float)std::pow(n,2.0f);}); // derivative of tanhx is 1 - tanhx squared
-        layerInputDerivatives.hProduct(nextLayerDerivatives);
+    // derivative of tanhx is 1 - tanhx squared, multiplied into the derivatives wrt the output in place
+    static void getDerivatives(MatrixView<const float> previousLayerOutput, MatrixView<float> nextLayerDerivatives) {
+        NN_PROFILE_SCOPE("tanh.backward", 3.0 * nextLayerDerivatives.size(), 3.0 * sizeof(float) * nextLayerDerivatives.size());
+        if (previousLayerOutput.isContiguous() && nextLayerDerivatives.isContiguous()) {
+            Activations::tanhBackward(previousLayerOutput.data, nextLayerDerivatives.data, nextLayerDerivatives.size());
+            return;
+        }
+        for (int i = 0; i < nextLayerDerivatives.noRows; i++) {
+            Activations::tanhBackward(previousLayerOutput.row(i), nextLayerDerivatives.row(i), nextLayerDerivatives.noColumns);
+        }
+    }
 
-        return layerInputDerivatives;
+    // same for outputs stored in 16 bits, which the expression reads as float
+    template <typename S>
+    static void getDerivatives(MatrixView<const S> previousLayerOutput, MatrixView<float> nextLayerDerivatives) {
+        NN_PROFILE_SCOPE("tanh.backward", 3.0 * nextLayerDerivatives.size(), (sizeof(S) + 2.0 * sizeof(float)) * nextLayerDerivatives.size());
+        nextLayerDerivatives.assign(hProduct(1.0f - square(previousLayerOutput), nextLayerDerivatives));
     }
-};
\ No newline at end of file
+};
+
+#endif
@@ -0,0 +1,254 @@
+// Header guard
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+#include "Profiler.cpp"
+#include "Topology.cpp"
+
+// Long-lived worker threads that run parallel loops with work stealing
+// every worker starts on its own contiguous share of the indices and, once that runs out,
+// steals the upper half of whatever another worker has left, preferring workers on its own NUMA node
+class ThreadPool
+{
+private:
+    // the indices still to be processed by one worker, [begin, end)
+    struct Range
+    {
+        std::mutex lock;
+        int begin = 0;
+        int end = 0;
+    };
+
+    std::vector<std::thread> workers;
+    std::vector<std::unique_ptr<Range>> ranges;
+    std::vector<int> workerNodes; // all 0 unless the pool was given a topology
+    std::vector<int> workerCpus;  // -1 where a worker is not pinned
+
+    std::mutex lock;
+    std::condition_variable startJob;
+    std::condition_variable finishJob;
+    const std::function<void(int, int)> *task = nullptr;
+    long generation = 0; // bumped for every parallelFor so workers know there is new work
+    bool stealing = true;
+    int noBusyWorkers = 0;
+    bool stopping = false;
+
+public:
+    // noThreads <= 0 sizes the pool to the hardware, or to the cpus of the topology
+    // with a topology every worker is pinned to a core, the workers numbered node by node (Topology::cpuOfWorker)
+    explicit ThreadPool(int noThreads = 0, const Topology *topology = nullptr)
+    {
+        NN_PROFILE_SCOPE("pool.start");
+        if (noThreads <= 0)
+        {
+            noThreads = topology != nullptr ? topology->noCpus() : std::max(1, (int)std::thread::hardware_concurrency());
+        }
+        for (int i = 0; i < noThreads; i++)
+        {
+            ranges.emplace_back(new Range());
+            workerNodes.push_back(topology != nullptr ? topology->nodeOfWorker(i, noThreads) : 0);
+            workerCpus.push_back(topology != nullptr ? topology->cpuOfWorker(i, noThreads) : -1);
+        }
+        for (int i = 0; i < noThreads; i++)
+        {
+            workers.emplace_back(&ThreadPool::workerLoop, this, i);
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ~ThreadPool()
+    {
+        NN_PROFILE_SCOPE("pool.join");
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        startJob.notify_all();
+        for (std::thread &worker : workers)
+        {
+            worker.join();
+        }
+    }
+
+    int size() const
+    {
+        return (int)workers.size();
+    }
+
+    // the NUMA node (index into the topology) a worker runs on, 0 without a topology
+    int nodeOf(int worker) const
+    {
+        return workerNodes[worker];
+    }
+
+    // the worker whose own share of a parallelFor over count indices holds index, i.e. the one that runs it unless
+    // it gets stolen. lets memory be placed where the worker that will read it runs
+    static int ownerOf(int index, int count, int noWorkers)
+    {
+        return (int)(((long)index + 1) * noWorkers - 1) / count;
+    }
+
+    // call body(worker, index) for every index in [0, count) and wait until all of them are done
+    // worker is in [0, size()) and never runs two indices at once, so it can pick per-worker buffers
+    void parallelFor(int count, const std::function<void(int, int)> &body)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+        NN_PROFILE_SCOPE("pool.parallelFor");
+        run(count, body, true);
+    }
+
+    // call body(worker) exactly once on every worker's own thread, e.g. so each worker first touches (allocates and
+    // writes) the buffers it is going to use, which puts them in its node's memory
+    void forEachWorker(const std::function<void(int)> &body)
+    {
+        NN_PROFILE_SCOPE("pool.forEachWorker");
+        run(size(), [&](int worker, int) { body(worker); }, false);
+    }
+
+private:
+    // one job: worker i starts on the indices ownerOf maps to it, and takes others' only when allowed to steal
+    void run(int count, const std::function<void(int, int)> &body, bool allowStealing)
+    {
+        int noWorkers = size();
+        for (int i = 0; i < noWorkers; i++)
+        {
+            std::lock_guard<std::mutex> guard(ranges[i]->lock);
+            ranges[i]->begin = (int)((long)count * i / noWorkers);
+            ranges[i]->end = (int)((long)count * (i + 1) / noWorkers);
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        task = &body;
+        stealing = allowStealing;
+        noBusyWorkers = noWorkers;
+        generation++;
+        startJob.notify_all();
+        finishJob.wait(guard, [this] { return noBusyWorkers == 0; });
+        task = nullptr;
+    }
+
+    void workerLoop(int worker)
+    {
+        if (workerCpus[worker] >= 0)
+        {
+            Topology::pinCurrentThread(workerCpus[worker]);
+        }
+        long seenGeneration = 0;
+        while (true)
+        {
+            const std::function<void(int, int)> *currentTask;
+            bool currentStealing;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                startJob.wait(guard, [&] { return stopping || generation != seenGeneration; });
+                if (stopping)
+                {
+                    return;
+                }
+                seenGeneration = generation;
+                currentTask = task;
+                currentStealing = stealing;
+            }
+
+            {
+                NN_PROFILE_SCOPE("pool.work");
+                int index;
+                while (takeIndex(worker, index) || (currentStealing && stealWork(worker) && takeIndex(worker, index)))
+                {
+                    (*currentTask)(worker, index);
+                }
+            }
+
+            std::lock_guard<std::mutex> guard(lock);
+            if (--noBusyWorkers == 0)
+            {
+                finishJob.notify_one();
+            }
+        }
+    }
+
+    // pop the next index off the front of this worker's own range
+    bool takeIndex(int worker, int &index)
+    {
+        Range &range = *ranges[worker];
+        std::lock_guard<std::mutex> guard(range.lock);
+        if (range.begin >= range.end)
+        {
+            return false;
+        }
+        index = range.begin++;
+        return true;
+    }
+
+    // move the upper half of the largest remaining range of another worker into this worker's range
+    // a worker on the same node is robbed first, whatever its node placed for that work stays close
+    bool stealWork(int worker)
+    {
+        while (true)
+        {
+            int victim = -1;
+            int largest = 0;
+            int localVictim = -1;
+            int largestLocal = 0;
+            for (int i = 0; i < size(); i++)
+            {
+                if (i == worker)
+                {
+                    continue;
+                }
+                std::lock_guard<std::mutex> guard(ranges[i]->lock);
+                int remaining = ranges[i]->end - ranges[i]->begin;
+                if (remaining > largest)
+                {
+                    largest = remaining;
+                    victim = i;
+                }
+                if (workerNodes[i] == workerNodes[worker] && remaining > largestLocal)
+                {
+                    largestLocal = remaining;
+                    localVictim = i;
+                }
+            }
+            if (localVictim >= 0)
+            {
+                victim = localVictim;
+            }
+            if (victim < 0)
+            {
+                return false;
+            }
+
+            int begin, end;
+            {
+                std::lock_guard<std::mutex> guard(ranges[victim]->lock);
+                int remaining = ranges[victim]->end - ranges[victim]->begin;
+                if (remaining <= 0)
+                {
+                    continue; // the victim finished in the meantime, look again
+                }
+                end = ranges[victim]->end;
+                begin = end - (remaining + 1) / 2;
+                ranges[victim]->end = begin;
+            }
+            std::lock_guard<std::mutex> guard(ranges[worker]->lock);
+            ranges[worker]->begin = begin;
+            ranges[worker]->end = end;
+            return true;
+        }
+    }
+};
+
+#endif
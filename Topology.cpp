@@ -0,0 +1,300 @@
+// Header guard
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+
+#ifdef __linux__
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
+
+// Where the weights live while the threads of a training loop are spread over several NUMA nodes
+// SHARED: one copy, on whichever node first wrote it
+// REPLICATED: every node runs its workers on a copy of its own, refreshed from the master copy after each step
+// INTERLEAVED: one copy with its pages spread round robin over the nodes, so no single memory bus carries it all
+enum class WeightPlacement
+{
+    SHARED,
+    REPLICATED,
+    INTERLEAVED
+};
+
+// How the threaded training loops (Network::trainThreaded, trainAsync) place their threads & memory
+// the defaults leave everything to the scheduler, as on a single-node machine
+struct TopologySettings
+{
+    bool pinThreads = false;    // bind every worker to a core, the workers of a node to that node's cores
+    bool partitionData = false; // copy the samples a worker trains on into memory that worker first touched
+    WeightPlacement weights = WeightPlacement::SHARED;
+
+    // pinned workers, node-local samples and the given weight placement
+    static TopologySettings numa(WeightPlacement weights = WeightPlacement::REPLICATED)
+    {
+        TopologySettings settings;
+        settings.pinThreads = true;
+        settings.partitionData = true;
+        settings.weights = weights;
+        return settings;
+    }
+
+    // placing anything per node only means something when the workers stay on their node
+    bool pinned() const
+    {
+        return pinThreads || partitionData || weights != WeightPlacement::SHARED;
+    }
+};
+
+// The NUMA nodes this process may run on and their cores, read from sysfs within the process affinity mask
+// wherever that can't be read (another OS, a container without /sys) it is one node holding every hardware thread,
+// on which all the placements above behave like the defaults
+class Topology
+{
+private:
+    std::vector<int> nodeIds;            // the kernel's number of every node
+    std::vector<std::vector<int>> nodes; // the usable cpus of every node, nodes without any are left out
+
+public:
+    // one node with every hardware thread
+    Topology()
+    {
+        int noCpus = std::max(1, (int)std::thread::hardware_concurrency());
+        nodeIds = {0};
+        nodes.emplace_back();
+        for (int cpu = 0; cpu < noCpus; cpu++)
+        {
+            nodes[0].push_back(cpu);
+        }
+    }
+
+    // the given cpus per node, e.g. to lay workers out for another machine
+    explicit Topology(std::vector<std::vector<int>> _nodes)
+    {
+        for (int i = 0; i < (int)_nodes.size(); i++)
+        {
+            if (!_nodes[i].empty())
+            {
+                nodeIds.push_back(i);
+                nodes.push_back(std::move(_nodes[i]));
+            }
+        }
+        if (nodes.empty())
+        {
+            *this = Topology();
+        }
+    }
+
+    // the machine this process runs on
+    static Topology detect()
+    {
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        Topology topology;
+        topology.nodeIds.clear();
+        topology.nodes.clear();
+        for (int id : parseCpuList(readLine("/sys/devices/system/node/online")))
+        {
+            std::vector<int> cpus;
+            for (int cpu : parseCpuList(readLine("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist")))
+            {
+                if (!masked || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+            if (!cpus.empty())
+            {
+                topology.nodeIds.push_back(id);
+                topology.nodes.push_back(cpus);
+            }
+        }
+        if (!topology.nodes.empty())
+        {
+            return topology;
+        }
+#endif
+        return Topology();
+    }
+
+    // "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}, the format of the sysfs cpu & node lists
+    static std::vector<int> parseCpuList(const std::string &list)
+    {
+        std::vector<int> cpus;
+        std::stringstream stream(list);
+        std::string range;
+        while (std::getline(stream, range, ','))
+        {
+            size_t dash = range.find('-');
+            try
+            {
+                int first = std::stoi(range.substr(0, dash));
+                int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+                for (int cpu = first; cpu <= last; cpu++)
+                {
+                    cpus.push_back(cpu);
+                }
+            }
+            catch (const std::exception &)
+            {
+                // blank or malformed entries add nothing
+            }
+        }
+        return cpus;
+    }
+
+    int noNodes() const
+    {
+        return (int)nodes.size();
+    }
+
+    int noCpus() const
+    {
+        int count = 0;
+        for (const std::vector<int> &cpus : nodes)
+        {
+            count += (int)cpus.size();
+        }
+        return count;
+    }
+
+    const std::vector<int> &cpusOf(int node) const
+    {
+        return nodes[node];
+    }
+
+    // the first of the noWorkers workers placed on node, they are numbered node by node. every node gets a share
+    // of the workers in proportion to its cpus
+    int firstWorkerOf(int node, int noWorkers) const
+    {
+        int before = 0;
+        for (int i = 0; i < node; i++)
+        {
+            before += (int)nodes[i].size();
+        }
+        return (int)((long)noWorkers * before / noCpus());
+    }
+
+    int nodeOfWorker(int worker, int noWorkers) const
+    {
+        int node = 0;
+        while (node + 1 < noNodes() && firstWorkerOf(node + 1, noWorkers) <= worker)
+        {
+            node++;
+        }
+        return node;
+    }
+
+    // the workers of a node take its cpus in order, sharing them round robin when there are more workers than cpus
+    int cpuOfWorker(int worker, int noWorkers) const
+    {
+        int node = nodeOfWorker(worker, noWorkers);
+        const std::vector<int> &cpus = nodes[node];
+        return cpus[(worker - firstWorkerOf(node, noWorkers)) % cpus.size()];
+    }
+
+    // bind the calling thread to one cpu, false where that is not supported or not allowed
+    static bool pinCurrentThread(int cpu)
+    {
+#ifdef __linux__
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return sched_setaffinity(0, sizeof(set), &set) == 0;
+#else
+        (void)cpu;
+        return false;
+#endif
+    }
+
+    // spread the whole pages of [data, data + bytes) round robin over every node, moving those already placed
+    // false (leaving the memory where it is) on a single node, without the mbind system call, or for a range
+    // smaller than a page
+    bool interleave(void *data, size_t bytes) const
+    {
+#if defined(__linux__) && defined(SYS_mbind)
+        if (noNodes() < 2)
+        {
+            return false;
+        }
+        // from <numaif.h>, which is only installed with libnuma
+        const int MPOL_INTERLEAVE = 3;
+        const unsigned MPOL_MF_MOVE = 1 << 1;
+        const size_t maskBits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> mask(1);
+        for (int id : nodeIds)
+        {
+            mask.resize(std::max(mask.size(), (size_t)id / maskBits + 1));
+            mask[id / maskBits] |= 1UL << (id % maskBits);
+        }
+
+        uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t begin = ((uintptr_t)data + pageSize - 1) & ~(pageSize - 1);
+        uintptr_t end = ((uintptr_t)data + bytes) & ~(pageSize - 1);
+        if (end <= begin)
+        {
+            return false;
+        }
+        return syscall(SYS_mbind, begin, end - begin, MPOL_INTERLEAVE, mask.data(), mask.size() * maskBits + 1, MPOL_MF_MOVE) == 0;
+#else
+        (void)data;
+        (void)bytes;
+        return false;
+#endif
+    }
+
+    // e.g. "2 NUMA nodes, 16 workers: node 0 cpus 0-7 (8 workers), node 1 cpus 8-15 (8 workers)"
+    std::string describe(int noWorkers) const
+    {
+        std::string text = noNodes() == 1 ? "1 node (no NUMA)" : std::to_string(noNodes()) + " NUMA nodes";
+        text += ", " + std::to_string(noWorkers) + (noWorkers == 1 ? " worker:" : " workers:");
+        for (int node = 0; node < noNodes(); node++)
+        {
+            int end = node + 1 < noNodes() ? firstWorkerOf(node + 1, noWorkers) : noWorkers;
+            text += std::string(node == 0 ? " " : ", ") + "node " + std::to_string(nodeIds[node]) + " cpus " + formatCpuList(nodes[node]) +
+                    " (" + std::to_string(end - firstWorkerOf(node, noWorkers)) + " workers)";
+        }
+        return text;
+    }
+
+private:
+    static std::string readLine(const std::string &path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    // the inverse of parseCpuList
+    static std::string formatCpuList(const std::vector<int> &cpus)
+    {
+        std::string text;
+        for (int i = 0; i < (int)cpus.size();)
+        {
+            int j = i;
+            while (j + 1 < (int)cpus.size() && cpus[j + 1] == cpus[j] + 1)
+            {
+                j++;
+            }
+            text += (text.empty() ? "" : ",") + std::to_string(cpus[i]) + (j > i ? "-" + std::to_string(cpus[j]) : "");
+            i = j + 1;
+        }
+        return text;
+    }
+};
+
+#endif
@@ -0,0 +1,107 @@
+// Header guard
+#ifndef WORKSPACE_H
+#define WORKSPACE_H
+
+#include <cstdlib>
+#include <cstddef>
+#include <cassert>
+#include <algorithm>
+
+#include <sys/mman.h>
+
+#include "Matrix.cpp"
+
+// One aligned block of floats that a plan carves into MatrixViews with a bump pointer
+// the planner first adds up sizeOf() of every buffer, reserves that once, then allocates the buffers in any order
+class Workspace
+{
+private:
+    float *block = nullptr;
+    size_t capacity = 0;
+    size_t used = 0;
+
+    void release()
+    {
+        if (block != nullptr)
+        {
+            munlock(block, capacity * sizeof(float));
+        }
+        std::free(block);
+        block = nullptr;
+        capacity = 0;
+        used = 0;
+    }
+
+public:
+    // every buffer starts on its own cache line
+    static const size_t ALIGNMENT = 64;
+    static const size_t FLOATS_PER_LINE = ALIGNMENT / sizeof(float);
+
+    Workspace() {}
+
+    // buffers are never shared between plans, so a copy starts out empty and has to be planned again
+    Workspace(const Workspace &) {}
+
+    Workspace &operator=(const Workspace &)
+    {
+        release();
+        return *this;
+    }
+
+    ~Workspace()
+    {
+        release();
+    }
+
+    // number of floats a rows x columns buffer of T takes in the workspace, e.g. half as many for BFloat16
+    template <typename T = float>
+    static size_t sizeOf(int rows, int columns)
+    {
+        size_t count = ((size_t)rows * columns * sizeof(T) + sizeof(float) - 1) / sizeof(float);
+        return (count + FLOATS_PER_LINE - 1) / FLOATS_PER_LINE * FLOATS_PER_LINE;
+    }
+
+    // drop every buffer and make room for count floats in a single allocation
+    void reserve(size_t count)
+    {
+        release();
+        block = (float *)std::aligned_alloc(ALIGNMENT, std::max(count, FLOATS_PER_LINE) * sizeof(float));
+        capacity = count;
+    }
+
+    // best effort: keep the block in RAM so the buffers are never swapped out (may fail under RLIMIT_MEMLOCK)
+    bool lock()
+    {
+        return block != nullptr && mlock(block, capacity * sizeof(float)) == 0;
+    }
+
+    template <typename T = float>
+    MatrixView<T> allocate(int rows, int columns)
+    {
+        size_t count = sizeOf<T>(rows, columns);
+        assert(used + count <= capacity);
+        MatrixView<T> buffer((T *)(block + used), rows, columns);
+        used += count;
+        return buffer.setAll(0);
+    }
+
+    // the fill level, and a return to an earlier one: the buffers allocated since are given up together and the next
+    // ones reuse their floats, e.g. for buffers that are never needed at the same time
+    size_t mark() const
+    {
+        return used;
+    }
+
+    void rewind(size_t position)
+    {
+        assert(position <= capacity);
+        used = position;
+    }
+
+    size_t bytesReserved() const
+    {
+        return capacity * sizeof(float);
+    }
+};
+
+#endif
@@ -0,0 +1,124 @@
+// accuracy test of the approximate activation kernels, run by ctest
+// under every instruction set the cpu has, tanh and exp are swept over their input range (a fixed stride through
+// the float bit patterns, so every binade is sampled alike) and compared against double-precision libm within
+// Activations::TANH_MAX_ULP (TANH_MAX_ULP_SIMD for the vector kernels) and EXP_MAX_ULP. a NaN input must come out
+// NaN, also in the partial last vector
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
+
+#include "Activations.cpp"
+
+static int noFailures = 0;
+
+static float fromBits(uint32_t bits)
+{
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+static uint32_t toBits(float x)
+{
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+// error of y in units of the last place of the float nearest to the exact value
+static double ulpError(float y, double exact)
+{
+    int exponent;
+    std::frexp(exact, &exponent);
+    double ulp = std::ldexp(1.0, std::max(exponent - 24, -149));
+    return std::fabs((double)y - exact) / ulp;
+}
+
+// the largest error of kernel over +-[0, limit] (positive and negative limits may differ)
+template <typename Kernel, typename Exact>
+static double sweep(float negativeLimit, float positiveLimit, Kernel kernel, Exact exact)
+{
+    const uint32_t stride = 251;
+    std::vector<float> inputs;
+    for (uint32_t bits = 0; bits <= toBits(positiveLimit); bits += stride)
+    {
+        inputs.push_back(fromBits(bits));
+    }
+    for (uint32_t bits = 0; bits <= toBits(negativeLimit); bits += stride)
+    {
+        inputs.push_back(-fromBits(bits));
+    }
+    std::vector<float> outputs = inputs;
+    kernel(outputs.data(), (int)outputs.size());
+    double worst = 0;
+    for (size_t i = 0; i < inputs.size(); i++)
+    {
+        worst = std::max(worst, ulpError(outputs[i], exact((double)inputs[i])));
+    }
+    return worst;
+}
+
+static void check(const std::string &name, double worst, int bound)
+{
+    std::cout << name + ": at most " + std::to_string(worst) + " ulp" << std::endl;
+    if (!(worst <= bound))
+    {
+        std::cout << "FAIL " + name + ": over the bound of " + std::to_string(bound) + " ulp" << std::endl;
+        noFailures++;
+    }
+}
+
+// NaN at every position of an array one entry longer than two AVX-512 vectors
+template <typename Kernel>
+static void checkNan(const std::string &name, Kernel kernel)
+{
+    const int n = 33;
+    for (int position = 0; position < n; position++)
+    {
+        std::vector<float> values(n, 0.5f);
+        values[position] = std::numeric_limits<float>::quiet_NaN();
+        kernel(values.data(), n);
+        if (!std::isnan(values[position]))
+        {
+            std::cout << "FAIL " + name + ": NaN at " + std::to_string(position) + " became " + std::to_string(values[position]) << std::endl;
+            noFailures++;
+            return;
+        }
+    }
+}
+
+int main()
+{
+    auto tanhKernel = [](float *values, int n) { Activations::tanh(values, n); };
+    auto expKernel = [](float *values, int n) { Activations::map<Activations::Exp>(values, n); };
+    auto sigmoidKernel = [](float *values, int n) { Activations::sigmoid(values, n); };
+    auto exactTanh = [](double x) { return std::tanh(x); };
+    auto exactExp = [](double x) { return std::exp(x); };
+
+    const char *isaNames[] = {"scalar", "avx2", "avx512"};
+    for (int isa = Gemm::SCALAR; isa <= Gemm::AVX512; isa++)
+    {
+        Gemm::setIsa((Gemm::Isa)isa);
+        if ((int)Gemm::activeIsa() != isa)
+        {
+            std::cout << "skipping " + std::string(isaNames[isa]) + ", not supported by this cpu" << std::endl;
+            continue;
+        }
+        std::string prefix = std::string(isaNames[isa]) + " ";
+        // past 10 tanh is +-1 in float, the kernel clamps before that
+        check(prefix + "tanh", sweep(10.0f, 10.0f, tanhKernel, exactTanh), isa == Gemm::SCALAR ? Activations::TANH_MAX_ULP : Activations::TANH_MAX_ULP_SIMD);
+        // the range exp is not clamped in
+        check(prefix + "exp", sweep(87.3f, 88.3f, expKernel, exactExp), Activations::EXP_MAX_ULP);
+        checkNan(prefix + "tanh", tanhKernel);
+        checkNan(prefix + "exp", expKernel);
+        checkNan(prefix + "sigmoid", sigmoidKernel);
+    }
+    Gemm::setIsa(Gemm::AVX512);
+
+    std::cout << (noFailures == 0 ? "all activation checks passed" : std::to_string(noFailures) + " activation checks failed") << std::endl;
+    return noFailures == 0 ? 0 : 1;
+}
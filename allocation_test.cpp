@@ -0,0 +1,101 @@
+// steady-state allocation test, run by ctest on a build with NN_COUNT_ALLOCATIONS
+// after plan() and one warm-up step, planned training steps (every optimizer, mixed precision, activation
+// checkpointing) and planned or engine inference must not call operator new at all
+#include <iostream>
+#include <vector>
+#include <random>
+#include <string>
+
+#include "Network.cpp"
+#include "InferenceEngine.cpp"
+
+static int noFailures = 0;
+
+// the allocations of noSteps calls of step after a warm-up call
+template <typename Step>
+static void check(const std::string &name, int noSteps, Step step)
+{
+    step();
+    long before = AllocationCounter::count();
+    for (int i = 0; i < noSteps; i++)
+    {
+        step();
+    }
+    long allocations = AllocationCounter::count() - before;
+    if (allocations != 0)
+    {
+        std::cout << "FAIL " + name + ": " + std::to_string(allocations) + " allocations in " + std::to_string(noSteps) + " steps" << std::endl;
+        noFailures++;
+    }
+}
+
+int main()
+{
+    if (!AllocationCounter::enabled())
+    {
+        std::cout << "built without NN_COUNT_ALLOCATIONS, nothing is counted" << std::endl;
+        return 1;
+    }
+
+    const int batchSize = 32;
+    const int noSteps = 20;
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<float> pixel(0, 1);
+    std::vector<std::vector<Matrix<float>>> data;
+    for (int i = 0; i < 2 * batchSize; i++)
+    {
+        Matrix<float> input({64, 1});
+        for (float &x : input.data)
+        {
+            x = pixel(gen);
+        }
+        Matrix<float> expectedOutput({10, 1}, 0);
+        expectedOutput.set(i % 10, 0, 1);
+        data.push_back({input, expectedOutput});
+    }
+    const std::vector<std::vector<int>> dimensions = {{64, 48}, {48, 32}, {32, 32}, {32, 10}};
+
+    struct Configuration
+    {
+        std::string name;
+        OptimizerSettings optimizer;
+        bool mixedPrecision;
+        bool checkpointed;
+    };
+    const Configuration configurations[] = {
+        {"sgd", OptimizerSettings::sgd(), false, false},
+        {"momentum", OptimizerSettings::withMomentum(), false, false},
+        {"adam", OptimizerSettings::adam(), false, false},
+        {"adam,bfloat16", OptimizerSettings::adam(), true, false},
+        {"sgd,checkpointed", OptimizerSettings::sgd(), false, true},
+    };
+    for (const Configuration &configuration : configurations)
+    {
+        Network network(dimensions);
+        network.randomNetwork();
+        network.setOptimizer(configuration.optimizer);
+        network.setMixedPrecision(configuration.mixedPrecision);
+        if (configuration.checkpointed)
+        {
+            // keeps the outputs of layers 1 and 3, the first one is recomputed
+            network.setActivationBudget(sizeof(float) * batchSize * (32 + 10 + 48));
+        }
+        network.plan(batchSize);
+        int start = 0;
+        check("trainBatch " + configuration.name, noSteps, [&]() {
+            network.trainBatch(data, start, batchSize, 1e-3f);
+            start = (start + batchSize) % (int)data.size();
+        });
+        MatrixView<const float> input = network.plannedInput(batchSize);
+        check("runPlanned " + configuration.name, noSteps, [&]() { network.runPlanned(input); });
+    }
+
+    Network network(dimensions);
+    network.randomNetwork();
+    InferenceEngine engine(network, batchSize);
+    Matrix<float> batch({64, batchSize}, 0.5f);
+    check("InferenceEngine::predict", noSteps, [&]() { engine.predict(batch.view()); });
+
+    std::cout << (noFailures == 0 ? "no allocations in steady state" : std::to_string(noFailures) + " allocation checks failed") << std::endl;
+    return noFailures == 0 ? 0 : 1;
+}
@@ -0,0 +1,430 @@
+// nn-bench: microbenchmarks of the kernels, the layers and whole training epochs on synthetic MNIST-shaped data
+// every benchmark reports the time per iteration, GFLOP/s (and GB/s for memory-bound ones), samples/sec where a
+// sample makes sense and the heap allocations per iteration, as a table and optionally as JSON to track regressions
+// usage: nn-bench [--filter <substring>] [--json <file>] [--min-time <seconds>]
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+#include "Network.cpp"
+#include "Activations.cpp"
+#include "InferenceEngine.cpp"
+#include "StaticNetwork.cpp"
+
+struct BenchmarkResult
+{
+    std::string name;
+    std::string parameters;
+    long iterations;
+    double seconds; // per iteration, best of the repetitions
+    double flops;   // per iteration, 0 if not meaningful
+    double bytes;   // moved per iteration, 0 if not meaningful
+    double samples; // per iteration, 0 if not meaningful
+    double allocations; // per iteration, only counted when built with NN_COUNT_ALLOCATIONS (nn-bench is)
+};
+
+class BenchmarkRunner
+{
+private:
+    std::string filter;
+    double minTime;
+    std::vector<BenchmarkResult> results;
+    std::ostream console; // std::cout as it was when the runner started, benchmarks may redirect it
+
+    static double now()
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+public:
+    BenchmarkRunner(const std::string &_filter, double _minTime) : filter(_filter), minTime(_minTime), console(std::cout.rdbuf()) {}
+
+    const std::vector<BenchmarkResult> &getResults() const
+    {
+        return results;
+    }
+
+    // time step() after one warm-up call: the iteration count grows until a repetition takes minTime,
+    // then the best of 3 repetitions is kept, which filters out most of the noise of a shared machine
+    void run(const std::string &name, const std::string &parameters, double flops, double bytes, double samples, const std::function<void()> &step)
+    {
+        std::string fullName = name + "/" + parameters;
+        if (fullName.find(filter) == std::string::npos)
+        {
+            return;
+        }
+        step();
+        long iterations = 1;
+        double elapsed = 0;
+        while (true)
+        {
+            double start = now();
+            for (long i = 0; i < iterations; i++)
+            {
+                step();
+            }
+            elapsed = now() - start;
+            if (elapsed >= minTime || iterations >= (1L << 30))
+            {
+                break;
+            }
+            iterations *= elapsed <= 0 ? 16 : std::min(16L, std::max(2L, (long)(minTime / elapsed) + 1));
+        }
+        double best = elapsed / iterations;
+        long allocationsBefore = AllocationCounter::count();
+        for (int repetition = 1; repetition < 3; repetition++)
+        {
+            double start = now();
+            for (long i = 0; i < iterations; i++)
+            {
+                step();
+            }
+            best = std::min(best, (now() - start) / iterations);
+        }
+        double allocations = (double)(AllocationCounter::count() - allocationsBefore) / (2 * iterations);
+
+        BenchmarkResult result = {name, parameters, iterations, best, flops, bytes, samples, allocations};
+        results.push_back(result);
+        print(result);
+    }
+
+    void print(const BenchmarkResult &result)
+    {
+        std::ostringstream line;
+        line.setf(std::ios::fixed);
+        line.precision(2);
+        line << result.name + "/" + result.parameters << ": " << result.seconds * 1e6 << " us";
+        if (result.flops > 0)
+        {
+            line << ", " << result.flops / result.seconds * 1e-9 << " GFLOP/s";
+        }
+        if (result.bytes > 0)
+        {
+            line << ", " << result.bytes / result.seconds * 1e-9 << " GB/s";
+        }
+        if (result.samples > 0)
+        {
+            line << ", " << (long)(result.samples / result.seconds) << " samples/sec";
+        }
+        line << ", " << result.allocations << " allocations/iteration";
+        console << line.str() << std::endl;
+    }
+
+    void writeJson(std::ostream &out) const
+    {
+        const char *isaNames[] = {"scalar", "avx2", "avx512"};
+        out.precision(9);
+        out << "{\n  \"context\": {\"isa\": \"" << isaNames[Gemm::activeIsa()] << "\", \"hardware_threads\": " << std::thread::hardware_concurrency()
+            << ", \"allocation_counting\": " << (AllocationCounter::enabled() ? "true" : "false") << "},\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const BenchmarkResult &result = results[i];
+            out << (i == 0 ? "\n" : ",\n") << "    {\"name\": \"" << result.name << "\", \"parameters\": \"" << result.parameters
+                << "\", \"iterations\": " << result.iterations << ", \"seconds_per_iteration\": " << result.seconds
+                << ", \"gflops\": " << (result.flops > 0 ? result.flops / result.seconds * 1e-9 : 0)
+                << ", \"gbytes_per_second\": " << (result.bytes > 0 ? result.bytes / result.seconds * 1e-9 : 0)
+                << ", \"samples_per_second\": " << (result.samples > 0 ? result.samples / result.seconds : 0)
+                << ", \"allocations_per_iteration\": " << result.allocations << "}";
+        }
+        out << "\n  ]\n}\n";
+    }
+};
+
+static Matrix<float> randomMatrix(int rows, int columns, std::mt19937 &gen)
+{
+    std::uniform_real_distribution<float> distribution(-1, 1);
+    Matrix<float> m({rows, columns});
+    for (float &x : m.data)
+    {
+        x = distribution(gen);
+    }
+    return m;
+}
+
+static std::string shape(int m, int n, int k)
+{
+    return std::to_string(m) + "x" + std::to_string(k) + "*" + std::to_string(k) + "x" + std::to_string(n);
+}
+
+// Matrix::multiply, one column on the right is the GEMV of a single sample, wider ones the GEMM of a batch
+static void benchmarkMultiply(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int shapes[][3] = {{30, 1, 784}, {1024, 1, 784}, {30, 16, 784}, {10, 16, 30}, {256, 256, 256}, {1024, 256, 784}, {1024, 1024, 1024}};
+    for (const auto &s : shapes)
+    {
+        Matrix<float> a = randomMatrix(s[0], s[2], gen);
+        Matrix<float> b = randomMatrix(s[2], s[1], gen);
+        Matrix<float> c;
+        runner.run(s[1] == 1 ? "matrix.gemv" : "matrix.gemm", shape(s[0], s[1], s[2]), 2.0 * s[0] * s[1] * s[2], 0, 0, [&]() { c = a.multiply(b); });
+    }
+}
+
+static void benchmarkTranspose(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int shapes[][2] = {{784, 16}, {784, 1024}, {1024, 1024}};
+    for (const auto &s : shapes)
+    {
+        Matrix<float> a = randomMatrix(s[0], s[1], gen);
+        Matrix<float> t;
+        runner.run("matrix.transpose", std::to_string(s[0]) + "x" + std::to_string(s[1]), 0, 2.0 * sizeof(float) * s[0] * s[1], 0, [&]() { t = Matrix<float>::transpose(a); });
+    }
+}
+
+// the element-wise operations of a layer on a hidden layer's activations of a batch
+static void benchmarkElementWise(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int sizes[][2] = {{30, 16}, {1024, 256}};
+    for (const auto &s : sizes)
+    {
+        double n = (double)s[0] * s[1];
+        std::string parameters = std::to_string(s[0]) + "x" + std::to_string(s[1]);
+        Matrix<float> a = randomMatrix(s[0], s[1], gen);
+        Matrix<float> b = randomMatrix(s[0], s[1], gen);
+        Matrix<float> column = randomMatrix(s[0], 1, gen);
+        runner.run("elementwise.add", parameters, n, 3 * sizeof(float) * n, 0, [&]() { a.add(b); });
+        // the operands of the in-place products are chosen so that repeating them never drifts into denormals
+        Matrix<float> signs({s[0], s[1]}, 1);
+        for (int i = 0; i < s[0] * s[1]; i += 2)
+        {
+            signs.data[i] = -1;
+        }
+        runner.run("elementwise.hProduct", parameters, n, 3 * sizeof(float) * n, 0, [&]() { a.hProduct(signs); });
+        runner.run("elementwise.addToColumns", parameters, n, 2 * sizeof(float) * n, 0, [&]() { a.addToColumns(column); });
+        // tanh(x), re-seeding the input each time so the values stay in the interesting range, and its derivative
+        // at outputs of 0, where the factor is 1
+        Matrix<float> x = randomMatrix(s[0], s[1], gen);
+        Matrix<float> zeros({s[0], s[1]}, 0);
+        runner.run("elementwise.tanh", parameters, 0, 3 * sizeof(float) * n, 0, [&]() {
+            a.assign(x);
+            Activations::tanh(a.data.data(), (int)a.data.size());
+        });
+        runner.run("elementwise.tanhBackward", parameters, 3 * n, 3 * sizeof(float) * n, 0, [&]() {
+            Activations::tanhBackward(zeros.data.data(), b.data.data(), (int)b.data.size());
+        });
+    }
+}
+
+// one layer of the MNIST network (784 -> 30) and a wide one (784 -> 1024) on batches of a few sizes
+static void benchmarkLayers(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int shapes[][3] = {{784, 30, 16}, {784, 30, 256}, {784, 1024, 256}};
+    for (const auto &s : shapes)
+    {
+        int noInputs = s[0];
+        int noOutputs = s[1];
+        int batchSize = s[2];
+        std::string parameters = std::to_string(noInputs) + "->" + std::to_string(noOutputs) + ",batch=" + std::to_string(batchSize);
+        FullyConnectedLayer layer(noInputs, noOutputs);
+        layer.randomLayer(gen);
+        Matrix<float> input = randomMatrix(noInputs, batchSize, gen);
+        Matrix<float> output({noOutputs, batchSize});
+        double flops = 2.0 * noInputs * noOutputs * batchSize;
+        runner.run("layer.forwardPropagate", parameters, flops, 0, batchSize, [&]() { layer.forwardPropagate(input.view(), output.view()); });
+
+        // the sparse path on an input with MNIST's share of nonzero pixels (about 1 in 9), compression included
+        if (batchSize <= FullyConnectedLayer::SPARSE_MAX_BATCH)
+        {
+            Matrix<float> sparse = input;
+            std::uniform_int_distribution<int> keep(0, 8);
+            for (float &x : sparse.data)
+            {
+                x = keep(gen) == 0 ? x : 0;
+            }
+            SparseColumns sparseInput;
+            sparseInput.reserve(noInputs, batchSize, FullyConnectedLayer::SPARSE_DENSITY);
+            runner.run("layer.forwardSparse", parameters, flops, 0, batchSize, [&]() { layer.forwardPropagate(sparse.view(), output.view(), sparseInput); });
+        }
+
+        // outputs of 0 make the tanh factor 1, so the derivatives, which are overwritten in place, stay the same
+        Matrix<float> zeroOutput({noOutputs, batchSize}, 0);
+        Matrix<float> nextDerivatives = randomMatrix(noOutputs, batchSize, gen);
+        Matrix<float> inputDerivatives({noInputs, batchSize});
+        runner.run("layer.getDerivatives", parameters, 2 * flops, 0, batchSize, [&]() {
+            layer.getDerivatives<float, float>(input.view(), zeroOutput.view(), nextDerivatives.view(), inputDerivatives.view());
+        });
+    }
+}
+
+// one step of every optimizer on the parameters of a 784 -> 1024 layer. the derivatives it resets are put back
+// before each step, which adds a copy to every iteration
+static void benchmarkOptimizers(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int noParameters = 784 * 1024 + 1024;
+    Matrix<float> parameters = randomMatrix(noParameters, 1, gen);
+    Matrix<float> derivatives = randomMatrix(noParameters, 1, gen);
+    Matrix<float> step({noParameters, 1});
+    const OptimizerSettings settings[] = {OptimizerSettings::sgd(), OptimizerSettings::withMomentum(), OptimizerSettings::adam()};
+    const char *names[] = {"sgd", "momentum", "adam"};
+    for (int i = 0; i < 3; i++)
+    {
+        Optimizer optimizer(settings[i]);
+        optimizer.addTensor(parameters.data.data(), step.data.data(), noParameters, true);
+        runner.run("optimizer.step", std::string(names[i]) + ",parameters=" + std::to_string(noParameters), 0, 0, 0, [&]() {
+            std::copy(derivatives.data.begin(), derivatives.data.end(), step.data.begin());
+            optimizer.step(1e-6f);
+        });
+    }
+}
+
+// discards whatever is written to it
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override
+    {
+        return c;
+    }
+};
+
+// one epoch of train and trainThreaded on random 784-pixel images with one-hot labels. the training loops print
+// their progress, which is swallowed here
+static void benchmarkTraining(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int noSamples = 4096;
+    std::uniform_real_distribution<float> pixel(0, 1);
+    std::uniform_int_distribution<int> label(0, 9);
+    std::vector<std::vector<Matrix<float>>> data;
+    for (int i = 0; i < noSamples; i++)
+    {
+        Matrix<float> input({784, 1});
+        for (float &x : input.data)
+        {
+            x = pixel(gen);
+        }
+        Matrix<float> expectedOutput({10, 1}, 0);
+        expectedOutput.set(label(gen), 0, 1);
+        data.push_back({input, expectedOutput});
+    }
+
+    const int hiddenSizes[] = {30, 256};
+    const int batchSizes[] = {16, 128};
+    NullBuffer sink;
+    std::streambuf *console = std::cout.rdbuf(&sink);
+    for (int hidden : hiddenSizes)
+    {
+        for (int batchSize : batchSizes)
+        {
+            Network network({{784, hidden}, {hidden, 10}});
+            network.randomNetwork();
+            // forward 2 flops per weight, backward 4 (input and weight derivatives)
+            double flops = 6.0 * (784 * hidden + hidden * 10) * noSamples;
+            std::string parameters = "784-" + std::to_string(hidden) + "-10,batch=" + std::to_string(batchSize) + ",samples=" + std::to_string(noSamples);
+            runner.run("network.train", parameters, flops, 0, noSamples, [&]() { network.train(data, 0.01f, 1, batchSize); });
+            runner.run("network.trainThreaded", parameters, flops, 0, noSamples, [&]() { network.trainThreaded(data, 0.01f, 1, batchSize); });
+        }
+    }
+    std::cout.rdbuf(console);
+}
+
+// planned training steps of a deep stack, keeping every activation vs. recomputing within 3/5 of their memory
+static void benchmarkCheckpointing(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    const int batchSize = 256;
+    const int depth = 9;
+    const int width = 256;
+    std::vector<std::vector<Matrix<float>>> data;
+    for (int i = 0; i < batchSize; i++)
+    {
+        Matrix<float> expectedOutput({10, 1}, 0);
+        expectedOutput.set(i % 10, 0, 1);
+        data.push_back({randomMatrix(784, 1, gen), expectedOutput});
+    }
+    std::vector<std::vector<int>> dimensions = {{784, width}};
+    for (int i = 1; i < depth; i++)
+    {
+        dimensions.push_back({width, width});
+    }
+    dimensions.push_back({width, 10});
+    double flops = 6.0 * batchSize * (784.0 * width + (depth - 1.0) * width * width + width * 10.0);
+    size_t allActivations = sizeof(float) * batchSize * ((size_t)depth * width + 10);
+
+    for (size_t budget : {(size_t)0, allActivations * 3 / 5})
+    {
+        Network network(dimensions);
+        network.randomNetwork();
+        network.setActivationBudget(budget);
+        network.plan(batchSize);
+        std::string parameters = "784-" + std::to_string(width) + "x" + std::to_string(depth) + "-10,batch=" + std::to_string(batchSize) +
+                                 ",kept=" + std::to_string(network.getCheckpointPlan().noKept()) + "/" + std::to_string(depth + 1) +
+                                 ",activationBytes=" + std::to_string(network.getCheckpointPlan().activationBytes);
+        runner.run("network.trainBatch", parameters, flops, 0, batchSize, [&]() { network.trainBatch(data, 0, batchSize, 1e-4f); });
+    }
+}
+
+// latency of a single 784-30-10 prediction through the compile-time-shaped StaticNetwork, the InferenceEngine with a
+// batch of one and Network::runNetwork, which allocates its outputs
+static void benchmarkPrediction(BenchmarkRunner &runner, std::mt19937 &gen)
+{
+    Network network({{784, 30}, {30, 10}});
+    network.randomNetwork();
+    Matrix<float> input = randomMatrix(784, 1, gen);
+    double flops = 2.0 * (784 * 30 + 30 * 10);
+    float output[10];
+
+    // too big for the stack
+    static StaticNetwork<784, 30, 10> staticNetwork;
+    staticNetwork.load(network);
+    runner.run("predict.static", "784-30-10", flops, 0, 1, [&]() { staticNetwork.predict(input.data.data(), output); });
+
+    InferenceEngine engine(network, 1);
+    runner.run("predict.engine", "784-30-10", flops, 0, 1, [&]() { engine.predict(input.view()); });
+
+    runner.run("predict.runNetwork", "784-30-10", flops, 0, 1, [&]() { network.runNetwork(input); });
+}
+
+int main(int argc, char **argv)
+{
+    std::string filter;
+    std::string jsonFile;
+    double minTime = 0.2;
+    for (int i = 1; i < argc; i++)
+    {
+        std::string argument = argv[i];
+        if (argument == "--filter" && i + 1 < argc)
+        {
+            filter = argv[++i];
+        }
+        else if (argument == "--json" && i + 1 < argc)
+        {
+            jsonFile = argv[++i];
+        }
+        else if (argument == "--min-time" && i + 1 < argc)
+        {
+            minTime = std::stod(argv[++i]);
+        }
+        else
+        {
+            std::cout << "Usage: nn-bench [--filter <substring>] [--json <file>] [--min-time <seconds>]" << std::endl;
+            return 1;
+        }
+    }
+
+    BenchmarkRunner runner(filter, minTime);
+    std::mt19937 gen(42);
+    benchmarkMultiply(runner, gen);
+    benchmarkTranspose(runner, gen);
+    benchmarkElementWise(runner, gen);
+    benchmarkLayers(runner, gen);
+    benchmarkOptimizers(runner, gen);
+    benchmarkPrediction(runner, gen);
+    benchmarkTraining(runner, gen);
+    benchmarkCheckpointing(runner, gen);
+
+    if (!jsonFile.empty())
+    {
+        std::ofstream out(jsonFile);
+        runner.writeJson(out);
+        if (!out)
+        {
+            std::cout << "Could not write " + jsonFile << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,163 @@
+// test of the multi-process collectives, run by ctest
+// 1 to 4 ranks forked through ProcessGroup meet over a SharedMemoryTransport whose rings are smaller than the
+// messages, so every exchange wraps around them several times. the sums are of small integers, which float adds up
+// exactly, so every result is compared for equality. every rank exits with the outcome of its own checks and the
+// original process collects them with join()
+#include <iostream>
+#include <vector>
+#include <string>
+
+#include <unistd.h>
+
+#include "Network.cpp"
+
+static const size_t CHANNEL_CAPACITY = 1000;
+
+static bool fail(int rank, int noRanks, const std::string &what)
+{
+    std::cout << "FAIL rank " + std::to_string(rank) + " of " + std::to_string(noRanks) + ": " + what << std::endl;
+    return false;
+}
+
+// sum of counts both below the number of ranks and several times the ring capacity, not multiples of either
+static bool testSum(RingAllReduce &ring, int rank, int noRanks)
+{
+    for (size_t count : {(size_t)1, (size_t)3, (size_t)CHANNEL_CAPACITY + 1, (size_t)5 * CHANNEL_CAPACITY + 7})
+    {
+        std::vector<float> data(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            data[i] = (float)((rank + 1) * (i % 100));
+        }
+        ring.sum(data.data(), count);
+        // 1 + 2 + ... + noRanks times every rank's base value
+        float factor = (float)(noRanks * (noRanks + 1) / 2);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (data[i] != factor * (float)(i % 100))
+            {
+                return fail(rank, noRanks, "sum of " + std::to_string(count) + " floats, entry " + std::to_string(i) + " is " + std::to_string(data[i]));
+            }
+        }
+    }
+    return true;
+}
+
+// broadcast from every root in turn
+static bool testBroadcast(RingAllReduce &ring, int rank, int noRanks)
+{
+    const size_t count = 3 * CHANNEL_CAPACITY + 11;
+    for (int root = 0; root < noRanks; root++)
+    {
+        std::vector<float> data(count, -1);
+        if (rank == root)
+        {
+            for (size_t i = 0; i < count; i++)
+            {
+                data[i] = (float)(root * 1000 + i % 997);
+            }
+        }
+        ring.broadcast(data.data(), count, root);
+        for (size_t i = 0; i < count; i++)
+        {
+            if (data[i] != (float)(root * 1000 + i % 997))
+            {
+                return fail(rank, noRanks, "broadcast from " + std::to_string(root) + ", entry " + std::to_string(i) + " is " + std::to_string(data[i]));
+            }
+        }
+    }
+    return true;
+}
+
+// trainDistributed keeps the replicas identical: every rank's parameters equal rank 0's, bit for bit
+static bool testTrainDistributed(Transport &transport, RingAllReduce &ring, int rank, int noRanks)
+{
+    std::vector<std::vector<Matrix<float>>> data;
+    for (int i = 0; i < 96; i++)
+    {
+        Matrix<float> input({16, 1});
+        for (int j = 0; j < 16; j++)
+        {
+            input.set(j, 0, (float)((i * 7 + j * 3) % 11) / 11);
+        }
+        Matrix<float> expectedOutput({4, 1}, 0);
+        expectedOutput.set(i % 4, 0, 1);
+        data.push_back({input, expectedOutput});
+    }
+    Network network({{16, 12}, {12, 4}});
+    // a different start on every rank, trainDistributed broadcasts rank 0's
+    network.randomNetwork();
+    network.trainDistributed(data, transport, 0.05f, 2, 8);
+
+    std::vector<float> parameters;
+    for (const FullyConnectedLayer &layer : network.getLayers())
+    {
+        parameters.insert(parameters.end(), layer.getWeights().data.begin(), layer.getWeights().data.end());
+        parameters.insert(parameters.end(), layer.getBiases().data.begin(), layer.getBiases().data.end());
+    }
+    std::vector<float> reference = parameters;
+    ring.broadcast(reference.data(), reference.size());
+    if (parameters != reference)
+    {
+        return fail(rank, noRanks, "parameters differ from rank 0's after trainDistributed");
+    }
+    return true;
+}
+
+int main()
+{
+    bool passed = true;
+    for (int noRanks = 1; noRanks <= 4; noRanks++)
+    {
+        // unique to this run and this group, every rank derives the same name before the fork
+        std::string name = "/nn-collective-test-" + std::to_string(getpid()) + "-" + std::to_string(noRanks);
+        ProcessGroup group;
+        int rank = group.fork(noRanks);
+        if (rank < 0)
+        {
+            std::cout << "FAIL: could not fork " + std::to_string(noRanks) + " ranks" << std::endl;
+            return 1;
+        }
+
+        bool ok;
+        SharedMemoryTransport transport;
+        if (!transport.open(name, rank, noRanks, CHANNEL_CAPACITY))
+        {
+            ok = fail(rank, noRanks, "could not join " + name);
+        }
+        else
+        {
+            RingAllReduce ring(transport);
+            ok = testSum(ring, rank, noRanks);
+            ok = testBroadcast(ring, rank, noRanks) && ok;
+            ok = testTrainDistributed(transport, ring, rank, noRanks) && ok;
+            transport.barrier();
+        }
+        if (rank != 0)
+        {
+            std::cout.flush();
+            _exit(ok ? 0 : 1);
+        }
+        if (!group.join() || !ok)
+        {
+            std::cout << "FAIL: " + std::to_string(noRanks) + " ranks" << std::endl;
+            passed = false;
+        }
+    }
+
+    // join reports a child that failed
+    ProcessGroup group;
+    int rank = group.fork(2);
+    if (rank == 1)
+    {
+        _exit(3);
+    }
+    if (group.join())
+    {
+        std::cout << "FAIL: join missed a child exiting with status 3" << std::endl;
+        passed = false;
+    }
+
+    std::cout << (passed ? "all collective checks passed" : "collective checks failed") << std::endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,50 @@
+// nn-convert: one-time conversion of a csv dataset (label first, then the features, one header line)
+// into the binary format of Dataset.cpp that training maps straight into memory
+// usage: nn-convert mnist_train.csv mnist_train.bin [u8|f32]
+#include <iostream>
+#include <string>
+
+#include "Dataset.cpp"
+#include "CsvLoader.cpp"
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::cout << "Usage: nn-convert <input.csv> <output.bin> [u8|f32]" << std::endl;
+        return 1;
+    }
+    // u8 keeps the raw pixels (4x smaller), f32 stores normalized values that can be read in place
+    DatasetHeader::Dtype dtype = argc > 3 && std::string(argv[3]) == "u8" ? DatasetHeader::U8 : DatasetHeader::F32;
+
+    // raw values, the writer applies the normalization
+    CsvDataset csv;
+    if (!csv.load(argv[1], 0, 1.0f))
+    {
+        std::cout << "Could not read file" << std::endl;
+        return 1;
+    }
+
+    // pixels are normalized to have value [0, 1]
+    DatasetWriter writer;
+    if (!writer.open(argv[2], csv.featureCount(), 0, dtype, 1.0f / 255))
+    {
+        std::cout << "Could not open file" << std::endl;
+        return 1;
+    }
+    for (int i = 0; i < csv.size(); i++)
+    {
+        if (!writer.addSample(csv.input(i).data, csv.label(i)))
+        {
+            std::cout << "Conversion failed at entry #" + std::to_string(i) << std::endl;
+            return 1;
+        }
+    }
+    if (!writer.close())
+    {
+        std::cout << "Conversion failed" << std::endl;
+        return 1;
+    }
+    std::cout << "Conversion completed" << std::endl;
+    return 0;
+}
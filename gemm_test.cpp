@@ -0,0 +1,173 @@
+// correctness test of the GEMM entry points against Gemm::reference, run by ctest
+// every entry point is checked under every instruction set the cpu has, on ragged shapes that leave partial
+// register tiles and cache blocks, with leading dimensions wider than the rows
+#include <iostream>
+#include <vector>
+#include <random>
+#include <cmath>
+#include <string>
+
+#include "Gemm.cpp"
+#include "HalfFloat.cpp"
+
+static int noFailures = 0;
+static std::mt19937 gen(7);
+
+static std::vector<float> randomValues(size_t count)
+{
+    std::uniform_real_distribution<float> distribution(-1, 1);
+    std::vector<float> values(count);
+    for (float &x : values)
+    {
+        x = distribution(gen);
+    }
+    return values;
+}
+
+// every entry of c within a tolerance growing with the length k of the dot products
+static void check(const std::string &name, const std::vector<float> &c, const std::vector<float> &expected, int k)
+{
+    float tolerance = 1e-5f * (k + 1);
+    for (size_t i = 0; i < c.size(); i++)
+    {
+        if (!(std::fabs(c[i] - expected[i]) <= tolerance))
+        {
+            std::cout << "FAIL " + name + ": entry " + std::to_string(i) + " is " + std::to_string(c[i]) + ", expected " + std::to_string(expected[i]) << std::endl;
+            noFailures++;
+            return;
+        }
+    }
+}
+
+static std::string shape(const std::string &isa, const std::string &entry, int m, int n, int k)
+{
+    return isa + " " + entry + " " + std::to_string(m) + "x" + std::to_string(n) + "x" + std::to_string(k);
+}
+
+// multiply, multiplyStrided through the transpose flags, and a bfloat16 A through multiplyMixed
+static void testMultiply(const std::string &isa, int m, int n, int k)
+{
+    const int pad = 3;
+    for (int transA = 0; transA < 2; transA++)
+    {
+        for (int transB = 0; transB < 2; transB++)
+        {
+            // op(A) is m x k: stored k x m when transposed, same for B
+            int lda = (transA ? m : k) + pad;
+            int ldb = (transB ? k : n) + pad;
+            int ldc = n + pad;
+            std::vector<float> a = randomValues((size_t)(transA ? k : m) * lda);
+            std::vector<float> b = randomValues((size_t)(transB ? n : k) * ldb);
+            std::vector<float> c = randomValues((size_t)m * ldc);
+            std::vector<float> initial = c;
+            std::vector<float> expected = c;
+            Gemm::reference(m, n, k, a.data(), transA ? 1 : lda, transA ? lda : 1, b.data(), transB ? 1 : ldb, transB ? ldb : 1, expected.data(), ldc);
+
+            std::string name = shape(isa, "multiply(" + std::to_string(transA) + "," + std::to_string(transB) + ")", m, n, k);
+            Gemm::multiply(transA ? Gemm::TRANSPOSE : Gemm::NO_TRANSPOSE, transB ? Gemm::TRANSPOSE : Gemm::NO_TRANSPOSE, m, n, k, a.data(), lda, b.data(), ldb, c.data(), ldc);
+            check(name, c, expected, k);
+
+            // the plain row-major entry point on the same operands
+            if (!transA && !transB)
+            {
+                Gemm::multiply(m, n, k, a.data(), lda, b.data(), ldb, initial.data(), ldc);
+                check(shape(isa, "multiply", m, n, k), initial, expected, k);
+            }
+        }
+    }
+
+    // A stored as bfloat16, read as float by the packing
+    int lda = k + pad;
+    std::vector<float> values = randomValues((size_t)m * lda);
+    std::vector<BFloat16> a(values.begin(), values.end());
+    std::vector<float> rounded(a.begin(), a.end());
+    std::vector<float> b = randomValues((size_t)k * n);
+    std::vector<float> c = randomValues((size_t)m * n);
+    std::vector<float> expected = c;
+    Gemm::reference(m, n, k, rounded.data(), lda, 1, b.data(), n, 1, expected.data(), n);
+    Gemm::multiplyMixed(m, n, k, a.data(), lda, 1, b.data(), n, 1, c.data(), n);
+    check(shape(isa, "multiplyMixed<bf16>", m, n, k), c, expected, k);
+}
+
+// y += op(A) x with strided vectors, both orientations
+static void testMultiplyVector(const std::string &isa, int m, int k)
+{
+    const int incX = 2;
+    const int incY = 3;
+    for (int transA = 0; transA < 2; transA++)
+    {
+        int lda = (transA ? m : k) + 1;
+        std::vector<float> a = randomValues((size_t)(transA ? k : m) * lda);
+        std::vector<float> x = randomValues((size_t)k * incX);
+        std::vector<float> y = randomValues((size_t)m * incY);
+        std::vector<float> expected = y;
+        // y as an m x 1 matrix with leading dimension incY, x as a k x 1 one with row stride incX
+        Gemm::reference(m, 1, k, a.data(), transA ? 1 : lda, transA ? lda : 1, x.data(), incX, 1, expected.data(), incY);
+        Gemm::multiplyVector(transA ? Gemm::TRANSPOSE : Gemm::NO_TRANSPOSE, m, k, a.data(), lda, x.data(), incX, y.data(), incY);
+        check(shape(isa, "multiplyVector(" + std::to_string(transA) + ")", m, 1, k), y, expected, k);
+    }
+}
+
+static void testTranspose(int rows, int cols)
+{
+    int lda = cols + 5;
+    int ldb = rows + 2;
+    std::vector<float> a = randomValues((size_t)rows * lda);
+    std::vector<float> b((size_t)cols * ldb, 0);
+    std::vector<float> expected = b;
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            expected[(size_t)j * ldb + i] = a[(size_t)i * lda + j];
+        }
+    }
+    Gemm::transpose(rows, cols, a.data(), lda, b.data(), ldb);
+    check("transpose " + std::to_string(rows) + "x" + std::to_string(cols), b, expected, 0);
+}
+
+int main()
+{
+    // k == 1 goes through the outer product, n == 1 and m == 1 through the matrix-vector product, the rest through
+    // the blocked kernels with partial tiles and (for 300) more than one cache block
+    const int sizes[] = {1, 2, 5, 8, 17, 33, 300};
+    const char *isaNames[] = {"scalar", "avx2", "avx512"};
+    for (int isa = Gemm::SCALAR; isa <= Gemm::AVX512; isa++)
+    {
+        Gemm::setIsa((Gemm::Isa)isa);
+        if ((int)Gemm::activeIsa() != isa)
+        {
+            std::cout << "skipping " + std::string(isaNames[isa]) + ", not supported by this cpu" << std::endl;
+            continue;
+        }
+        for (int m : sizes)
+        {
+            for (int n : sizes)
+            {
+                for (int k : sizes)
+                {
+                    if ((long)m * n * k <= 300L * 300 * 33)
+                    {
+                        testMultiply(isaNames[isa], m, n, k);
+                    }
+                }
+            }
+            for (int k : sizes)
+            {
+                testMultiplyVector(isaNames[isa], m, k);
+            }
+        }
+    }
+    Gemm::setIsa(Gemm::AVX512);
+
+    for (int rows : {1, 7, 8, 31, 33, 100})
+    {
+        for (int cols : {1, 9, 32, 65})
+        {
+            testTranspose(rows, cols);
+        }
+    }
+
+    std::cout << (noFailures == 0 ? "all GEMM checks passed" : std::to_string(noFailures) + " GEMM checks failed") << std::endl;
+    return noFailures == 0 ? 0 : 1;
+}
@@ -4,67 +4,133 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <sstream>
+#include <string>
+
+#include <unistd.h>
 
 #include "Network.cpp"
+#include "Checkpoint.cpp"
+#include "InferenceEngine.cpp"
+#include "QuantizedInferenceEngine.cpp"
 #include "Matrix.cpp"
 
-int main()
+// classes predicted for the whole test set in batches of batchSize, and the samples/sec of doing so
+template <typename Engine>
+std::vector<int> scoreTestSet(Engine &engine, const CsvDataset &testData, int batchSize, double &samplesPerSecond)
 {
-    int noEpochs = 15;
-    int batchSize = 16;
-    float learnRate = 0.015;
-    
-    // read training entries from csv file
-    std::vector<std::vector<std::string>> content;
-    std::vector<std::string> entry;
-    std::string line;
-    std::string word;
-
-    std::fstream trainingFile("mnist_train.csv", std::ios::in);
-    // get training entry by entry
-    if (trainingFile.is_open())
-    {
-        std::cout << "Reading training data" << std::endl;
-        while (std::getline(trainingFile, line))
-        {
-            entry.clear();
-            std::stringstream str(line);
-            while (std::getline(str, word, ','))
-            {
-                entry.push_back(word);
-            }
-            content.push_back(entry);
-        }
-        trainingFile.close();
-    }
-    else
+    std::vector<int> predictedOutputs;
+    auto startTime = std::chrono::high_resolution_clock::now();
+    for (int start = 0; start < testData.size(); start += batchSize)
     {
-        std::cout << "Could not open file" << std::endl;
-        return 0;
+        int count = std::min(batchSize, testData.size() - start);
+        std::vector<int> batch = engine.argmaxSamples(testData.input(start).data, count);
+        predictedOutputs.insert(predictedOutputs.end(), batch.begin(), batch.end());
     }
-    std::cout << "File reading completed" << std::endl;
+    auto endTime = std::chrono::high_resolution_clock::now();
+    samplesPerSecond = testData.size() / std::chrono::duration<double>(endTime - startTime).count();
+    return predictedOutputs;
+}
 
-    std::cout << "Processing training data" << std::endl;
+// accuracy and throughput of an int8 copy of the network, calibrated on calibrationData, against the float one
+template <typename Dataset>
+void reportQuantization(const Network &network, const Dataset &calibrationData, const CsvDataset &testData, InferenceEngine &engine, int batchSize)
+{
+    QuantizedInferenceEngine quantizedEngine(network, calibrationData);
+    double floatSpeed = 0;
+    double quantizedSpeed = 0;
+    std::vector<int> floatOutputs;
+    std::vector<int> quantizedOutputs;
+    // best of a few passes, the first one warms the caches
+    for (int pass = 0; pass < 5; pass++)
+    {
+        double speed;
+        floatOutputs = scoreTestSet(engine, testData, batchSize, speed);
+        floatSpeed = std::max(floatSpeed, speed);
+        quantizedOutputs = scoreTestSet(quantizedEngine, testData, batchSize, speed);
+        quantizedSpeed = std::max(quantizedSpeed, speed);
+    }
+    int noFloatCorrect = 0;
+    int noQuantizedCorrect = 0;
+    int noAgreeing = 0;
+    for (int i = 0; i < testData.size(); i++)
+    {
+        noFloatCorrect += floatOutputs[i] == testData.label(i);
+        noQuantizedCorrect += quantizedOutputs[i] == testData.label(i);
+        noAgreeing += floatOutputs[i] == quantizedOutputs[i];
+    }
+    float noSamples = (float)testData.size();
+    std::cout << "Accuracy float32: " + std::to_string(noFloatCorrect / noSamples) + " (" + std::to_string((long)floatSpeed) + " samples/sec)" << std::endl;
+    std::cout << "Accuracy int8:    " + std::to_string(noQuantizedCorrect / noSamples) + " (" + std::to_string((long)quantizedSpeed) + " samples/sec)" << std::endl;
+    std::cout << "int8 agrees with float32 on " + std::to_string(noAgreeing / noSamples) + " of the test set, " +
+                     std::to_string(quantizedSpeed / floatSpeed) + "x the throughput"
+              << std::endl;
+}
 
-    std::vector<std::vector<Matrix<float>>> trainingData; // transform into format compatible with train fucntion in Network layer
+// train on a whole dataset (MappedDataset, CsvDataset) through a DataPipeline, or with noRanks > 1 data-parallel
+// over that many forked copies of this process (Network::trainDistributed), each on its own shard. only rank 0
+// returns, false if the data does not fit the network or a rank failed
+template <typename Dataset>
+bool trainOn(Network &network, Dataset &data, const std::string &fileName, float learnRate, int noEpochs, int batchSize, int noRanks)
+{
+    if (!network.matches(data))
+    {
+        std::cout << fileName + " does not match the network" << std::endl;
+        return false;
+    }
+    if (noRanks == 1)
+    {
+        // batches are shuffled every epoch and prefetched on a background thread
+        DataPipeline<Dataset> pipeline(data, batchSize);
+        return network.train(pipeline, learnRate, noEpochs);
+    }
 
-    //skip fieldname line in csv
-    for (int i = 1; i < (int) content.size(); i++)
+    std::string name = "/nn-train-" + std::to_string(getpid());
+    ProcessGroup group;
+    int rank = group.fork(noRanks);
+    if (rank < 0)
+    {
+        std::cout << "Could not start " + std::to_string(noRanks) + " processes" << std::endl;
+        return false;
+    }
+    SharedMemoryTransport transport;
+    bool joined = transport.open(name, rank, noRanks);
+    if (joined)
+    {
+        network.trainDistributed(data, transport, learnRate, noEpochs, batchSize);
+    }
+    if (rank != 0)
+    {
+        std::cout.flush();
+        _exit(joined ? 0 : 1);
+    }
+    if (!group.join() || !joined)
     {
-        entry = content[i];
+        std::cout << "Distributed training over " + std::to_string(noRanks) + " processes failed" << std::endl;
+        return false;
+    }
+    return true;
+}
 
-        std::vector<float> inputPixel(784);
-        std::vector<float> outputLabel(10);
-        outputLabel[std::stoi(entry[0])] = 1; // only correct label set to 1, rest set to 0
-        for (int j = 1; j < 784 + 1; j++)
+// usage: neural-network-scratch [--ranks <n>], n > 1 trains over n processes
+int main(int argc, char **argv)
+{
+    int noRanks = 1;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string(argv[i]) == "--ranks" && i + 1 < argc)
         {
-            inputPixel[j - 1] = std::stof(entry[j]) / 255; // normalize pixel input to have value [0, 1]
+            noRanks = std::max(1, std::atoi(argv[++i]));
+        }
+        else
+        {
+            std::cout << "Usage: neural-network-scratch [--ranks <n>]" << std::endl;
+            return 1;
         }
-        trainingData.push_back({Matrix<float>({784, 1}, inputPixel), Matrix<float>({10, 1}, outputLabel)});
     }
 
-    std::cout << "Training data processing completed" << std::endl;
+    int noEpochs = 5;
+    int batchSize = 16;
+    float learnRate = 0.001;
 
     // initiate a network with only 1 hidden layer that has 50 neurons
     std::vector<std::vector<int>> networkDimension = {
@@ -72,92 +138,104 @@ int main()
         {30, 10}};
 
     Network myNetwork = Network(networkDimension);
+    // Adam gets to the accuracy plain SGD (learn rate 0.015) reaches after 15 epochs in a third of them
+    myNetwork.setOptimizer(OptimizerSettings::adam());
+
+    // a profiling build prints its counters every second and saves a trace of the whole run
+    if (Profiler::enabled())
+    {
+        Profiler::setStatsInterval(1.0);
+        Profiler::setTracing(true);
+    }
 
     // randomize weights & biases for each epoch
 
     myNetwork.randomNetwork();
-    std::cout << "Running network" << std::endl;
 
-    // Heavy-lifting train function
-    myNetwork.trainThreaded(trainingData, learnRate, noEpochs, batchSize);
-    std::cout << "Still training" << std::endl;
-    content.clear();
+    // a saved model of this architecture skips training entirely, delete mnist_model.ckpt to retrain
+    bool trained = Checkpoint::load("mnist_model.ckpt", myNetwork);
 
-        // get test data entry by entry
-    std::fstream testFile("mnist_test.csv", std::ios::in);
-    if (testFile.is_open())
+    // a binary dataset made by nn-convert is mapped straight into memory, no parsing and no copy
+    // otherwise the csv is parsed in parallel, pixels normalized to have value [0, 1] and labels one-hot encoded
+    MappedDataset trainingSet;
+    CsvDataset trainingCsv;
+    if (trained)
     {
-        std::cout << "Reading test data" << std::endl;
-        while (std::getline(testFile, line))
+        std::cout << "Loaded model from mnist_model.ckpt" << std::endl;
+    }
+    else if (trainingSet.open("mnist_train.bin"))
+    {
+        std::cout << "Mapped " + std::to_string(trainingSet.size()) + " training entries" << std::endl;
+        std::cout << "Running network" << std::endl;
+        if (!trainOn(myNetwork, trainingSet, "mnist_train.bin", learnRate, noEpochs, batchSize, noRanks))
+        {
+            return 0;
+        }
+    }
+    else if (trainingCsv.load("mnist_train.csv", 10, 1.0f / 255))
+    {
+        std::cout << "Running network" << std::endl;
+
+        // Heavy-lifting train function
+        if (!trainOn(myNetwork, trainingCsv, "mnist_train.csv", learnRate, noEpochs, batchSize, noRanks))
         {
-            entry.clear();
-            std::stringstream str(line);
-            while (std::getline(str, word, ','))
-            {
-                entry.push_back(word);
-            }
-            content.push_back(entry);
+            return 0;
         }
-        testFile.close();
     }
     else
     {
         std::cout << "Could not open file" << std::endl;
         return 0;
     }
-    std::cout << "File reading completed" << std::endl;
-
-    std::cout << "Processing test data" << std::endl;
-
-    std::vector<std::vector<Matrix<float>>> testData; // transform into format compatible with train fucntion in Network layer
-
-    //skip fieldname line in csv
-    for (int i = 1; i < content.size(); i++)
+    std::cout << "Still training" << std::endl;
+    if (!trained && !Checkpoint::save(myNetwork, "mnist_model.ckpt"))
     {
-        entry = content[i];
+        std::cout << "Could not save model" << std::endl;
+    }
 
-        std::vector<float> inputPixel(784);
-        std::vector<float> outputLabel(10);
-        outputLabel[std::stoi(entry[0])] = 1; // only correct label set to 1, rest set to 0
-        for (int j = 1; j < 784 + 1; j++)
-        {
-            inputPixel[j - 1] = std::stof(entry[j]) / 255; // normalize pixel input to have value [0, 1]
-        }
-        testData.push_back({Matrix<float>({784, 1}, inputPixel), Matrix<float>({10, 1}, outputLabel)});
+    // get test data
+    CsvDataset testData;
+    if (!testData.load("mnist_test.csv", 10, 1.0f / 255))
+    {
+        std::cout << "Could not open file" << std::endl;
+        return 0;
+    }
+    if (!myNetwork.matches(testData))
+    {
+        std::cout << "mnist_test.csv does not match the network" << std::endl;
+        return 0;
     }
 
-    std::cout << "Test data processing completed" << std::endl;
+    // Network scores the test data in parallel mini-batches: accuracy, loss and per-class precision & recall
+    Evaluation evaluation = myNetwork.evaluate(testData);
+    std::cout << evaluation.toString();
 
-    // Network predicts test data and log accuracy
-    int noCorrect = 0;
-    for (int i = 0; i < testData.size(); i++)
-    {
-        Matrix<float> output = myNetwork.runNetwork(testData[i][0]).back();
-        int predictedOutput = 0;
-        for (int j = 1; j < output.noRows; j++)
-        {
-            if (output.get(j, 0) > output.get(predictedOutput, 0))
-            {
-                predictedOutput = j;
-            }
-        }
+    // inference-only copy of the network for the throughput comparison below
+    InferenceEngine engine(myNetwork);
+    const int scoringBatchSize = 1024;
 
-        int expectedOutput = 0;
-        for (int j = 1; j < testData[i][1].data.size(); j++)
-        {
-            if (testData[i][1].data[j] > testData[i][1].data[expectedOutput])
-            {
-                expectedOutput = j;
-            }
-        }
+    // int8 inference is calibrated on the training set, which a loaded model has not read yet
+    if (trainingSet.size() == 0 && trainingCsv.size() == 0 && !trainingSet.open("mnist_train.bin"))
+    {
+        trainingCsv.load("mnist_train.csv", 10, 1.0f / 255);
+    }
+    if (trainingSet.size() > 0 && myNetwork.matches(trainingSet))
+    {
+        reportQuantization(myNetwork, trainingSet, testData, engine, scoringBatchSize);
+    }
+    else if (trainingCsv.size() > 0 && myNetwork.matches(trainingCsv))
+    {
+        reportQuantization(myNetwork, trainingCsv, testData, engine, scoringBatchSize);
+    }
 
-        if (predictedOutput == expectedOutput)
+    if (Profiler::enabled())
+    {
+        std::cout << "stats " + Profiler::statsLine() << std::endl;
+        if (!Profiler::writeChromeTrace("nn_trace.json"))
         {
-            noCorrect++;
+            std::cout << "Could not save trace" << std::endl;
         }
-        std::cout << "Predicted: " + std::to_string(predictedOutput) + " Actual: " + std::to_string(expectedOutput) << std::endl;
     }
-    std::cout << "Accuracy: " + std::to_string((float)noCorrect / (float)testData.size()) << std::endl;
 
     return 0;
 }